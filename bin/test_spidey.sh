@@ -37,7 +37,7 @@ check_md5sum() {
 
 check_header() {
     status=$(head -n 1 $WORKSPACE/header | tr -d '\r\n')
-    content=$(awk '/Content/ { print $2 }' $WORKSPACE/header | tr -d '\r\n')
+    content=$(awk 'tolower($1) == "content-type:" { print $2 }' $WORKSPACE/header | tr -d '\r\n')
     if [ "$status" != "$1" ]; then
 	echo "FAILURE: $status != $1" > $WORKSPACE/test
 	return 1;
@@ -66,6 +66,24 @@ grep_count() {
     return 0;
 }
 
+pipeline() {
+    exec 3<>/dev/tcp/$1/$2 || return 1
+    printf "$3" >&3
+    timeout 10 cat <&3 > $WORKSPACE/test
+    exec 3<&-
+}
+
+start_server() {
+    ./bin/spidey -r www -p $LOCAL -l '' "$@" 2> /dev/null &
+    SERVER=$!
+    sleep 1
+}
+
+stop_server() {
+    kill $SERVER
+    wait $SERVER 2> /dev/null
+}
+
 check_hrefs() {
     if [ "$(sed -En 's/.*a href="([^"]+)".*/\1/p' $WORKSPACE/test | sort | paste -s -d ,)" != $1 ]; then
 	echo "FAILURE: hrefs != $1" > $WORKSPACE/test
@@ -115,7 +133,7 @@ printf "\n %-64s ... \n" "Handle Browse Requests"
 
 printf "     %-60s ... " "/"
 HREFS="/..,/html,/images,/scripts,/song.txt,/text"
-STATUS="HTTP/1.0 200 OK"
+STATUS="HTTP/1.1 200 OK"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/ > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all ".. html scripts text" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
@@ -149,7 +167,7 @@ fi
 sleep 1
 
 printf "     %-60s ... " "/scripts"
-HREFS="/scripts/..,/scripts/cowsay.sh,/scripts/env.sh,/scripts/hello.py"
+HREFS="/scripts/..,/scripts/cowsay.sh,/scripts/env.sh,/scripts/hello.fcgi,/scripts/hello.py,/scripts/sleep.sh"
 curl -s -D $WORKSPACE/header $HOST:$PORT/scripts > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all ".. cowsay.sh env.sh" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
     error "Failure"
@@ -177,13 +195,22 @@ else
     echo "Success"
 fi
 
+printf "     %-60s ... " "/text?format=json"
+CONTENT="application/json"
+curl -s -D $WORKSPACE/header "$HOST:$PORT/text?format=json" > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all '"hackers.txt" "lyrics.txt" "directory"' $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
 # ------------------------------------------------------------------------------
 
 printf "\n %-64s ... \n" "Handle File Requests"
 
 printf "     %-60s ... " "/html/index.html"
 MD5SUM=36fcc1da4afe58242350ee3940bb4220
-STATUS="HTTP/1.0 200 OK"
+STATUS="HTTP/1.1 200 OK"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/html/index.html > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all "Spidey html thumbnail" $WORKSPACE/test || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
@@ -292,6 +319,7 @@ sleep 1
 printf "\n %-64s ... \n" "Handle CGI Requests"
 
 printf "     %-60s ... " "/scripts/env.sh"
+STATUS="HTTP/1.0 200 OK"
 CONTENT="text/plain"
 HEADERS="DOCUMENT_ROOT QUERY_STRING REMOTE_ADDR REMOTE_PORT REQUEST_METHOD REQUEST_URI SCRIPT_FILENAME SERVER_PORT HTTP_HOST HTTP_USER_AGENT"
 curl -s -D $WORKSPACE/header $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
@@ -363,12 +391,233 @@ fi
 
 sleep 1
 
+printf "     %-60s ... " "/scripts/hello.py (POST user=pparker)"
+curl -s -D $WORKSPACE/header -d user=pparker $HOST:$PORT/scripts/hello.py > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "form input user Hello" $WORKSPACE/test || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/scripts/hello.fcgi?user=pparker"
+STATUS="HTTP/1.1 200 OK"
+curl -s -D $WORKSPACE/header "$HOST:$PORT/scripts/hello.fcgi?user=pparker" > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "form input user Hello" $WORKSPACE/test || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT" || ! grep_all "Content-Length X-Worker" $WORKSPACE/header; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/scripts/hello.fcgi (POST user=pparker)"
+curl -s -D $WORKSPACE/header -d user=pparker $HOST:$PORT/scripts/hello.fcgi > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "form input user Hello" $WORKSPACE/test || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/scripts/hello.fcgi /scripts/hello.fcgi (same worker)"
+curl -s -D $WORKSPACE/header -o /dev/null -o /dev/null $HOST:$PORT/scripts/hello.fcgi $HOST:$PORT/scripts/hello.fcgi
+if ! check_status $? 0 || [ "$(grep -c '^X-Worker' $WORKSPACE/header)" != 2 ] || [ "$(awk '/^X-Worker/ { print $2 }' $WORKSPACE/header | sort -u | wc -l)" != 1 ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Keep-Alive"
+
+printf "     %-60s ... " "/html/index.html /text/hackers.txt"
+curl -s -D $WORKSPACE/header -o /dev/null -o /dev/null -w '%{num_connects} ' $HOST:$PORT/html/index.html $HOST:$PORT/text/hackers.txt > $WORKSPACE/test
+if ! check_status $? 0 || [ "$(cat $WORKSPACE/test)" != "1 0 " ] || ! grep_all "Content-Length Connection:.keep-alive" $WORKSPACE/header; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "Connection: close"
+curl -s -D $WORKSPACE/header -o /dev/null -o /dev/null -w '%{num_connects} ' -H "Connection: close" $HOST:$PORT/html/index.html $HOST:$PORT/text/hackers.txt > $WORKSPACE/test
+if ! check_status $? 0 || [ "$(cat $WORKSPACE/test)" != "1 1 " ] || ! grep_all "Connection:.close" $WORKSPACE/header; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/song.txt /song.txt (POST user=pparker)"
+curl -s -D $WORKSPACE/header -o /dev/null -o /dev/null -w '%{num_connects} ' -d user=pparker $HOST:$PORT/song.txt $HOST:$PORT/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || [ "$(cat $WORKSPACE/test)" != "1 0 " ] || ! grep_all "Connection:.keep-alive" $WORKSPACE/header; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/scripts/hello.fcgi /song.txt (POST chunked)"
+curl -s -D $WORKSPACE/header -o /dev/null -o /dev/null -w '%{num_connects} ' -H "Transfer-Encoding: chunked" -d user=pparker $HOST:$PORT/scripts/hello.fcgi $HOST:$PORT/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || [ "$(cat $WORKSPACE/test)" != "1 0 " ] || ! grep_all "X-Worker Connection:.keep-alive" $WORKSPACE/header; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "Pipelined GET, POST, POST (chunked), GET"
+REQUESTS="GET /song.txt HTTP/1.1\r\nHost: $HOST\r\n\r\n"
+REQUESTS+="POST /song.txt HTTP/1.1\r\nHost: $HOST\r\nContent-Length: 13\r\n\r\nuser=pparker\n"
+REQUESTS+="POST /text/hackers.txt HTTP/1.1\r\nHost: $HOST\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nuser=\r\n7\r\npparker\r\n0\r\n\r\n"
+REQUESTS+="GET /html/index.html HTTP/1.1\r\nHost: $HOST\r\nConnection: close\r\n\r\n"
+pipeline $HOST $PORT "$REQUESTS"
+if ! check_status $? 0 || ! grep_count "^HTTP/1.1.200" 4 || ! grep_all "Right criminal Spidey Connection:.close" $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "Pipelined HEAD (file, gzip, range, listing, missing), GET"
+REQUESTS="HEAD /text/hackers.txt HTTP/1.1\r\nHost: $HOST\r\n\r\n"
+REQUESTS+="HEAD /text/hackers.txt HTTP/1.1\r\nHost: $HOST\r\nAccept-Encoding: gzip\r\n\r\n"
+REQUESTS+="HEAD /text/hackers.txt HTTP/1.1\r\nHost: $HOST\r\nRange: bytes=0-9\r\n\r\n"
+REQUESTS+="HEAD / HTTP/1.1\r\nHost: $HOST\r\n\r\n"
+REQUESTS+="HEAD /missing HTTP/1.1\r\nHost: $HOST\r\n\r\n"
+REQUESTS+="GET /song.txt HTTP/1.1\r\nHost: $HOST\r\nConnection: close\r\n\r\n"
+pipeline $HOST $PORT "$REQUESTS"
+if ! check_status $? 0 || ! grep_count "^HTTP/1.1.[24]0[046]" 6 || ! grep_count "Content-Length" 6 ||
+   ! grep_count "hackers\|list-group\|display-1" 0 || ! grep_all "deep.void Connection:.close" $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Conditional Requests"
+
+printf "     %-60s ... " "/text/hackers.txt If-None-Match"
+STATUS="HTTP/1.1 304 Not Modified"
+CONTENT=""
+ETAG=$(curl -s -D - -o /dev/null $HOST:$PORT/text/hackers.txt | awk 'tolower($1) == "etag:" { print $2 }' | tr -d '\r\n')
+curl -s -D $WORKSPACE/header -H "If-None-Match: $ETAG" $HOST:$PORT/text/hackers.txt > $WORKSPACE/test
+if ! check_status $? 0 || [ -z "$ETAG" ] || [ -s $WORKSPACE/test ] || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/text/hackers.txt If-Modified-Since"
+curl -s -D $WORKSPACE/header -H "If-Modified-Since: Fri, 01 Jan 2100 00:00:00 GMT" $HOST:$PORT/text/hackers.txt > $WORKSPACE/test
+if ! check_status $? 0 || [ -s $WORKSPACE/test ] || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/text/hackers.txt If-None-Match (changed)"
+MD5SUM=c77059544e187022e19b940d0c55f408
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/plain"
+curl -s -D $WORKSPACE/header -H 'If-None-Match: "stale"' $HOST:$PORT/text/hackers.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Range Requests"
+
+printf "     %-60s ... " "/text/hackers.txt bytes=0-99"
+MD5SUM=f020f4245ff147b237e0f10b40ba282f
+STATUS="HTTP/1.1 206 Partial Content"
+CONTENT="text/plain"
+curl -s -D $WORKSPACE/header -r 0-99 $HOST:$PORT/text/hackers.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT" || ! grep_all "Content-Range:.bytes.0-99/3738" $WORKSPACE/header; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/text/hackers.txt bytes=0-9,20-29,-5"
+CONTENT="multipart/byteranges;"
+curl -s -D $WORKSPACE/header -r 0-9,20-29,-5 $HOST:$PORT/text/hackers.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_count "Content-Range:" 3 || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/text/hackers.txt bytes=4000-"
+STATUS="HTTP/1.1 416 Range Not Satisfiable"
+CONTENT="text/plain"
+curl -s -D $WORKSPACE/header -r 4000- $HOST:$PORT/text/hackers.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_header "$STATUS" "$CONTENT" || ! grep_all "Content-Range:.bytes.\*/3738" $WORKSPACE/header; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Compressed Requests"
+
+printf "     %-60s ... " "/text/hackers.txt Accept-Encoding: gzip"
+MD5SUM=c77059544e187022e19b940d0c55f408
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/plain"
+curl -s -D $WORKSPACE/header -H 'Accept-Encoding: gzip' $HOST:$PORT/text/hackers.txt | gzip -dc > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT" || ! grep_all "Content-Encoding:.gzip" $WORKSPACE/header; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/text/hackers.txt Accept-Encoding: identity"
+curl -s -D $WORKSPACE/header -H 'Accept-Encoding: identity' $HOST:$PORT/text/hackers.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT" || grep -q "Content-Encoding" $WORKSPACE/header; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
 # ------------------------------------------------------------------------------
 
 printf "\n %-64s ... \n" "Handle Errors"
 
 printf "     %-60s ... " "/asdf"
-STATUS="HTTP/1.0 404 Not Found"
+STATUS="HTTP/1.1 404 Not Found"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/asdf > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all "404" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
@@ -400,3 +649,77 @@ if ! check_status $? 0 || ! grep_all "400" $WORKSPACE/test || ! check_header "$S
 else
     echo "Success"
 fi
+
+sleep 1
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Statistics"
+
+printf "     %-60s ... " "/__stats"
+STATUS="HTTP/1.1 200 OK"
+CONTENT="application/json"
+curl -s -D $WORKSPACE/header $HOST:$PORT/__stats > $WORKSPACE/test
+if ! check_status $? 0 || ! check_header "$STATUS" "$CONTENT" || ! grep_all '"requests":.[1-9] "404":.[1-9] "file":.{"count":.[1-9] "p999_us":' $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+# ------------------------------------------------------------------------------
+
+# The remaining sections start servers of their own (from this tree, on the
+# port after PORT), so they only run alongside a local build
+
+LOCAL=$((PORT + 1))
+
+if [ "$HOST" != localhost ] || [ ! -x ./bin/spidey ]; then
+    printf "\n %-64s ... Skipped\n" "Handle Concurrency Modes and CGI Limits"
+    exit
+fi
+
+printf "\n %-64s ... \n" "Handle Concurrency Modes"
+
+for MODE in "prefork 2" "threaded 2" "event 2"; do
+    printf "     %-60s ... " "-c $MODE"
+    start_server -c $MODE
+    curl -s -o /dev/null -o $WORKSPACE/test -w '%{num_connects} ' $HOST:$LOCAL/html/index.html $HOST:$LOCAL/scripts/env.sh > $WORKSPACE/header
+    if ! check_status $? 0 || [ "$(cat $WORKSPACE/header)" != "1 0 " ] || ! grep_all "REQUEST_METHOD SERVER_PORT=$LOCAL" $WORKSPACE/test ||
+       ! pipeline $HOST $LOCAL "GET /song.txt HTTP/1.1\r\nHost: $HOST\r\n\r\nGET /song.txt HTTP/1.1\r\nHost: $HOST\r\nConnection: close\r\n\r\n" ||
+       ! grep_count "^HTTP/1.1.200" 2; then
+	error "Failure"
+    else
+	echo "Success"
+    fi
+    stop_server
+done
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle CGI Limits"
+
+start_server -c threaded 4 -n 1 -t 2
+
+printf "     %-60s ... " "/scripts/sleep.sh?5 (-t 2)"
+START=$(date +%s)
+curl -s -m 10 $HOST:$LOCAL/scripts/sleep.sh?5 > $WORKSPACE/test
+if [ $(($(date +%s) - START)) -ge 4 ] || grep -q Slept $WORKSPACE/test; then
+    echo "FAILURE: script was not killed after 2 seconds" > $WORKSPACE/test
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/scripts/sleep.sh?1 twice at once (-n 1)"
+START=$(date +%s%N)
+curl -s $HOST:$LOCAL/scripts/sleep.sh?1 > $WORKSPACE/header &
+curl -s $HOST:$LOCAL/scripts/sleep.sh?1 > $WORKSPACE/test
+wait $!
+if [ $((($(date +%s%N) - START) / 1000000)) -lt 2000 ] || ! grep -q Slept $WORKSPACE/header || ! grep -q Slept $WORKSPACE/test; then
+    echo "FAILURE: scripts did not run one at a time" > $WORKSPACE/test
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_server
@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+
+import collections
+import json
+import os
+import sys
+
+# Functions
+
+def usage(status=0):
+    progname = os.path.basename(sys.argv[0])
+    print(f'''Usage: {progname} [-x PHASE] TRACE
+    -x  PHASE       Leave out a phase (and time spent in it), e.g. accept
+    ''')
+    sys.exit(status)
+
+def load_events(path):
+    ''' Load complete ("X") events from a trace written by spidey -T.
+
+    The file is in the JSON Array Format, which may end in a trailing comma
+    and lack its closing bracket (as it does while spidey is still running).
+    '''
+    with open(path) as stream:
+        text = stream.read().rstrip().rstrip(',')
+    if not text.endswith(']'):
+        text += ']'
+    return [event for event in json.loads(text) if event.get('ph') == 'X']
+
+def self_times(events):
+    ''' Attribute time to the innermost phase running on each thread.
+
+    Returns a list of (event, self time) pairs: the event's duration minus
+    the time spent in the phases nested inside it.
+    '''
+    threads = collections.defaultdict(list)
+    for event in events:
+        threads[(event['pid'], event['tid'])].append(event)
+
+    pairs = []
+    for thread in threads.values():
+        thread.sort(key=lambda event: (event['ts'], -event['dur']))
+        stack = []
+        for event in thread:
+            while stack and stack[-1][0]['ts'] + stack[-1][0]['dur'] <= event['ts']:
+                pairs.append(tuple(stack.pop()))
+            if stack:
+                stack[-1][1] -= event['dur']
+            stack.append([event, event['dur']])
+        pairs.extend(tuple(entry) for entry in stack)
+    return pairs
+
+def percentile(values, fraction):
+    ''' Return the value below which a fraction of the (sorted) values fall '''
+    return values[min(len(values) - 1, int(fraction * len(values)))]
+
+def summarize(pairs):
+    ''' Print a per-phase breakdown, phases taking the most time first '''
+    phases = collections.defaultdict(lambda: {'durations': [], 'self': 0.0})
+    for event, own in pairs:
+        phases[event['name']]['durations'].append(event['dur'])
+        phases[event['name']]['self'] += own
+
+    overall = sum(phase['self'] for phase in phases.values()) or 1.0
+
+    print('{:<24} {:>7} {:>11} {:>6} {:>10} {:>10} {:>10} {:>10}'.format(
+        'Phase', 'Count', 'Self (ms)', 'Self%', 'Mean (us)', 'p50 (us)', 'p99 (us)', 'Max (us)'))
+    for name, phase in sorted(phases.items(), key=lambda item: -item[1]['self']):
+        durations = sorted(phase['durations'])
+        print('{:<24} {:>7} {:>11.3f} {:>5.1f}% {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f}'.format(
+            name, len(durations), phase['self'] / 1000, 100 * phase['self'] / overall,
+            sum(durations) / len(durations), percentile(durations, 0.5),
+            percentile(durations, 0.99), durations[-1]))
+
+def main():
+    excluded = set()
+    arguments = sys.argv[1:]
+
+    while arguments and arguments[0].startswith('-'):
+        argument = arguments.pop(0)
+        if argument == '-x' and arguments:
+            excluded.add(arguments.pop(0))
+        elif argument == '-h':
+            usage(0)
+        else:
+            usage(1)
+
+    if len(arguments) != 1:
+        usage(1)
+
+    pairs = [pair for pair in self_times(load_events(arguments[0])) if pair[0]['name'] not in excluded]
+    if not pairs:
+        print('No events in trace')
+        sys.exit(1)
+
+    summarize(pairs)
+
+# Main execution
+
+if __name__ == '__main__':
+    main()
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -3,10 +3,13 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <netdb.h>
+#include <semaphore.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 /* Constants */
@@ -19,15 +22,44 @@
 typedef enum {
     SINGLE,                             /**< Single connection */
     FORKING,                            /**< Process per connection */
+    EVENT,                              /**< Event loop over all connections */
+    PREFORK,                            /**< Pool of pre-forked processes */
+    THREADED,                           /**< Pool of worker threads */
     UNKNOWN
 } ServerMode;
 
-/* Global Variables */
+/* Global Variables
+ *
+ * These are only written while parsing options and starting up in main, before
+ * any worker process or thread exists.  Afterwards they are read-only, which is
+ * what makes it safe for worker threads to share them without locking.  Their
+ * defaults live in config.c, which the server, benchmark and tests all link.
+ */
 
 extern char *Port;                      /**< Port number */
 extern char *MimeTypesPath;             /**< Path to mime.types file */
 extern char *DefaultMimeType;           /**< Default file mimetype */
 extern char *RootPath;                  /**< Path to root directory */
+extern size_t Workers;                  /**< Number of pool workers (0 = CPUs) */
+extern bool Sharded;                    /**< One SO_REUSEPORT socket per pinned worker */
+extern int  KeepAliveTimeout;           /**< Idle seconds before closing (0 = off) */
+extern size_t KeepAliveMax;             /**< Maximum requests per connection */
+extern bool SendFile;                   /**< Send static files with sendfile(2) */
+extern size_t CacheEntries;             /**< Size of file metadata cache (0 = off) */
+extern size_t ContentBudget;            /**< Bytes of hot file contents to cache (0 = off) */
+extern size_t MmapThreshold;            /**< Smallest file to send from a shared mapping (0 = off) */
+extern bool Compress;                   /**< Compress text responses clients accept compressed */
+extern size_t FastCGIWorkers;           /**< FastCGI workers per .fcgi executable (0 = run as CGI) */
+extern size_t MemoBudget;               /**< Bytes of CGI responses to keep (0 = off) */
+extern char *MemoHeaders;               /**< Request headers CGI responses vary on (comma-separated) */
+extern size_t CGIProcesses;             /**< CGI scripts running at once, over all processes (0 = no limit) */
+extern int  CGITimeout;                 /**< Seconds before a CGI script is killed (0 = no limit) */
+extern int  CGICPULimit;                /**< CPU seconds a CGI script may use (0 = no limit) */
+extern char *AccessLog;                 /**< Path to access journal ("-" = stderr, "" = off) */
+extern char *StatsURI;                  /**< URI of the statistics page ("" = off) */
+#ifdef TRACE
+extern char *TracePath;                 /**< Path to write trace events to */
+#endif
 
 /* Logging Macros */
 
@@ -40,6 +72,276 @@ extern char *RootPath;                  /**< Path to root directory */
 #define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
 #define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
 
+/* Request Tracing
+ *
+ * Only built with make TRACE=1; otherwise these compile to nothing.
+ * trace_scope times the rest of the enclosing block, and trace_start and
+ * trace_stop time a stretch of code within one.
+ */
+
+#ifdef TRACE
+typedef struct {
+    const char *name;                   /*< Name of phase */
+    uint64_t    start;                  /*< When the span opened (monotonic ns) */
+} TraceSpan;
+
+bool	    trace_open(const char *path);
+TraceSpan   trace_begin(const char *name);
+void	    trace_end(TraceSpan *span);
+
+#define trace_scope(name)       TraceSpan trace_span __attribute__((cleanup(trace_end))) = trace_begin(name)
+#define trace_start(span, name) TraceSpan span = trace_begin(name)
+#define trace_stop(span)        trace_end(&span)
+#else
+#define trace_scope(name)
+#define trace_start(span, name)
+#define trace_stop(span)
+#endif
+
+/* HTTP Request Parser */
+
+#define PARSER_MAX_HEADERS  64
+
+typedef struct {
+    size_t  offset;                     /*< Offset from start of request */
+    size_t  length;                     /*< Length of slice */
+} Slice;
+
+typedef enum {
+    PARSER_REQUEST_LINE = 0,            /**< Expecting request line */
+    PARSER_HEADERS,                     /**< Expecting header or blank line */
+    PARSER_DONE,                        /**< Request head complete */
+    PARSER_ERROR,                       /**< Request malformed */
+} ParserState;
+
+enum {
+    PARSE_ERROR      = -1,
+    PARSE_INCOMPLETE = 0,
+    PARSE_COMPLETE   = 1,
+};
+
+typedef struct {
+    ParserState state;                  /*< Current parser state */
+    size_t  line;                       /*< Offset of current line */
+    size_t  cursor;                     /*< Offset to resume scanning from */
+    size_t  length;                     /*< Length of complete request head */
+
+    Slice   method;                     /*< HTTP method */
+    Slice   uri;                        /*< HTTP uniform resource identifier */
+    Slice   query;                      /*< HTTP query string */
+    Slice   version;                    /*< HTTP version */
+
+    Slice   names[PARSER_MAX_HEADERS];  /*< Header names */
+    Slice   values[PARSER_MAX_HEADERS]; /*< Header data */
+    size_t  nheaders;                   /*< Number of headers */
+} Parser;
+
+void        parser_init(Parser *p);
+int         parser_parse(Parser *p, const char *data, size_t length);
+char *      parser_string(char *data, Slice slice);
+
+/* Arena Allocator */
+
+#define ARENA_SIZE      (BUFSIZ)
+#define ARENA_ALIGNMENT 16
+
+typedef struct arena_block ArenaBlock;
+struct arena_block {
+    ArenaBlock *next;                   /*< Next overflow block */
+    char        data[] __attribute__((aligned(ARENA_ALIGNMENT)));
+};
+
+typedef struct {
+    char       *data;                   /*< Block being carved */
+    size_t      size;                   /*< Size of block being carved */
+    size_t      used;                   /*< Bytes carved from block */
+    ArenaBlock *blocks;                 /*< Overflow blocks (freed on reset) */
+    char        initial[ARENA_SIZE] __attribute__((aligned(ARENA_ALIGNMENT)));
+} Arena;
+
+void	    arena_init(Arena *a);
+void *	    arena_alloc(Arena *a, size_t size);
+void *	    arena_calloc(Arena *a, size_t size);
+char *	    arena_strdup(Arena *a, const char *s);
+void	    arena_reset(Arena *a);
+
+/* HTTP Connection */
+
+#define CONNECTION_BUFFER_SIZE  (2*BUFSIZ)
+#define CONNECTION_OUTPUT_SIZE  (2*BUFSIZ)
+
+typedef struct connection_segment ConnectionSegment;
+struct connection_segment {
+    int     fd;                         /*< File to send from (-1 for data) */
+    off_t   offset;                     /*< Offset of next byte to send (in file or data) */
+    off_t   length;                     /*< Bytes left to send */
+    ConnectionSegment *next;            /*< Next segment in queue */
+    char    data[];                     /*< Copy of data to send (if not from a file) */
+};
+
+typedef struct {
+    int     fd;                         /*< Client socket file descripter */
+    FILE    *stream;                    /*< Client socket stream (responses) */
+    char     output[CONNECTION_OUTPUT_SIZE];    /*< Buffered responses */
+
+    char     host[NI_MAXHOST];          /*< Host name of client */
+    char     port[NI_MAXSERV];          /*< Port number of client */
+
+    char     buffer[CONNECTION_BUFFER_SIZE];    /*< Buffered client input */
+    size_t   offset;                    /*< Start of unconsumed input */
+    size_t   length;                    /*< End of buffered input */
+    Parser   parser;                    /*< Parser for request at offset */
+    Arena    arena;                     /*< Memory for the current request */
+
+    size_t   nrequests;                 /*< Number of requests handled */
+    off_t    sent;                      /*< Bytes written to the client socket */
+    bool     corked;                    /*< TCP_CORK set until next flush */
+    bool     discarding;                /*< Drop output (the body of a HEAD response) */
+
+    bool     nonblocking;               /*< Client socket is non-blocking (see connection_nonblock) */
+    bool     queueing;                  /*< Queue output the socket cannot take instead of waiting */
+    ConnectionSegment *queue;           /*< Output waiting for the socket (see connection_drain) */
+    ConnectionSegment *queue_tail;      /*< Last segment in queue */
+} Connection;
+
+Connection *accept_connection(int sfd);
+void	    free_connection(Connection *c);
+ssize_t	    connection_fill(Connection *c, bool block);
+bool	    connection_ready(Connection *c);
+bool	    connection_flush(Connection *c);
+off_t	    connection_sendfile(Connection *c, int fd, off_t offset, off_t length);
+off_t	    connection_write(Connection *c, const char *data, off_t length);
+off_t	    connection_sent(Connection *c);
+void	    connection_discard(Connection *c, bool discard);
+bool	    connection_nonblock(Connection *c);
+bool	    connection_queued(Connection *c);
+bool	    connection_drain(Connection *c);
+bool	    handle_requests(Connection *c, bool eof);
+size_t	    handle_connection(Connection *c);
+
+/* Refcounted LRU Hash Tables */
+
+typedef struct lru_node LRUNode;
+struct lru_node {
+    size_t      hash;                   /*< Hash of the entry's key */
+    size_t      cost;                   /*< What the entry counts against the table's total */
+    size_t      refs;                   /*< Table reference plus one per user */
+    LRUNode    *prev, *next;            /*< LRU list (most recently used first) */
+    LRUNode    *chain;                  /*< Next node in hash bucket (or list of evicted nodes) */
+};
+
+typedef struct {
+    LRUNode   **buckets;                /*< Hash buckets (a power of two) */
+    size_t      mask;                   /*< Number of buckets minus one */
+    LRUNode    *head;                   /*< Most recently used node */
+    LRUNode    *tail;                   /*< Least recently used node */
+    size_t      count;                  /*< Number of nodes */
+    size_t      total;                  /*< Sum of the nodes' costs */
+} LRUTable;
+
+/* Entries embed an LRUNode as their first member */
+#define lru_entry(node, type)   ((type *)(node))
+
+/* Statically set up a table over an array of (a power of two) buckets */
+#define LRU_TABLE(array)        { .buckets = (array), .mask = sizeof(array) / sizeof(LRUNode *) - 1 }
+
+bool	    lru_init(LRUTable *table, size_t nbuckets);
+LRUNode *   lru_chain(LRUTable *table, size_t hash);
+void	    lru_insert(LRUTable *table, LRUNode *node);
+bool	    lru_remove(LRUTable *table, LRUNode *node);
+void	    lru_discard(LRUTable *table, LRUNode *node, LRUNode **evicted);
+void	    lru_touch(LRUTable *table, LRUNode *node);
+void	    lru_evict(LRUTable *table, size_t budget, LRUNode **evicted);
+
+/* File Metadata Cache */
+
+#define CACHE_TTL   2                   /* Seconds before an entry is re-resolved */
+
+typedef enum {
+    CACHE_DIRECTORY,                    /**< Browse request */
+    CACHE_EXECUTABLE,                   /**< CGI request */
+    CACHE_READABLE,                     /**< File request */
+    CACHE_UNREADABLE,                   /**< None of the above */
+    CACHE_MISSING,                      /**< Nothing there (or outside RootPath) */
+} CacheKind;
+
+typedef struct cache_entry CacheEntry;
+struct cache_entry {
+    LRUNode     node;                   /*< Hash table and LRU links (first, see lru_entry) */
+    CacheKind   kind;                   /*< How to handle the resource */
+    struct stat st;                     /*< stat(2) of the resource */
+    int         fd;                     /*< Open descriptor (regular readable files, else -1) */
+    char       *path;                   /*< Real path of the resource */
+    char       *uri;                    /*< URI the entry is cached under */
+    char        etag[64];               /*< ETag (regular files) */
+    char        modified[32];           /*< Last-Modified date (regular files) */
+
+    time_t      loaded;                 /*< When the entry was resolved */
+};
+
+CacheEntry *cache_lookup(Connection *c, const char *uri);
+void	    cache_release(CacheEntry *entry);
+void	    cache_stats(size_t *hits, size_t *misses);
+void	    cache_report(void);
+
+/* Shared File Mappings */
+
+#define MAPPING_BUDGET  (256 << 20)     /* Bytes mapped at most */
+#define MAPPING_IDLE    10              /* Seconds an unused mapping is kept */
+#define MAPPING_CHUNK   (1 << 20)       /* Bytes written (and read ahead) at a time */
+
+off_t	    mapping_send(Connection *c, CacheEntry *file, off_t offset, off_t length);
+void	    mapping_stats(size_t *hits, size_t *misses, size_t *bytes);
+
+/* Hot Content Cache */
+
+typedef struct request Request;
+
+bool	    content_respond(Request *r, const char *mimetype, const char *extra);
+void	    content_stats(size_t *hits, size_t *misses, size_t *rejected, size_t *bytes);
+
+/* Directory Listings */
+
+#define LISTING_BUDGET  (4 << 20)       /* Bytes of rendered listings cached */
+#define LISTING_CHUNK   4096            /* Entries kept (and streamed) at a time */
+
+typedef enum {
+    LISTING_HTML = 0,                   /**< text/html for browsers */
+    LISTING_JSON,                       /**< application/json for machine clients */
+} ListingFormat;
+
+typedef struct {
+    const char *body;                   /*< Rendered listing (NULL if streamed) */
+    size_t      length;                 /*< Length of body */
+    void       *entry;                  /*< Cache entry holding body */
+} Listing;
+
+ListingFormat listing_format(Request *request);
+bool	    listing_acquire(Request *request, ListingFormat format, Listing *listing);
+void	    listing_release(Listing *listing);
+bool	    listing_stream(Request *request, ListingFormat format, bool chunked);
+void	    listing_stats(size_t *hits, size_t *misses, size_t *streamed, size_t *bytes);
+
+/* Access Journal */
+
+typedef struct {
+    time_t   time;                      /*< When the request started (wall clock) */
+    uint64_t started;                   /*< When the request started (monotonic ns) */
+    off_t    bytes;                     /*< Bytes of response sent */
+    uint32_t latency;                   /*< Microseconds spent handling the request */
+    uint16_t status;                    /*< HTTP status code */
+    uint8_t  version;                   /*< HTTP minor version (HTTP/1.x) */
+    char     method[8];                 /*< HTTP method (truncated) */
+    char     host[46];                  /*< Host name of client (truncated) */
+    char     uri[171];                  /*< HTTP URI (truncated, to fill 256 bytes) */
+} JournalRecord;
+
+bool	    journal_open(const char *path);
+void	    journal_begin(JournalRecord *record, Connection *c);
+void	    journal_request(Request *request);
+void	    journal_end(JournalRecord *record, Connection *c, int status);
+void	    journal_stats(size_t *written, size_t *dropped);
+
 /* HTTP Request */
 
 typedef struct header Header;
@@ -49,52 +351,247 @@ struct header {
     Header  *next;                      /*< Next header entry */
 };
 
+typedef enum {
+    BODY_NONE,                          /**< Nothing (left) to read */
+    BODY_LENGTH,                        /**< Content-Length bytes */
+    BODY_CHUNK_SIZE,                    /**< Chunked: expecting a chunk-size line */
+    BODY_CHUNK_DATA,                    /**< Chunked: inside a chunk */
+    BODY_CHUNK_END,                     /**< Chunked: expecting CRLF after a chunk */
+    BODY_TRAILERS,                      /**< Chunked: expecting trailers or blank line */
+    BODY_CUT,                           /**< Cut short (the connection cannot be reused) */
+} RequestBodyState;
+
 typedef struct {
-    int     fd;                         /*< Client socket file descripter */
-    FILE    *stream;                    /*< Client socket file stream */
+    RequestBodyState state;             /*< What is expected next */
+    off_t   remaining;                  /*< Bytes left in body or chunk */
+} RequestBody;
+
+struct request {
+    Connection *connection;             /*< Connection request arrived on */
     char    *method;                    /*< HTTP method */
     char    *uri;                       /*< HTTP uniform resource identifier */
     char    *path;                      /*< Real path corrsponding to URI and RootPath */
+    CacheEntry *file;                   /*< Cached metadata for path */
     char    *query;                     /*< HTTP query string */
-
-    char     host[NI_MAXHOST];          /*< Host name of client */
-    char     port[NI_MAXSERV];          /*< Port number of client */
+    int      version;                   /*< HTTP minor version (HTTP/1.x) */
+    bool     keep_alive;                /*< Keep connection open after response */
+    JournalRecord *access;              /*< Access journal record (or NULL) */
+    RequestBody body;                   /*< Framing of the request body (see request_body_next) */
 
     Header  *headers;                   /*< List of name, data Header pairs */
-} Request;
+};
 
-Request *   accept_request(int sfd);
+Request *   create_request(Connection *c);
 void	    free_request(Request *request);
 int	    parse_request(Request *request);
+const char *request_header(Request *request, const char *name);
+void	    request_body_init(Request *request, RequestBody *body);
+const char *request_body_next(Request *request, RequestBody *body, size_t *length);
+void	    request_body_consume(Request *request, RequestBody *body, size_t length);
+bool	    request_body_skip(Request *request);
+void	    request_headers_end(Request *request);
+
+/* CGI Response Memos */
+
+#define MEMO_MAX_SIZE   (1 << 20)       /* Largest response worth keeping */
+
+typedef struct {
+    char   *key;                        /*< Script, query and varied headers (NULL if not kept) */
+    size_t  klength;                    /*< Length of key */
+    char   *output;                     /*< Output captured so far */
+    size_t  length;                     /*< Length of output */
+    size_t  capacity;                   /*< Bytes allocated for output */
+} Memo;
+
+bool	    memo_respond(Request *request, Memo *memo);
+void	    memo_append(Memo *memo, const char *data, size_t length);
+void	    memo_finish(Memo *memo, bool complete);
+void	    memo_stats(size_t *hits, size_t *misses, size_t *stored, size_t *bytes);
+
+/* CGI Processes */
+
+#define CGI_QUEUE_MAX   64              /* Requests that may wait for a script slot */
+#define CGI_QUEUE_WAIT  5               /* Seconds a request waits before it is shed */
+
+char **	    cgi_environment(Request *request);
+pid_t	    cgi_spawn(Request *request, int *input, int *output);
+off_t	    cgi_relay(Request *request, pid_t pid, int input, int output, Memo *memo);
+bool	    cgi_init(void);
+bool	    cgi_acquire(void);
+void	    cgi_release(void);
+void	    cgi_stats(size_t *running, size_t *queued, size_t *peak, size_t *shed, size_t *killed);
+
+/* FastCGI Worker Pools */
+
+typedef struct {
+    void   *pool;                       /*< Pool of the executable */
+    size_t  slot;                       /*< Slot of the worker in its pool */
+    int     fd;                         /*< Connection to the worker */
+} FastCGIWorker;
+
+bool	    fastcgi_init(void);
+void	    fastcgi_stop(void);
+bool	    fastcgi_handles(Request *request);
+bool	    fastcgi_acquire(Request *request, FastCGIWorker *worker);
+void	    fastcgi_release(FastCGIWorker *worker);
+off_t	    fastcgi_relay(Request *request, FastCGIWorker *worker);
+void	    fastcgi_stats(size_t *requests, size_t *started, size_t *waited, size_t *failed);
 
 /* HTTP Request Handlers */
 
 typedef enum {
     HTTP_STATUS_OK = 0,			/* 200 OK */
+    HTTP_STATUS_PARTIAL_CONTENT,	/* 206 Partial Content */
+    HTTP_STATUS_NOT_MODIFIED,		/* 304 Not Modified */
     HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
     HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
+    HTTP_STATUS_RANGE_NOT_SATISFIABLE,	/* 416 Range Not Satisfiable */
     HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_SERVICE_UNAVAILABLE,	/* 503 Service Unavailable */
 } Status;
 
 Status      handle_request(Request *request);
+bool        request_blocks(Connection *c);
+
+/* Server Statistics */
+
+typedef enum {
+    STATS_CACHE_FILE,                   /**< File metadata cache */
+    STATS_CACHE_CONTENT,                /**< Hot content cache */
+    STATS_CACHE_LISTING,                /**< Directory listings */
+    STATS_CACHE_ENCODING,               /**< Compressed files */
+    STATS_CACHE_MEMO,                   /**< CGI responses */
+    STATS_CACHES
+} StatsCache;
+
+typedef enum {
+    STATS_SPAWN_CGI,                    /**< CGI script */
+    STATS_SPAWN_FASTCGI,                /**< FastCGI worker */
+    STATS_SPAWNS
+} StatsSpawn;
+
+bool	    stats_init(void);
+void	    stats_connection(int delta);
+void	    stats_cache(StatsCache cache, bool hit);
+void	    stats_spawn(StatsSpawn spawn);
+void	    stats_request(Request *request, Status status, const JournalRecord *record);
+char *	    stats_render(size_t *length);
+void	    stats_watch(void);
+
+/* HTTP Range Requests */
+
+#define RANGE_MAX   16                  /* Ranges honored per request (more are ignored) */
+
+typedef struct {
+    off_t   first;                      /*< First byte of range */
+    off_t   last;                       /*< Last byte of range (inclusive) */
+} Range;
+
+ssize_t	    range_parse(const char *spec, off_t size, Range *ranges, size_t nranges);
+
+/* HTTP Content Encoding */
+
+#define ENCODING_BUDGET     (8 << 20)   /* Bytes of compressed files cached */
+#define ENCODING_MAX_SIZE   (4 << 20)   /* Largest file compressed on the fly */
+
+typedef enum {
+    ENCODING_IDENTITY = 0,              /**< As is */
+    ENCODING_GZIP,                      /**< gzip format */
+    ENCODING_DEFLATE,                   /**< zlib format */
+} Encoding;
+
+typedef struct {
+    const char *body;                   /*< Compressed contents */
+    off_t       length;                 /*< Length of body */
+    char        etag[80];               /*< ETag of compressed contents */
+    void       *entry;                  /*< Cache entry holding body */
+} Encoded;
+
+Encoding    encoding_negotiate(Request *request, const char *mimetype);
+bool	    encoding_vary(const char *mimetype);
+const char *encoding_name(Encoding encoding);
+bool	    encoding_acquire(Request *request, Encoding encoding, Encoded *encoded);
+void	    encoding_release(Encoded *encoded);
+void	    encoding_stats(size_t *hits, size_t *misses, double *ratio, size_t *bytes);
+
+/* HTTP Conditional Requests */
+
+void	    conditional_validators(CacheEntry *entry);
+bool	    conditional_not_modified(Request *request, const char *etag);
+bool	    conditional_range(Request *request);
 
 /* HTTP Server */
 
 int         single_server(int sfd);
 int         forking_server(int sfd);
+int         event_server(int sfd, size_t nworkers);
+int         prefork_server(int sfd, size_t nworkers);
+int         threaded_server(int sfd, size_t nworkers);
+
+/* Queue */
+
+typedef struct {
+    size_t  sequence;                   /*< Lap marker for producers/consumers */
+    void   *data;                       /*< Queued element */
+} QueueCell;
+
+typedef struct {
+    QueueCell  *cells;                  /*< Ring of queue cells */
+    size_t      mask;                   /*< Capacity - 1 (capacity is a power of 2) */
+    size_t      head __attribute__((aligned(64)));  /*< Next position to pop */
+    size_t      tail __attribute__((aligned(64)));  /*< Next position to push */
+    sem_t       items;                  /*< Number of published elements */
+    sem_t       slots;                  /*< Number of free cells */
+} Queue;
+
+Queue *     queue_create(size_t capacity);
+void        queue_delete(Queue *q);
+bool        queue_try_push(Queue *q, void *data);
+bool        queue_try_pop(Queue *q, void **data);
+void        queue_push(Queue *q, void *data);
+void *      queue_pop(Queue *q);
+bool        queue_offer(Queue *q, void *data);
+bool        queue_poll(Queue *q, void **data);
 
 /* Socket */
 
-int	    socket_listen(const char *port);
+int	    socket_listen(const char *port, bool reuseport);
+int *	    socket_shards(int sfd, size_t nshards);
+int	    socket_shard_cpu(size_t shard);
+int	    socket_pin_cpu(int cpu);
+
+/* Mime Types */
+
+int	    mime_load(void);
+bool	    mime_reload(void);
+void	    mime_watch(void);
+void	    mime_begin(void);
+void	    mime_end(void);
+const char *mime_lookup(const char *extension);
+
+/* Character Class Scanning */
+
+typedef struct {
+    const char *name;                                   /**< Kernel name */
+    size_t (*blank)(const char *s, size_t n);           /**< Offset of first ' ' or '\t' */
+    size_t (*nonblank)(const char *s, size_t n);        /**< Offset of first non-blank */
+} ScanKernel;
+
+extern const ScanKernel  ScanKernels[];
+extern const ScanKernel *Scan;
+
+bool	    scan_supported(const ScanKernel *kernel);
 
 /* Utilities */
 
 #define chomp(s)    (s)[strlen(s) - 1] = '\0'
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
-char *	    determine_mimetype(const char *path);
-char *	    determine_request_path(const char *uri);
+const char *determine_mimetype(const char *path);
+char *	    determine_request_path(Arena *arena, const char *uri);
 const char *http_status_string(Status status);
+size_t	    hash_bytes(const void *data, size_t length);
+size_t	    hash_string(const char *s);
 char *	    skip_nonwhitespace(char *s);
 char *	    skip_whitespace(char *s);
 
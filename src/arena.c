@@ -0,0 +1,110 @@
+/* arena.c: Bump-Pointer Arena Allocator */
+
+#include "spidey.h"
+
+#include <string.h>
+
+/* Internal Functions */
+
+static inline size_t arena_align(size_t size) {
+    return (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+}
+
+/* Functions */
+
+/**
+ * Initialize arena to carve from its initial block.
+ *
+ * @param   a           Arena structure.
+ **/
+void arena_init(Arena *a) {
+    a->data   = a->initial;
+    a->size   = sizeof(a->initial);
+    a->used   = 0;
+    a->blocks = NULL;
+}
+
+/**
+ * Allocate memory from arena.
+ *
+ * @param   a           Arena structure.
+ * @param   size        Number of bytes to allocate.
+ * @return  Pointer to allocated (uninitialized) memory or NULL on failure.
+ *
+ * Allocations are carved from the current block by bumping a pointer.  When
+ * the block is exhausted, a new block (at least ARENA_SIZE bytes) is malloc'd
+ * and carving continues there.  Memory is never freed individually; it is all
+ * released at once by arena_reset.
+ **/
+void * arena_alloc(Arena *a, size_t size) {
+    size = arena_align(size ? size : 1);
+
+    if (size > a->size - a->used) {
+        size_t bsize = size > ARENA_SIZE ? size : ARENA_SIZE;
+        ArenaBlock *block = malloc(sizeof(ArenaBlock) + bsize);
+        if (!block) {
+            return NULL;
+        }
+
+        block->next = a->blocks;
+        a->blocks   = block;
+        a->data     = block->data;
+        a->size     = bsize;
+        a->used     = 0;
+    }
+
+    void *p = a->data + a->used;
+    a->used += size;
+    return p;
+}
+
+/**
+ * Allocate zeroed memory from arena.
+ *
+ * @param   a           Arena structure.
+ * @param   size        Number of bytes to allocate.
+ * @return  Pointer to allocated (zeroed) memory or NULL on failure.
+ **/
+void * arena_calloc(Arena *a, size_t size) {
+    void *p = arena_alloc(a, size);
+    if (p) {
+        memset(p, 0, size);
+    }
+    return p;
+}
+
+/**
+ * Copy string into arena.
+ *
+ * @param   a           Arena structure.
+ * @param   s           String to copy.
+ * @return  Copy of string allocated from arena or NULL on failure.
+ **/
+char * arena_strdup(Arena *a, const char *s) {
+    size_t length = strlen(s) + 1;
+    char  *copy   = arena_alloc(a, length);
+    if (copy) {
+        memcpy(copy, s, length);
+    }
+    return copy;
+}
+
+/**
+ * Release everything allocated from arena.
+ *
+ * @param   a           Arena structure.
+ *
+ * Overflow blocks are freed and carving starts over at the beginning of the
+ * initial block, so an arena that stays within ARENA_SIZE never calls malloc.
+ **/
+void arena_reset(Arena *a) {
+    while (a->blocks) {
+        ArenaBlock *next = a->blocks->next;
+        free(a->blocks);
+        a->blocks = next;
+    }
+
+    arena_init(a);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
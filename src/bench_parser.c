@@ -0,0 +1,124 @@
+/* bench_parser.c: HTTP Request Parser Microbenchmark */
+
+#include "spidey.h"
+
+#include <string.h>
+#include <time.h>
+
+/* Sample Request (roughly what arrives through our proxy) */
+
+static const char *SampleRequest =
+    "GET /scripts/cowsay.sh?message=hello+world&template=vader HTTP/1.1\r\n"
+    "Host: localhost:9424\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/118.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=3f2a9c1e8b7d4f60a1c2e3d4b5a69788; theme=dark; csrftoken=Zm9vYmFyYmF6cXV4cXV1eHF1dXpxdXV4; "
+        "_ga=GA1.1.1234567890.1696000000; _gid=GA1.1.0987654321.1696000000; preferences=%7B%22lang%22%3A%22en%22%7D\r\n"
+    "X-Request-Id: 6a1f0c2e-9d3b-4b7a-8e5f-1c2d3e4f5a6b\r\n"
+    "X-B3-TraceId: 80f198ee56343ba864fe8b2a57d3eff7\r\n"
+    "X-B3-SpanId: e457b5a2e4d86bd1\r\n"
+    "X-B3-ParentSpanId: 05e3ac9a4f6e3b90\r\n"
+    "X-B3-Sampled: 1\r\n"
+    "X-Forwarded-For: 203.0.113.195, 70.41.3.18, 150.172.238.178\r\n"
+    "X-Forwarded-Proto: https\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "\r\n";
+
+/* The same request for a link carrying campaign and tracking parameters,
+ * whose long request line goes through the scan kernel (see parser_blank) */
+
+static const char *TrackedRequest =
+    "GET /html/index.html?utm_source=newsletter&utm_medium=email&utm_campaign=fall_launch_2023&utm_content=hero_button"
+        "&utm_term=web+server&gclid=Cj0KCQjw9fqnBhDSARIsAHlcQYQm1a7kQ2Vx3f8nWbZ0cT5pL6rD9sE4uJ2hK7gF1aB3mN8vC0xZ"
+        "&fbclid=IwAR2xQ7mN3vB8cZ1aS4dF6gH9jK2lP5oI7uY0tR3eW6qA8sD1fG4hJ7kL0zX&mc_eid=4f2a9c1e8b&mc_cid=7d4f60a1c2"
+        "&ref=homepage_banner&session_hint=3f2a9c1e8b7d4f60a1c2e3d4b5a69788 HTTP/1.1\r\n"
+    "Host: localhost:9424\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/118.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Cookie: session=3f2a9c1e8b7d4f60a1c2e3d4b5a69788; theme=dark; csrftoken=Zm9vYmFyYmF6cXV4cXV1eHF1dXpxdXV4\r\n"
+    "X-Request-Id: 6a1f0c2e-9d3b-4b7a-8e5f-1c2d3e4f5a6b\r\n"
+    "X-Forwarded-For: 203.0.113.195, 70.41.3.18, 150.172.238.178\r\n"
+    "\r\n";
+
+/**
+ * Return monotonic time in nanoseconds.
+ **/
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Parse a request repeatedly, delivered in the given number of reads.
+ *
+ * @param   request     Request to parse.
+ * @param   nheaders    Number of headers in the request.
+ * @param   iterations  Number of times to parse the request.
+ * @param   nreads      Number of pieces the request arrives in.
+ * @return  Average nanoseconds per request.
+ **/
+static double bench(const char *request, size_t nheaders, size_t iterations, size_t nreads) {
+    size_t length = strlen(request);
+    size_t piece  = length / nreads + 1;
+    Parser parser;
+    size_t complete = 0;
+
+    double start = now_ns();
+    for (size_t i = 0; i < iterations; i++) {
+        parser_init(&parser);
+        for (size_t arrived = piece; ; arrived += piece) {
+            int status = parser_parse(&parser, request, arrived < length ? arrived : length);
+            if (status != PARSE_INCOMPLETE) {
+                complete += status == PARSE_COMPLETE;
+                break;
+            }
+        }
+    }
+    double elapsed = now_ns() - start;
+
+    if (complete != iterations || parser.nheaders != nheaders) {
+        fprintf(stderr, "Parser failed: %zu/%zu complete, %zu headers\n", complete, iterations, parser.nheaders);
+        exit(EXIT_FAILURE);
+    }
+
+    return elapsed / iterations;
+}
+
+int main(int argc, char *argv[]) {
+    size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+
+    const struct { const char *request; size_t nheaders; } samples[] = {
+        { SampleRequest,  19 },
+        { TrackedRequest, 7 },
+    };
+
+    for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+        const char *request  = samples[i].request;
+        size_t      nheaders = samples[i].nheaders;
+
+        printf("Request: %zu bytes (request line %zu), %zu headers, %zu iterations\n",
+            strlen(request), strcspn(request, "\r"), nheaders, iterations);
+        for (const ScanKernel *k = ScanKernels; k->name; k++) {
+            if (!scan_supported(k)) {
+                continue;
+            }
+            Scan = k;
+            printf("  %-6s  1 read: %7.1f  4 reads: %7.1f  16 reads: %7.1f  ns/request\n", k->name,
+                bench(request, nheaders, iterations, 1), bench(request, nheaders, iterations, 4),
+                bench(request, nheaders, iterations, 16));
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,243 @@
+/* cache.c: File Metadata Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+/* Globals */
+
+static pthread_mutex_t CacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+static LRUTable CacheTable = { 0 };        /* Cached entries (each costing 1) */
+
+static size_t CacheHits   = 0;
+static size_t CacheMisses = 0;
+
+/* Internal Functions */
+
+/**
+ * Free entry once its last reference is gone.
+ *
+ * @param   entry       Cache entry (no longer reachable from the cache).
+ **/
+static void cache_free(CacheEntry *entry) {
+    if (entry->fd >= 0) {
+        close(entry->fd);
+    }
+    free(entry);
+}
+
+/**
+ * Find entry for URI in the hash table (must hold CacheLock).
+ **/
+static CacheEntry * cache_find(const char *uri, size_t hash) {
+    LRUNode *node = lru_chain(&CacheTable, hash);
+    while (node && (node->hash != hash || !streq(lru_entry(node, CacheEntry)->uri, uri))) {
+        node = node->chain;
+    }
+    return lru_entry(node, CacheEntry);
+}
+
+/**
+ * Resolve URI into a new (uncached) entry.
+ *
+ * @param   c           Connection structure (for temporary allocations).
+ * @param   uri         Resource path of URI.
+ * @return  Newly allocated entry with one reference (of kind CACHE_MISSING if
+ * the URI does not map to anything under RootPath), or NULL on failure.
+ *
+ * This is where all of the path-walking system calls happen: realpath, stat,
+ * access, and (for readable regular files) open.  Readable regular files also
+ * get their validators rendered (see conditional_validators).
+ **/
+static CacheEntry * cache_resolve(Connection *c, const char *uri) {
+    char *path = determine_request_path(&c->arena, uri);
+    if (!path) {
+        path = "";
+    }
+
+    size_t ulength = strlen(uri) + 1;
+    size_t plength = strlen(path) + 1;
+    CacheEntry *entry = calloc(1, sizeof(CacheEntry) + ulength + plength);
+    if (!entry) {
+        return NULL;
+    }
+
+    entry->uri  = (char *)(entry + 1);
+    entry->path = entry->uri + ulength;
+    memcpy(entry->uri, uri, ulength);
+    memcpy(entry->path, path, plength);
+
+    trace_start(probe, "stat_access");
+    entry->fd = -1;
+    if (!*path || stat(path, &entry->st) < 0) {
+        entry->kind = CACHE_MISSING;
+    } else if (S_ISDIR(entry->st.st_mode)) {
+        entry->kind = CACHE_DIRECTORY;
+    } else if (access(path, X_OK) == 0) {
+        entry->kind = CACHE_EXECUTABLE;
+    } else if (access(path, R_OK) == 0) {
+        entry->kind = CACHE_READABLE;
+        if (S_ISREG(entry->st.st_mode)) {
+            entry->fd = open(path, O_RDONLY | O_CLOEXEC);
+            conditional_validators(entry);
+        }
+    } else {
+        entry->kind = CACHE_UNREADABLE;
+    }
+    trace_stop(probe);
+
+    entry->loaded    = time(NULL);
+    entry->node.cost = 1;
+    entry->node.refs = 1;
+    return entry;
+}
+
+/* Functions */
+
+/**
+ * Look up (or resolve and cache) the resource a URI refers to.
+ *
+ * @param   c           Connection structure (for temporary allocations).
+ * @param   uri         Resource path of URI.
+ * @return  Cache entry with a reference for the caller (release it with
+ * cache_release), or NULL on failure.  URIs that do not map to anything
+ * under RootPath are cached too, as CACHE_MISSING entries.
+ *
+ * Entries are kept for CACHE_TTL seconds, after which they are resolved
+ * again, so changes under RootPath are picked up within that time.  At most
+ * CacheEntries are kept, evicting the least recently used; with CacheEntries
+ * of 0 every lookup resolves the URI afresh.  Evicted entries (and their open
+ * file descriptors) live on until the last request using them releases them.
+ **/
+CacheEntry * cache_lookup(Connection *c, const char *uri) {
+    trace_scope("cache_lookup");
+    CacheEntry *stale = NULL;
+    CacheEntry *entry;
+    size_t hash = hash_string(uri);
+
+    if (CacheEntries == 0) {
+        __atomic_add_fetch(&CacheMisses, 1, __ATOMIC_RELAXED);
+        stats_cache(STATS_CACHE_FILE, false);
+        return cache_resolve(c, uri);
+    }
+
+    pthread_mutex_lock(&CacheLock);
+
+    if (!CacheTable.buckets && !lru_init(&CacheTable, CacheEntries)) {
+        pthread_mutex_unlock(&CacheLock);
+        return cache_resolve(c, uri);
+    }
+
+    /* Hit */
+
+    entry = cache_find(uri, hash);
+    if (entry && time(NULL) - entry->loaded < CACHE_TTL) {
+        lru_touch(&CacheTable, &entry->node);
+        entry->node.refs++;
+        CacheHits++;
+        pthread_mutex_unlock(&CacheLock);
+        stats_cache(STATS_CACHE_FILE, true);
+        return entry;
+    }
+
+    /* Miss (or expired): resolve without holding the lock */
+
+    if (entry && lru_remove(&CacheTable, &entry->node)) {
+        stale = entry;
+    }
+    CacheMisses++;
+    pthread_mutex_unlock(&CacheLock);
+    stats_cache(STATS_CACHE_FILE, false);
+
+    if (stale) {
+        cache_free(stale);
+    }
+
+    entry = cache_resolve(c, uri);
+    if (!entry) {
+        return NULL;
+    }
+    entry->node.hash = hash;
+
+    /* Insert (replacing any entry resolved concurrently) and evict */
+
+    LRUNode *evicted = NULL;
+
+    pthread_mutex_lock(&CacheLock);
+
+    CacheEntry *other = cache_find(uri, hash);
+    if (other) {
+        lru_discard(&CacheTable, &other->node, &evicted);
+    }
+
+    lru_insert(&CacheTable, &entry->node);
+    lru_evict(&CacheTable, CacheEntries, &evicted);
+
+    pthread_mutex_unlock(&CacheLock);
+
+    while (evicted) {
+        LRUNode *next = evicted->chain;
+        cache_free(lru_entry(evicted, CacheEntry));
+        evicted = next;
+    }
+
+    return entry;
+}
+
+/**
+ * Release a reference to a cache entry.
+ *
+ * @param   entry       Cache entry (or NULL).
+ **/
+void cache_release(CacheEntry *entry) {
+    if (!entry) {
+        return;
+    }
+
+    pthread_mutex_lock(&CacheLock);
+    bool last = --entry->node.refs == 0;
+    pthread_mutex_unlock(&CacheLock);
+
+    if (last) {
+        cache_free(entry);
+    }
+}
+
+/**
+ * Retrieve hit and miss counters.
+ *
+ * @param   hits        Where to store the number of hits.
+ * @param   misses      Where to store the number of misses.
+ **/
+void cache_stats(size_t *hits, size_t *misses) {
+    pthread_mutex_lock(&CacheLock);
+    *hits   = CacheHits;
+    *misses = CacheMisses;
+    pthread_mutex_unlock(&CacheLock);
+}
+
+/**
+ * Log the cache's hit and miss counters and how full it is (see
+ * stats_report).
+ **/
+void cache_report(void) {
+    size_t hits, misses, count;
+
+    pthread_mutex_lock(&CacheLock);
+    hits   = CacheHits;
+    misses = CacheMisses;
+    count  = CacheTable.count;
+    pthread_mutex_unlock(&CacheLock);
+
+    log("File cache: %zu hits, %zu misses (%.1f%% hit rate), %zu of %zu entries",
+        hits, misses, hits + misses ? 100.0 * hits / (hits + misses) : 0.0, count, CacheEntries);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
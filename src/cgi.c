@@ -0,0 +1,458 @@
+/* cgi.c: CGI Processes */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define CGI_BUFFER_SIZE     (64 << 10)  /* Bytes of script output relayed at a time */
+#define CGI_DEFAULT_PATH    "/usr/local/bin:/usr/bin:/bin"
+
+/* Admission Control (shared by all server processes) */
+
+typedef struct {
+    sem_t   slots;                      /*< Scripts that may still start */
+    size_t  running;                    /*< Scripts running */
+    size_t  queued;                     /*< Requests waiting for a slot */
+    size_t  peak;                       /*< Most requests ever waiting */
+    size_t  shed;                       /*< Requests turned away */
+    size_t  killed;                     /*< Scripts killed for running too long */
+} CGILimits;
+
+/* Globals */
+
+static CGILimits *Limits = NULL;
+
+/* Internal Functions */
+
+/**
+ * Format a NAME=value environment variable in the connection's arena.
+ **/
+static char * cgi_variable(Arena *arena, const char *name, const char *value) {
+    size_t nlength = strlen(name);
+    size_t vlength = strlen(value);
+    char  *variable = arena_alloc(arena, nlength + vlength + 2);
+
+    if (variable) {
+        memcpy(variable, name, nlength);
+        variable[nlength] = '=';
+        memcpy(variable + nlength + 1, value, vlength + 1);
+    }
+    return variable;
+}
+
+/**
+ * Milliseconds of a monotonic clock.
+ **/
+static inline long long cgi_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/**
+ * Kill a script and everything it started (its process group).
+ **/
+static void cgi_kill(pid_t pid) {
+    kill(-pid, SIGKILL);
+    if (Limits) {
+        __atomic_add_fetch(&Limits->killed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Functions */
+
+/**
+ * Set up the limit on concurrent CGI scripts (before any worker exists).
+ *
+ * @return  Whether the limit could be set up (without it, scripts are not
+ * limited).
+ *
+ * The counters live in memory shared with the processes forked later, so
+ * that CGIProcesses holds across all of them in the forking and prefork
+ * modes.
+ **/
+bool cgi_init(void) {
+    if (CGIProcesses == 0) {
+        return true;
+    }
+
+    Limits = mmap(NULL, sizeof(CGILimits), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Limits == MAP_FAILED || sem_init(&Limits->slots, 1, CGIProcesses) < 0) {
+        if (Limits != MAP_FAILED) {
+            munmap(Limits, sizeof(CGILimits));
+        }
+        Limits = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Wait for a slot to start a CGI script in.
+ *
+ * @return  Whether the script may start (release the slot with cgi_release),
+ * or false if the request is shed: when CGI_QUEUE_MAX requests are already
+ * waiting, or no slot frees up within CGI_QUEUE_WAIT seconds.
+ **/
+bool cgi_acquire(void) {
+    struct timespec deadline;
+    int             status;
+
+    if (!Limits) {
+        return true;
+    }
+
+    if (sem_trywait(&Limits->slots) < 0) {
+        size_t queued = __atomic_add_fetch(&Limits->queued, 1, __ATOMIC_RELAXED);
+        size_t peak   = __atomic_load_n(&Limits->peak, __ATOMIC_RELAXED);
+        while (queued > peak && !__atomic_compare_exchange_n(&Limits->peak, &peak, queued, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+        if (queued > CGI_QUEUE_MAX) {
+            status = -1;
+        } else {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += CGI_QUEUE_WAIT;
+            while ((status = sem_timedwait(&Limits->slots, &deadline)) < 0 && errno == EINTR);
+        }
+
+        __atomic_sub_fetch(&Limits->queued, 1, __ATOMIC_RELAXED);
+        if (status < 0) {
+            __atomic_add_fetch(&Limits->shed, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    }
+
+    __atomic_add_fetch(&Limits->running, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * Release the slot of a CGI script that has been reaped.
+ **/
+void cgi_release(void) {
+    if (Limits) {
+        __atomic_sub_fetch(&Limits->running, 1, __ATOMIC_RELAXED);
+        sem_post(&Limits->slots);
+    }
+}
+
+/**
+ * Retrieve CGI admission counters.
+ *
+ * @param   running     Where to store the number of scripts running.
+ * @param   queued      Where to store the number of requests waiting (the
+ * queue depth).
+ * @param   peak        Where to store the deepest the queue has been.
+ * @param   shed        Where to store the number of requests turned away.
+ * @param   killed      Where to store the number of scripts killed.
+ **/
+void cgi_stats(size_t *running, size_t *queued, size_t *peak, size_t *shed, size_t *killed) {
+    CGILimits none = { .running = 0 };
+    CGILimits *limits = Limits ? Limits : &none;
+
+    *running = __atomic_load_n(&limits->running, __ATOMIC_RELAXED);
+    *queued  = __atomic_load_n(&limits->queued, __ATOMIC_RELAXED);
+    *peak    = __atomic_load_n(&limits->peak, __ATOMIC_RELAXED);
+    *shed    = __atomic_load_n(&limits->shed, __ATOMIC_RELAXED);
+    *killed  = __atomic_load_n(&limits->killed, __ATOMIC_RELAXED);
+}
+
+/**
+ * Build the environment of a CGI script.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  NULL-terminated array of NAME=value strings (in the connection's
+ * arena), or NULL on failure.
+ *
+ * Besides the request variables, every request header is passed on as
+ * HTTP_NAME (Content-Length and Content-Type as CONTENT_LENGTH and
+ * CONTENT_TYPE), except Proxy, which a client could use to redirect the
+ * script's own outgoing requests.
+ **/
+char ** cgi_environment(Request *r) {
+    Arena      *arena = &r->connection->arena;
+    const char *path  = getenv("PATH");
+    size_t      count = 12;
+    size_t      n     = 0;
+
+    for (Header *header = r->headers; header; header = header->next) {
+        count++;
+    }
+
+    char **environment = arena_alloc(arena, (count + 1) * sizeof(char *));
+    if (!environment) {
+        return NULL;
+    }
+
+    environment[n++] = cgi_variable(arena, "DOCUMENT_ROOT", RootPath);
+    environment[n++] = cgi_variable(arena, "GATEWAY_INTERFACE", "CGI/1.1");
+    environment[n++] = cgi_variable(arena, "PATH", path ? path : CGI_DEFAULT_PATH);
+    environment[n++] = cgi_variable(arena, "QUERY_STRING", r->query);
+    environment[n++] = cgi_variable(arena, "REMOTE_ADDR", r->connection->host);
+    environment[n++] = cgi_variable(arena, "REMOTE_PORT", r->connection->port);
+    environment[n++] = cgi_variable(arena, "REQUEST_METHOD", r->method);
+    environment[n++] = cgi_variable(arena, "REQUEST_URI", r->uri);
+    environment[n++] = cgi_variable(arena, "SCRIPT_FILENAME", r->path);
+    environment[n++] = cgi_variable(arena, "SERVER_PORT", Port);
+    environment[n++] = cgi_variable(arena, "SERVER_PROTOCOL", r->version ? "HTTP/1.1" : "HTTP/1.0");
+
+    for (Header *header = r->headers; header; header = header->next) {
+        char name[BUFSIZ];
+
+        if (strcasecmp(header->name, "Content-Length") == 0) {
+            environment[n++] = cgi_variable(arena, "CONTENT_LENGTH", header->data);
+            continue;
+        }
+        if (strcasecmp(header->name, "Content-Type") == 0) {
+            environment[n++] = cgi_variable(arena, "CONTENT_TYPE", header->data);
+            continue;
+        }
+        if (strcasecmp(header->name, "Proxy") == 0 || strlen(header->name) + 6 > sizeof(name)) {
+            continue;
+        }
+
+        char *s = stpcpy(name, "HTTP_");
+        for (const char *t = header->name; *t; t++) {
+            *s++ = *t == '-' ? '_' : toupper((unsigned char)*t);
+        }
+        *s = '\0';
+        environment[n++] = cgi_variable(arena, name, header->data);
+    }
+
+    environment[n] = NULL;
+    for (size_t i = 0; i < n; i++) {
+        if (!environment[i]) {
+            return NULL;
+        }
+    }
+    return environment;
+}
+
+/**
+ * Start the CGI script of a request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   input       Where to store the write end of the script's stdin.
+ * @param   output      Where to store the read end of the script's stdout.
+ * @return  Process ID of the script, or -1 on failure.
+ *
+ * The script is executed directly with vfork and execve, so no shell is
+ * started, the server is not copied, and the server's own environment is
+ * left alone: the script gets an environment of its own (see
+ * cgi_environment).  Every signal is restored to its default for the script
+ * (the server ignores SIGPIPE, for one).  Its stderr is the server's; every
+ * other descriptor of ours is closed, whether or not it is close-on-exec, so
+ * a script that hangs around cannot hold on to the server's port or clients.
+ *
+ * The script leads a process group of its own, so it can be killed together
+ * with whatever it starts (see cgi_relay), and may use CGICPULimit seconds
+ * of CPU time (after which it gets SIGXCPU, then SIGKILL).  The limit is set
+ * in the child before execve, so the script never runs without it; if it
+ * cannot be set the script is not started at all.
+ **/
+pid_t cgi_spawn(Request *r, int *input, int *output) {
+    trace_scope("cgi_spawn");
+    sigset_t      all, mask;
+    int           in[2], out[2];
+    pid_t         pid;
+    volatile int  error = 0;
+    char         *argv[] = { r->path, NULL };
+    char        **environment = cgi_environment(r);
+    struct rlimit limit = { .rlim_cur = CGICPULimit, .rlim_max = CGICPULimit + 1 };
+
+    if (!environment) {
+        return -1;
+    }
+
+    if (pipe2(in, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+
+    /* The child borrows our memory and stack until it execs, so none of our
+     * signal handlers may run in it: block everything across the vfork and
+     * let the child reset every handler before it unblocks.  It only makes
+     * system calls, and reports a failure through error (which we share). */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &mask);
+
+    if ((pid = vfork()) == 0) {
+        struct sigaction action = { .sa_handler = SIG_DFL };
+        sigset_t         none;
+
+        for (int signum = 1; signum < NSIG; signum++) {
+            sigaction(signum, &action, NULL);
+        }
+        if (setpgid(0, 0) < 0 ||
+           (CGICPULimit > 0 && setrlimit(RLIMIT_CPU, &limit) < 0) ||
+            dup2(in[0], STDIN_FILENO) < 0 ||
+            dup2(out[1], STDOUT_FILENO) < 0 ||
+            close_range(STDERR_FILENO + 1, ~0U, 0) < 0) {
+            error = errno;
+            _exit(127);
+        }
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        execve(r->path, argv, environment);
+        error = errno;
+        _exit(127);
+    }
+
+    if (pid > 0 && error) {
+        waitpid(pid, NULL, 0);
+        pid = -1;
+    } else if (pid < 0) {
+        error = errno;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &mask, NULL);
+    close(in[0]);
+    close(out[1]);
+
+    if (pid < 0) {
+        debug("Unable to spawn %s: %s", r->path, strerror(error));
+        close(in[1]);
+        close(out[0]);
+        return -1;
+    }
+    stats_spawn(STATS_SPAWN_CGI);
+
+    *input  = in[1];
+    *output = out[0];
+    return pid;
+}
+
+/**
+ * Relay a request body to a CGI script and its output to the client.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   pid         Process ID of the script.
+ * @param   input       Write end of the script's stdin (closed).
+ * @param   output      Read end of the script's stdout (closed).
+ * @param   memo        Where to capture the output as well (see memo_append).
+ * @return  Number of bytes of output relayed.
+ *
+ * The request body (see request_body_next) is written to the script's stdin
+ * while its stdout is read, so a script that answers before it has read
+ * all of its input cannot deadlock against us.  Once the body is over
+ * stdin is closed.  Output is relayed as is, CGI_BUFFER_SIZE bytes at a
+ * time, until the script closes its stdout.
+ *
+ * Each piece of output is written to the client before the next is read, so
+ * a slow client fills the pipe and stalls the script in its writes instead
+ * of having us buffer its output.  A script still running after CGITimeout
+ * seconds (including time spent waiting on the client) is killed, as is one
+ * whose client has gone away.
+ *
+ * Reading the body refills the connection's input buffer, so the request's
+ * method, uri, query and headers (which point into it) must not be used
+ * afterwards.
+ **/
+off_t cgi_relay(Request *r, pid_t pid, int input, int output, Memo *memo) {
+    trace_scope("cgi_relay");
+    FILE       *stream  = r->connection->stream;
+    long long   deadline = CGITimeout > 0 ? cgi_now() + CGITimeout * 1000LL : 0;
+    char       *buffer  = malloc(CGI_BUFFER_SIZE);
+    off_t       relayed = 0;
+    const char *pending = NULL;
+    size_t      plength = 0;
+    struct timeval saved = { 0 };
+    socklen_t   slength = sizeof(saved);
+
+    fcntl(input, F_SETFL, O_NONBLOCK);
+
+    /* Bound writes to a stalled client for the relay only (the connection
+     * keeps its own send timeout for later responses) */
+
+    if (deadline) {
+        struct timeval timeout = { .tv_sec = CGITimeout };
+        getsockopt(r->connection->fd, SOL_SOCKET, SO_SNDTIMEO, &saved, &slength);
+        setsockopt(r->connection->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+
+    while (output >= 0 && buffer) {
+        /* Close stdin once the whole body has been written */
+
+        if (input >= 0 && !pending && !(pending = request_body_next(r, &r->body, &plength))) {
+            close(input);
+            input = -1;
+        }
+
+        struct pollfd fds[] = {
+            { .fd = output, .events = POLLIN },
+            { .fd = input,  .events = POLLOUT },
+        };
+
+        long long timeout = deadline ? deadline - cgi_now() : -1;
+        int       ready   = deadline && timeout <= 0 ? 0 : poll(fds, input >= 0 ? 2 : 1, timeout);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            debug("Killing CGI script %d: %s", pid, ready ? strerror(errno) : "timed out");
+            cgi_kill(pid);
+            break;
+        }
+
+        if (input >= 0 && fds[1].revents) {
+            ssize_t nwritten = write(input, pending, plength);
+            if (nwritten > 0) {
+                request_body_consume(r, &r->body, nwritten);
+                pending = NULL;
+            } else if (nwritten < 0 && errno != EAGAIN && errno != EINTR) {
+                close(input);           /* Script is not reading (any more) */
+                input = -1;
+            }
+        }
+
+        if (fds[0].revents) {
+            ssize_t nread = read(output, buffer, CGI_BUFFER_SIZE);
+            if (nread < 0 && errno == EINTR) {
+                continue;
+            }
+            if (nread <= 0) {
+                break;
+            }
+            if (fwrite(buffer, 1, nread, stream) != (size_t)nread || (deadline && cgi_now() >= deadline)) {
+                debug("Killing CGI script %d: %s", pid, ferror(stream) ? "client gone" : "timed out");
+                cgi_kill(pid);
+                break;
+            }
+            memo_append(memo, buffer, nread);
+            relayed += nread;
+        }
+    }
+
+    if (deadline) {
+        fflush(stream);                 /* Still under the relay's timeout */
+        setsockopt(r->connection->fd, SOL_SOCKET, SO_SNDTIMEO, &saved, sizeof(saved));
+    }
+
+    if (input >= 0) {
+        close(input);
+    }
+    close(output);
+    free(buffer);
+    return relayed;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,144 @@
+/* conditional.c: HTTP Conditional Requests */
+
+#include "spidey.h"
+
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+/* Constants */
+
+#define HTTP_DATE_FORMAT    "%a, %d %b %Y %H:%M:%S GMT"
+
+/* Internal Functions */
+
+/**
+ * Determine whether an entity tag list matches an entity tag.
+ *
+ * @param   list        Value of If-None-Match or If-Range header.
+ * @param   etag        Entity tag of the file (always strong).
+ * @param   weak        Whether weak tags (W/"...") in list may match.
+ * @return  Whether any tag in list (or "*") matches.
+ **/
+static bool conditional_etag_match(const char *list, const char *etag, bool weak) {
+    size_t length = strlen(etag);
+
+    while (*(list = skip_whitespace((char *)list))) {
+        if (*list == '*') {
+            return true;
+        }
+
+        bool is_weak = strncmp(list, "W/", 2) == 0;
+        const char *tag = is_weak ? list + 2 : list;
+        if ((weak || !is_weak) && strncmp(tag, etag, length) == 0 &&
+            (tag[length] == ',' || tag[length] == '\0' || tag[length] == ' ' || tag[length] == '\t')) {
+            return true;
+        }
+
+        list = strchr(list, ',');
+        if (!list) {
+            break;
+        }
+        list++;
+    }
+
+    return false;
+}
+
+/**
+ * Parse an HTTP-date (IMF-fixdate, as we send in Last-Modified).
+ *
+ * @param   date        Date string.
+ * @param   when        Where to store the time.
+ * @return  Whether the date could be parsed.
+ **/
+static bool conditional_date(const char *date, time_t *when) {
+    struct tm tm = {0};
+    const char *end = strptime(date, HTTP_DATE_FORMAT, &tm);
+
+    if (!end || *skip_whitespace((char *)end)) {
+        return false;
+    }
+
+    *when = timegm(&tm);
+    return true;
+}
+
+/* Functions */
+
+/**
+ * Render the validators of a regular file into its cache entry.
+ *
+ * @param   entry       Cache entry (with stat data).
+ *
+ * The entity tag is derived from the inode, size and modification time (in
+ * nanoseconds), so a file that is replaced or rewritten gets a new one.
+ * Last-Modified only has a resolution of seconds.
+ **/
+void conditional_validators(CacheEntry *entry) {
+    struct stat *st = &entry->st;
+    struct tm    tm;
+
+    snprintf(entry->etag, sizeof(entry->etag), "\"%llx-%llx-%llx\"",
+        (unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+        (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec);
+
+    gmtime_r(&st->st_mtime, &tm);
+    strftime(entry->modified, sizeof(entry->modified), HTTP_DATE_FORMAT, &tm);
+}
+
+/**
+ * Determine whether the client's copy of a file is still current.
+ *
+ * @param   r           HTTP Request structure (for a regular file).
+ * @param   etag        Entity tag of the representation being sent (the
+ * file's own, or that of a compressed copy; see encoding_acquire).
+ * @return  Whether to respond with HTTP_STATUS_NOT_MODIFIED.
+ *
+ * If-None-Match takes precedence and is compared weakly against the entity
+ * tag; otherwise If-Modified-Since is compared against the modification
+ * time (a date the client merely echoes back is matched without parsing).
+ **/
+bool conditional_not_modified(Request *r, const char *etag) {
+    const char *value;
+    time_t      since;
+
+    if ((value = request_header(r, "If-None-Match"))) {
+        return conditional_etag_match(value, etag, true);
+    }
+
+    if ((value = request_header(r, "If-Modified-Since"))) {
+        if (streq(value, r->file->modified)) {
+            return true;
+        }
+        return conditional_date(value, &since) && r->file->st.st_mtime <= since;
+    }
+
+    return false;
+}
+
+/**
+ * Determine whether a Range request may be served as ranges.
+ *
+ * @param   r           HTTP Request structure (for a regular file).
+ * @return  Whether there is no If-Range header or it still matches the file
+ * (otherwise the whole file must be sent).
+ *
+ * If-Range holds either an entity tag, which must match strongly, or the
+ * exact Last-Modified date the client was sent.
+ **/
+bool conditional_range(Request *r) {
+    const char *value = request_header(r, "If-Range");
+
+    if (!value) {
+        return true;
+    }
+
+    if (value[0] == '"' || strncmp(value, "W/", 2) == 0) {
+        return conditional_etag_match(value, r->file->etag, false);
+    }
+
+    return streq(value, r->file->modified);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
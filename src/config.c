@@ -0,0 +1,31 @@
+/* config.c: Server Configuration */
+
+#include "spidey.h"
+
+/* Global Variables (defaults, overridden by the options parsed in main) */
+char *Port	      = "9424";
+char *MimeTypesPath   = "/etc/mime.types";
+char *DefaultMimeType = "text/plain";
+char *RootPath	      = "www";
+size_t Workers        = 0;
+bool   Sharded        = false;
+int    KeepAliveTimeout = 5;
+size_t KeepAliveMax   = 100;
+bool   SendFile       = true;
+size_t CacheEntries   = 1024;
+size_t ContentBudget  = 16 << 20;
+size_t MmapThreshold  = 1 << 20;
+bool   Compress       = true;
+size_t FastCGIWorkers = 4;
+size_t MemoBudget     = 0;
+char  *MemoHeaders    = "";
+size_t CGIProcesses   = 64;
+int    CGITimeout     = 30;
+int    CGICPULimit    = 10;
+char  *AccessLog      = "-";
+char  *StatsURI       = "/__stats";
+#ifdef TRACE
+char  *TracePath      = "spidey-trace.json";
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
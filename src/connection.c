@@ -0,0 +1,642 @@
+/* connection.c: HTTP Connection Functions */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio_ext.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/**
+ * Wait for the client socket to become ready (non-blocking sockets only).
+ *
+ * @param   c           Connection structure.
+ * @param   events      Events to wait for (POLLIN or POLLOUT).
+ * @return  Whether the socket became ready within KeepAliveTimeout (the same
+ * bound SO_RCVTIMEO puts on blocking reads).
+ **/
+static bool connection_wait(Connection *c, short events) {
+    struct pollfd pfd = { .fd = c->fd, .events = events };
+    int status;
+
+    do {
+        status = poll(&pfd, 1, KeepAliveTimeout > 0 ? KeepAliveTimeout * 1000 : -1);
+    } while (status < 0 && errno == EINTR);
+
+    return status > 0;
+}
+
+/**
+ * Write once to the client socket, from memory or from a file.
+ *
+ * @param   c           Connection structure.
+ * @param   data        Data to send (NULL to send from fd).
+ * @param   fd          File descriptor of (regular) file to send.
+ * @param   offset      Offset in file to send from (advanced past what was sent).
+ * @param   length      Number of bytes to send.
+ * @return  Number of bytes written, 0 if the file ended, or -1 on error.
+ *
+ * Files go out with sendfile(2), or through a buffer if SendFile is off.
+ **/
+static ssize_t connection_put(Connection *c, const char *data, int fd, off_t *offset, size_t length) {
+    char    buffer[BUFSIZ];
+    ssize_t nread;
+
+    if (data) {
+        return write(c->fd, data, length);
+    }
+
+    if (SendFile) {
+        return sendfile(c->fd, fd, offset, length);
+    }
+
+    if ((nread = pread(fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer), *offset)) <= 0) {
+        return nread;
+    }
+
+    ssize_t nwritten = write(c->fd, buffer, nread);
+    if (nwritten > 0) {
+        *offset += nwritten;
+    }
+    return nwritten;
+}
+
+/**
+ * Queue output the client socket cannot take yet.
+ *
+ * @param   c           Connection structure.
+ * @param   data        Data to copy (NULL to send from fd).
+ * @param   fd          File descriptor of file to send (duplicated).
+ * @param   offset      Offset in file to send from.
+ * @param   length      Number of bytes to send.
+ * @return  Whether the output was queued.
+ **/
+static bool connection_queue(Connection *c, const char *data, int fd, off_t offset, off_t length) {
+    ConnectionSegment *segment = malloc(sizeof(ConnectionSegment) + (data ? length : 0));
+    if (!segment) {
+        debug("Unable to allocate output segment: %s", strerror(errno));
+        return false;
+    }
+
+    if (data) {
+        memcpy(segment->data, data, length);
+        segment->fd     = -1;
+        segment->offset = 0;
+    } else if ((segment->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+        debug("Unable to duplicate file descriptor: %s", strerror(errno));
+        free(segment);
+        return false;
+    } else {
+        segment->offset = offset;
+    }
+    segment->length = length;
+    segment->next   = NULL;
+
+    if (c->queue_tail) {
+        c->queue_tail->next = segment;
+    } else {
+        c->queue = segment;
+    }
+    c->queue_tail = segment;
+    return true;
+}
+
+/**
+ * Send data or part of a file to the client.
+ *
+ * @param   c           Connection structure.
+ * @param   data        Data to send (NULL to send from fd).
+ * @param   fd          File descriptor of (regular) file to send.
+ * @param   offset      Offset in file to send from.
+ * @param   length      Number of bytes to send.
+ * @return  Number of bytes sent or queued (fewer than length if the client
+ * went away or the file shrank).
+ *
+ * On a blocking socket, this writes everything before returning.  On a
+ * non-blocking one, it either waits for the socket to drain (see
+ * connection_wait) or, when the connection is queueing, queues whatever the
+ * socket cannot take right away (a copy of data, or the range of the file)
+ * for connection_drain.  Once anything is queued, all later output is
+ * queued behind it, so responses stay in order.  While the connection is
+ * discarding (see connection_discard), nothing is sent at all.
+ **/
+static off_t connection_send(Connection *c, const char *data, int fd, off_t offset, off_t length) {
+    off_t sent = 0;
+
+    if (c->discarding) {
+        return length;
+    }
+
+    while (sent < length && !c->queue) {
+        ssize_t nsent = connection_put(c, data ? data + sent : NULL, fd, &offset, length - sent);
+        if (nsent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nsent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && c->nonblocking) {
+            if (c->queueing) {
+                break;
+            }
+            if (connection_wait(c, POLLOUT)) {
+                continue;
+            }
+        }
+        if (nsent <= 0) {
+            debug("Unable to send: %s", nsent < 0 ? strerror(errno) : "end of file");
+            c->sent += sent;
+            return sent;
+        }
+        sent += nsent;
+    }
+
+    if (sent < length && connection_queue(c, data ? data + sent : NULL, fd, offset, length - sent)) {
+        sent = length;
+    }
+
+    c->sent += sent;
+    return sent;
+}
+
+/**
+ * Write buffered output to the client socket (the stream's cookie I/O).
+ *
+ * Everything the stream writes passes through here (and connection_send),
+ * so this is where the bytes sent on the connection are counted.
+ **/
+static ssize_t connection_stream_write(void *cookie, const char *data, size_t length) {
+    off_t sent = connection_send(cookie, data, -1, 0, length);
+
+    return sent > 0 ? sent : -1;
+}
+
+static int connection_stream_close(void *cookie) {
+    return close(((Connection *)cookie)->fd);
+}
+
+/**
+ * Discard the first queued segment.
+ **/
+static void connection_dequeue(Connection *c) {
+    ConnectionSegment *segment = c->queue;
+
+    if (!(c->queue = segment->next)) {
+        c->queue_tail = NULL;
+    }
+    if (segment->fd >= 0) {
+        close(segment->fd);
+    }
+    free(segment);
+}
+
+/**
+ * Accept connection from server socket.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Newly allocated Connection structure.
+ *
+ * This function does the following:
+ *
+ *  1. Allocates a connection struct initialized to 0.
+ *  2. Accepts a client connection from the server socket.
+ *  3. Looks up the client information and stores it in the connection struct.
+ *  4. Applies the keep-alive idle timeout to reads from the client socket.
+ *  5. Disables Nagle's algorithm on the client socket.
+ *  6. Opens the client socket stream used to write responses.
+ *  7. Returns the connection struct.
+ *
+ * The returned connection struct must be deallocated using free_connection.
+ **/
+Connection * accept_connection(int sfd) {
+    trace_scope("accept_connection");
+    struct sockaddr_storage raddr;
+    socklen_t rlen = sizeof(raddr);
+
+    /* Allocate connection struct (zeroed) */
+
+    Connection *c = calloc(1, sizeof(Connection));
+    if (!c) {
+        debug("Unable to allocate connection: %s", strerror(errno));
+        return NULL;
+    }
+
+    parser_init(&c->parser);
+    arena_init(&c->arena);
+
+    /* Accept a client */
+
+    trace_start(wait, "accept");
+    c->fd = accept4(sfd, (struct sockaddr *)&raddr, &rlen, SOCK_CLOEXEC); // keep out of CGI children
+    trace_stop(wait);
+    if (c->fd < 0) {
+        debug("Unable to accept: %s", strerror(errno));
+        goto fail;
+    }
+
+    /* Lookup client information */
+
+    int flags  = NI_NUMERICHOST | NI_NUMERICSERV;
+    trace_start(lookup, "getnameinfo");
+    int status = getnameinfo((struct sockaddr *)&raddr, rlen, c->host, sizeof(c->host), c->port, sizeof(c->port), flags);
+    trace_stop(lookup);
+    if (status != 0) {
+        debug("Unable to lookup client: %s", gai_strerror(status));
+        goto fail;
+    }
+
+    /* Bound how long an idle client may hold on to the connection */
+
+    if (KeepAliveTimeout > 0) {
+        struct timeval timeout = { .tv_sec = KeepAliveTimeout };
+        setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    /* Responses are batched by the stream and TCP_CORK already, so Nagle
+     * would only hold back the tail of a batch until the client's delayed
+     * ACK (pipelined sendfile responses span several small segments) */
+
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+    /* Open socket stream (with room to batch pipelined responses) */
+
+    cookie_io_functions_t io = { .write = connection_stream_write, .close = connection_stream_close };
+    c->stream = fopencookie(c, "w", io);
+    if (!c->stream) {
+        debug("Unable to open socket stream: %s", strerror(errno));
+        goto fail;
+    }
+    setvbuf(c->stream, c->output, _IOFBF, sizeof(c->output));
+
+    debug("Accepted connection from %s:%s", c->host, c->port);
+    stats_connection(1);
+    return c;
+
+fail:
+    free_connection(c);
+    return NULL;
+}
+
+/**
+ * Deallocate connection struct.
+ *
+ * @param   c           Connection structure.
+ *
+ * This flushes and closes the client socket stream (or file descriptor),
+ * releases the connection's arena, and then frees the connection struct.
+ **/
+void free_connection(Connection *c) {
+    if (!c) {
+        return;
+    }
+
+    while (c->queue) {
+        connection_dequeue(c);
+    }
+
+    if (c->stream) {
+        fclose(c->stream);
+        stats_connection(-1);
+    } else if (c->fd >= 0) {
+        close(c->fd);
+    }
+
+    arena_reset(&c->arena);
+    free(c);
+}
+
+/**
+ * Read more client input into the connection buffer.
+ *
+ * @param   c           Connection structure.
+ * @param   block       Whether to wait for input (up to the idle timeout).
+ * @return  Number of bytes read, 0 on end of input, and -1 on error (errno is
+ * EAGAIN if nothing was available or the idle timeout expired).
+ *
+ * Input that was already consumed is discarded first to make room.
+ **/
+ssize_t connection_fill(Connection *c, bool block) {
+    if (c->offset > 0) {
+        memmove(c->buffer, c->buffer + c->offset, c->length - c->offset);
+        c->length -= c->offset;
+        c->offset  = 0;
+    }
+
+    if (c->length == sizeof(c->buffer)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    ssize_t nread;
+    do {
+        nread = recv(c->fd, c->buffer + c->length, sizeof(c->buffer) - c->length, block ? 0 : MSG_DONTWAIT);
+    } while ((nread < 0 && errno == EINTR) ||
+             (nread < 0 && errno == EAGAIN && block && c->nonblocking && connection_wait(c, POLLIN)));
+
+    if (nread > 0) {
+        c->length += nread;
+    }
+
+    return nread;
+}
+
+/**
+ * Determine if the buffered input holds a request that can be handled.
+ *
+ * @param   c           Connection structure.
+ * @return  Whether parse_request can run without waiting for more input.
+ *
+ * Whatever arrived since the last call is fed to the connection's parser.  A
+ * request is ready once its head is complete, once it is known to be
+ * malformed (so that the client gets its 400 right away), or once it has
+ * filled the whole buffer without completing.
+ **/
+bool connection_ready(Connection *c) {
+    int status = parser_parse(&c->parser, c->buffer + c->offset, c->length - c->offset);
+
+    return status != PARSE_INCOMPLETE || (c->offset == 0 && c->length == sizeof(c->buffer));
+}
+
+/**
+ * Cork the socket (see connection_sendfile) and flush buffered output into it.
+ *
+ * @param   c           Connection structure.
+ * @return  Whether or not buffered output was written.
+ **/
+static bool connection_cork(Connection *c) {
+    if (!c->corked) {
+        int on = 1;
+        c->corked = setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0;
+    }
+
+    return fflush(c->stream) == 0;
+}
+
+/**
+ * Flush buffered responses to the client.
+ *
+ * @param   c           Connection structure.
+ * @return  Whether or not everything was written.
+ *
+ * If the socket was corked for a sendfile (see connection_sendfile), it is
+ * uncorked afterwards so the final partial segment goes out immediately.
+ **/
+bool connection_flush(Connection *c) {
+    trace_scope("connection_flush");
+    bool flushed = fflush(c->stream) == 0;
+
+    if (c->corked) {
+        int off = 0;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+        c->corked = false;
+    }
+
+    return flushed;
+}
+
+/**
+ * Send part of a file to the client without copying it through user space.
+ *
+ * @param   c           Connection structure.
+ * @param   fd          File descriptor of (regular) file to send.
+ * @param   offset      Offset in file to start at.
+ * @param   length      Number of bytes to send.
+ * @return  Number of bytes sent, or -1 if buffered output could not be flushed.
+ *
+ * The socket is corked first, so the response headers still sitting in the
+ * output buffer and the start of the file are packed into full segments
+ * instead of going out as a short headers-only packet.  It stays corked
+ * until the next connection_flush, so pipelined responses batch up as well.
+ * Fewer bytes than requested are sent if the file shrinks or the client
+ * goes away.  (With SendFile off, which only the event loop does here, the
+ * file goes through a small buffer instead; see send_file_range.)
+ **/
+off_t connection_sendfile(Connection *c, int fd, off_t offset, off_t length) {
+    if (!connection_cork(c)) {
+        return -1;
+    }
+
+    return connection_send(c, NULL, fd, offset, length);
+}
+
+/**
+ * Write a (large) buffer to the client without copying it into the stream.
+ *
+ * @param   c           Connection structure.
+ * @param   data        Data to send.
+ * @param   length      Number of bytes to send.
+ * @return  Number of bytes sent, or -1 if buffered output could not be flushed.
+ *
+ * Like connection_sendfile, the socket is corked and buffered output flushed
+ * first.  Since only the kernel touches data, a page that can no longer be
+ * read (say, of a mapped file truncated underneath us) ends the write with
+ * EFAULT rather than raising SIGBUS.  On a queueing connection, whatever the
+ * socket cannot take is copied into the queue (see connection_send).
+ **/
+off_t connection_write(Connection *c, const char *data, off_t length) {
+    if (!connection_cork(c)) {
+        return -1;
+    }
+
+    return connection_send(c, data, -1, 0, length);
+}
+
+/**
+ * Count the bytes of responses written on a connection so far.
+ *
+ * @param   c           Connection structure.
+ * @return  Bytes sent to the client plus those still buffered for it.
+ **/
+off_t connection_sent(Connection *c) {
+    return c->sent + __fpending(c->stream);
+}
+
+/**
+ * Start or stop dropping everything written to the client.
+ *
+ * @param   c           Connection structure.
+ * @param   discard     Whether to drop output from now on.
+ *
+ * Buffered output is flushed first, so only what is written afterwards is
+ * dropped (see request_headers_end).  Dropped bytes are not counted as sent.
+ **/
+void connection_discard(Connection *c, bool discard) {
+    if (c->discarding != discard) {
+        fflush(c->stream);
+        c->discarding = discard;
+    }
+}
+
+/**
+ * Make the client socket non-blocking, queueing output it cannot take.
+ *
+ * @param   c           Connection structure.
+ * @return  Whether the socket could be made non-blocking.
+ *
+ * Output is queued (see connection_send) for as long as c->queueing is set;
+ * while it is cleared, reads and writes wait for the socket instead, as they
+ * would on a blocking one.
+ **/
+bool connection_nonblock(Connection *c) {
+    int flags = fcntl(c->fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(c->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return false;
+    }
+
+    c->nonblocking = c->queueing = true;
+    return true;
+}
+
+/**
+ * Determine if output is queued for the client.
+ *
+ * @param   c           Connection structure.
+ * @return  Whether output is waiting for the socket (see connection_drain).
+ **/
+bool connection_queued(Connection *c) {
+    return c->queue != NULL;
+}
+
+/**
+ * Send as much queued output as the client socket will take.
+ *
+ * @param   c           Connection structure.
+ * @return  Whether the connection is still usable (false once the client
+ * has gone away or a queued file could not be read).
+ *
+ * Queued bytes were already counted as sent when they were queued.  Once the
+ * queue is empty, the socket is uncorked (see connection_flush).
+ **/
+bool connection_drain(Connection *c) {
+    while (c->queue) {
+        ConnectionSegment *segment = c->queue;
+        char *data = segment->fd < 0 ? segment->data + segment->offset : NULL;
+
+        ssize_t nsent = connection_put(c, data, segment->fd, &segment->offset, segment->length);
+        if (nsent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nsent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (nsent <= 0) {
+            debug("Unable to send queued output: %s", nsent < 0 ? strerror(errno) : "end of file");
+            return false;
+        }
+
+        if (data) {
+            segment->offset += nsent;
+        }
+        if ((segment->length -= nsent) == 0) {
+            connection_dequeue(c);
+        }
+    }
+
+    if (c->corked) {
+        int off = 0;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+        c->corked = false;
+    }
+
+    return true;
+}
+
+/**
+ * Handle every request that is already buffered on a connection.
+ *
+ * @param   c           Connection structure.
+ * @param   eof         Whether the client has stopped sending.
+ * @return  Whether the connection should stay open.
+ *
+ * Pipelined requests are parsed and handled back to back, and their responses
+ * accumulate in the connection's output buffer so that the whole batch goes
+ * out with a single flush once no complete request is left.  If the client
+ * stopped sending halfway through a request, whatever did arrive is handled
+ * (which typically results in a 400).  If the connection is to stay open,
+ * any request body the handler did not read is skipped first (see
+ * request_body_skip), and if it was cut short the connection is closed.
+ * Each request is recorded in the access journal as it completes (see
+ * journal_end), so its latency does not include waiting for the rest of the
+ * batch.  Mime-types a request looks up stay valid until it completes (see
+ * mime_begin), and the body of a HEAD response is dropped until then (see
+ * request_headers_end).
+ *
+ * On a queueing connection (see connection_nonblock), handling stops early,
+ * leaving the rest buffered, once output is queued (until connection_drain
+ * empties the queue) or once the next request may block (see
+ * request_blocks), so that the event loop can hand it to a worker thread.
+ **/
+bool handle_requests(Connection *c, bool eof) {
+    bool keep_alive = true;
+
+    while (keep_alive && !connection_queued(c) && (connection_ready(c) || (eof && c->offset < c->length))) {
+        if (c->queueing && request_blocks(c)) {
+            break;
+        }
+
+        Request *r = create_request(c);
+        if (!r) {
+            return false;
+        }
+
+        JournalRecord record;
+        journal_begin(&record, c);
+        r->access = &record;
+
+        mime_begin();
+        Status status = handle_request(r);
+        mime_end();
+        connection_discard(c, false);
+        if (r->keep_alive && !request_body_skip(r)) {
+            r->keep_alive = false;
+        }
+        c->nrequests++;
+        journal_end(&record, c, status);
+        stats_request(r, status, &record);
+
+        keep_alive = r->keep_alive;
+        free_request(r);
+    }
+
+    return connection_flush(c) && keep_alive && !(eof && c->offset == c->length);
+}
+
+/**
+ * Handle HTTP requests on a connection until it should be closed.
+ *
+ * @param   c           Connection structure.
+ * @return  Number of requests handled.
+ *
+ * Input is read (blocking) until at least one complete request is buffered,
+ * and then everything that is buffered is handled as one batch.  This repeats
+ * for as long as each request asks to keep the connection alive (see
+ * parse_request).  The connection is given up once the client closes it,
+ * stays idle longer than KeepAliveTimeout, or has been used for KeepAliveMax
+ * requests.
+ **/
+size_t handle_connection(Connection *c) {
+    bool eof = false;
+
+    do {
+        /* Wait for a complete request (or the end of input) */
+
+        while (!eof && !connection_ready(c)) {
+            ssize_t nread = connection_fill(c, true);
+            if (nread < 0) {
+                return c->nrequests;
+            }
+            eof = nread == 0;
+        }
+
+    /* Handle buffered requests */
+    } while (handle_requests(c, eof));
+
+    return c->nrequests;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
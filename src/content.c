@@ -0,0 +1,340 @@
+/* content.c: Hot Content Cache */
+
+#include "spidey.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Constants */
+
+#define CONTENT_MAX_SIZE        (1 << 20)   /* Largest file worth keeping */
+#define CONTENT_SKETCH_ROWS     4
+#define CONTENT_SKETCH_WIDTH    8192        /* Counters per row (power of two) */
+#define CONTENT_SKETCH_MAX      15          /* Counters saturate here */
+#define CONTENT_SKETCH_SAMPLE   (10 * CONTENT_SKETCH_WIDTH)
+#define CONTENT_HEAD            "Content-Type: %s\r\nContent-Length: %lld\r\n%s"
+
+/* Cached Responses */
+
+typedef struct content_entry ContentEntry;
+struct content_entry {
+    LRUNode       node;                 /*< Hash (of path), cost and LRU links */
+    char         *path;                 /*< Real path of file */
+    const char   *mimetype;             /*< Mime-type the headers were rendered with */
+    ino_t         ino;                  /*< Inode of cached contents */
+    struct timespec mtime;              /*< Modification time of cached contents */
+    off_t         size;                 /*< Size of cached contents */
+
+    char         *head;                 /*< Headers from Content-Type up to Connection */
+    size_t        hlength;              /*< Length of head */
+    char         *body;                 /*< File contents */
+};
+
+/* Globals */
+
+static pthread_mutex_t ContentLock = PTHREAD_MUTEX_INITIALIZER;
+
+static LRUNode  *ContentBuckets[1024];
+static LRUTable ContentTable = LRU_TABLE(ContentBuckets);  /* Cached entries (costing their bytes) */
+
+static uint8_t ContentSketch[CONTENT_SKETCH_ROWS][CONTENT_SKETCH_WIDTH];
+static size_t  ContentSamples = 0;          /* Increments since last aging */
+
+static size_t ContentHits     = 0;
+static size_t ContentMisses   = 0;
+static size_t ContentRejected = 0;
+
+/* Pre-rendered lines around the cached head */
+
+static const char *ContentStatus[]     = { "HTTP/1.0 200 OK\r\n", "HTTP/1.1 200 OK\r\n" };
+static const char *ContentConnection[] = { "Connection: close\r\n\r\n", "Connection: keep-alive\r\n\r\n" };
+
+/* Internal Functions */
+
+static inline size_t content_cost(ContentEntry *entry) {
+    return sizeof(ContentEntry) + entry->hlength + entry->size;
+}
+
+static void content_free(ContentEntry *entry) {
+    free(entry->path);
+    free(entry->head);
+    free(entry->body);
+    free(entry);
+}
+
+/**
+ * Record an access in the frequency sketch (must hold ContentLock).
+ *
+ * @param   hash        Hash of path.
+ *
+ * This is a count-min sketch of small saturating counters.  Every
+ * CONTENT_SKETCH_SAMPLE accesses all counters are halved, so the sketch
+ * tracks recent popularity rather than all-time popularity.
+ **/
+static void content_sketch_add(size_t hash) {
+    for (size_t row = 0; row < CONTENT_SKETCH_ROWS; row++) {
+        uint8_t *counter = &ContentSketch[row][(hash >> (row * 16)) & (CONTENT_SKETCH_WIDTH - 1)];
+        if (*counter < CONTENT_SKETCH_MAX) {
+            (*counter)++;
+        }
+    }
+
+    if (++ContentSamples == CONTENT_SKETCH_SAMPLE) {
+        for (size_t row = 0; row < CONTENT_SKETCH_ROWS; row++) {
+            for (size_t i = 0; i < CONTENT_SKETCH_WIDTH; i++) {
+                ContentSketch[row][i] >>= 1;
+            }
+        }
+        ContentSamples = 0;
+    }
+}
+
+/**
+ * Estimate recent access frequency from the sketch (must hold ContentLock).
+ **/
+static unsigned content_sketch_estimate(size_t hash) {
+    unsigned estimate = CONTENT_SKETCH_MAX;
+
+    for (size_t row = 0; row < CONTENT_SKETCH_ROWS; row++) {
+        uint8_t counter = ContentSketch[row][(hash >> (row * 16)) & (CONTENT_SKETCH_WIDTH - 1)];
+        if (counter < estimate) {
+            estimate = counter;
+        }
+    }
+
+    return estimate;
+}
+
+/**
+ * Find entry for path (must hold ContentLock).
+ **/
+static ContentEntry * content_find(const char *path, size_t hash) {
+    LRUNode *node = lru_chain(&ContentTable, hash);
+    while (node && (node->hash != hash || !streq(lru_entry(node, ContentEntry)->path, path))) {
+        node = node->chain;
+    }
+    return lru_entry(node, ContentEntry);
+}
+
+/**
+ * Read file into a new entry with its headers rendered.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   mimetype    Mime-type of file.
+ * @param   extra       Further header lines (see content_respond).
+ * @param   hash        Hash of path.
+ * @return  Newly allocated entry with one reference, or NULL on failure.
+ **/
+static ContentEntry * content_load(Request *r, const char *mimetype, const char *extra, size_t hash) {
+    struct stat  *st    = &r->file->st;
+    ContentEntry *entry = calloc(1, sizeof(ContentEntry));
+    if (!entry) {
+        return NULL;
+    }
+
+    entry->path     = strdup(r->path);
+    entry->mimetype = mimetype;
+    entry->ino      = st->st_ino;
+    entry->mtime    = st->st_mtim;
+    entry->size     = st->st_size;
+    entry->body     = malloc(st->st_size ? st->st_size : 1);
+    entry->node.hash = hash;
+    entry->node.refs = 1;
+
+    int hlength = asprintf(&entry->head, CONTENT_HEAD, mimetype, (long long)st->st_size, extra);
+    if (!entry->path || !entry->body || hlength < 0) {
+        if (hlength < 0) entry->head = NULL;
+        content_free(entry);
+        return NULL;
+    }
+    entry->hlength   = hlength;
+    entry->node.cost = content_cost(entry);
+
+    off_t offset = 0;
+    while (offset < st->st_size) {
+        ssize_t nread = pread(r->file->fd, entry->body + offset, st->st_size - offset, offset);
+        if (nread <= 0) {
+            content_free(entry);
+            return NULL;
+        }
+        offset += nread;
+    }
+
+    return entry;
+}
+
+/**
+ * Decide whether an entry would be admitted (must hold ContentLock).
+ *
+ * @param   cost        Bytes the entry would hold (see content_cost).
+ * @param   hash        Hash of path.
+ * @return  Whether the entry fits, or may push out enough others to fit.
+ *
+ * TinyLFU: a candidate that does not fit in the free part of the budget is
+ * only admitted if it has been requested more often recently than every
+ * least recently used entry it would push out.
+ **/
+static bool content_admissible(size_t cost, size_t hash) {
+    unsigned frequency = content_sketch_estimate(hash);
+
+    if (cost > ContentBudget) {
+        return false;
+    }
+
+    size_t freed = 0;
+    for (LRUNode *victim = ContentTable.tail; ContentTable.total - freed + cost > ContentBudget; victim = victim->prev) {
+        if (content_sketch_estimate(victim->hash) >= frequency) {
+            return false;
+        }
+        freed += victim->cost;
+    }
+
+    return true;
+}
+
+/**
+ * Admit entry and make room for it, if it is admissible (must hold
+ * ContentLock).
+ *
+ * @param   entry       Candidate entry.
+ * @param   evicted     List that evicted entries which must be freed are
+ * pushed onto (see lru_discard).
+ * @return  Whether the entry was inserted.
+ **/
+static bool content_admit(ContentEntry *entry, LRUNode **evicted) {
+    if (!content_admissible(entry->node.cost, entry->node.hash)) {
+        return false;
+    }
+
+    lru_insert(&ContentTable, &entry->node);
+    lru_evict(&ContentTable, ContentBudget, evicted);
+    return true;
+}
+
+/* Functions */
+
+/**
+ * Respond to a file request from the hot content cache.
+ *
+ * @param   r           HTTP Request structure (for a regular, readable file).
+ * @param   mimetype    Mime-type of file.
+ * @param   extra       Further header lines, as passed to write_headers
+ * (these only change along with the file or its mime-type).
+ * @return  Whether the response was written (otherwise the caller must send
+ * the file itself).
+ *
+ * Small, frequently requested files are kept in memory together with their
+ * Content-Type and Content-Length headers, so a hit only copies the status
+ * line, the pre-rendered headers, the Connection header, and the body into
+ * the connection's output buffer: there is no file I/O and no formatting,
+ * and a batch of (pipelined) hits goes out with a single write.  The bytes
+ * are identical to what write_headers and the file itself would produce.
+ *
+ * A miss is only read in if the cache would admit it (see
+ * content_admissible); files that are not requested often enough to earn a
+ * place are left to the caller.  Entries are dropped once the file is
+ * replaced or its modification time or size changes (as seen by
+ * cache_lookup), or its mime-type is reloaded.
+ **/
+bool content_respond(Request *r, const char *mimetype, const char *extra) {
+    struct stat  *st      = &r->file->st;
+    ContentEntry *entry   = NULL;
+    LRUNode      *evicted = NULL;
+
+    if (ContentBudget == 0 || r->file->fd < 0 || st->st_size > CONTENT_MAX_SIZE) {
+        return false;
+    }
+
+    size_t hash = hash_string(r->path);
+
+    pthread_mutex_lock(&ContentLock);
+    content_sketch_add(hash);
+
+    entry = content_find(r->path, hash);
+    if (entry && (entry->size != st->st_size || entry->mimetype != mimetype || entry->ino != st->st_ino ||
+                  entry->mtime.tv_sec != st->st_mtim.tv_sec || entry->mtime.tv_nsec != st->st_mtim.tv_nsec)) {
+        lru_discard(&ContentTable, &entry->node, &evicted);
+        entry = NULL;
+    }
+
+    /* A miss the cache would not admit anyway is left to the caller (which
+     * sends the file without reading it in) */
+
+    bool admissible = true;
+    if (entry) {
+        entry->node.refs++;
+        ContentHits++;
+    } else {
+        ContentMisses++;
+        if (!(admissible = content_admissible(sizeof(ContentEntry) + st->st_size +
+                snprintf(NULL, 0, CONTENT_HEAD, mimetype, (long long)st->st_size, extra), hash))) {
+            ContentRejected++;
+        }
+    }
+    pthread_mutex_unlock(&ContentLock);
+    stats_cache(STATS_CACHE_CONTENT, entry != NULL);
+
+    if (!admissible) {
+        goto done;
+    }
+
+    /* Miss: load file and offer it for admission */
+
+    if (!entry) {
+        entry = content_load(r, mimetype, extra, hash);
+        if (!entry) {
+            goto done;
+        }
+
+        pthread_mutex_lock(&ContentLock);
+        if (content_find(r->path, hash) || !content_admit(entry, &evicted)) {
+            ContentRejected++;
+        }
+        pthread_mutex_unlock(&ContentLock);
+    }
+
+    /* Write pre-rendered response */
+
+    FILE *stream = r->connection->stream;
+    fputs(ContentStatus[r->version == 1], stream);
+    fwrite(entry->head, 1, entry->hlength, stream);
+    fputs(ContentConnection[r->keep_alive], stream);
+    request_headers_end(r);
+    fwrite(entry->body, 1, entry->size, stream);
+
+    pthread_mutex_lock(&ContentLock);
+    if (--entry->node.refs == 0) {
+        entry->node.chain = evicted;
+        evicted = &entry->node;
+    }
+    pthread_mutex_unlock(&ContentLock);
+
+done:
+    while (evicted) {
+        LRUNode *next = evicted->chain;
+        content_free(lru_entry(evicted, ContentEntry));
+        evicted = next;
+    }
+
+    return entry != NULL;
+}
+
+/**
+ * Retrieve hot content cache counters.
+ *
+ * @param   hits        Where to store the number of hits.
+ * @param   misses      Where to store the number of misses.
+ * @param   rejected    Where to store the number of misses not admitted.
+ * @param   bytes       Where to store the number of bytes cached.
+ **/
+void content_stats(size_t *hits, size_t *misses, size_t *rejected, size_t *bytes) {
+    pthread_mutex_lock(&ContentLock);
+    *hits     = ContentHits;
+    *misses   = ContentMisses;
+    *rejected = ContentRejected;
+    *bytes    = ContentTable.total;
+    pthread_mutex_unlock(&ContentLock);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
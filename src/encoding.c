@@ -0,0 +1,388 @@
+/* encoding.c: HTTP Content Encoding */
+
+#include "spidey.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include <zlib.h>
+
+/* Constants */
+
+#define ENCODING_MIN_SIZE   256         /* Smallest file worth compressing */
+#define ENCODING_LEVEL      9           /* Output is cached, so compress hard */
+
+/* Compressed Files */
+
+typedef struct encoding_entry EncodingEntry;
+struct encoding_entry {
+    LRUNode       node;                 /*< Hash (of path and encoding), cost and LRU links */
+    char         *path;                 /*< Real path of file */
+    Encoding      encoding;             /*< Content coding of body */
+    ino_t         ino;                  /*< Inode of compressed contents */
+    struct timespec mtime;              /*< Modification time of compressed contents */
+    off_t         size;                 /*< Size of compressed contents */
+
+    char         *body;                 /*< Compressed contents (NULL if not worth it) */
+    off_t         length;               /*< Length of body */
+};
+
+/* Globals */
+
+static pthread_mutex_t EncodingLock = PTHREAD_MUTEX_INITIALIZER;
+
+static LRUNode  *EncodingBuckets[256];
+static LRUTable EncodingTable = LRU_TABLE(EncodingBuckets);    /* Cached entries (costing their bytes) */
+
+static size_t EncodingHits   = 0;
+static size_t EncodingMisses = 0;
+static size_t EncodingIn     = 0;       /* Bytes compressed */
+static size_t EncodingOut    = 0;       /* Bytes they compressed to */
+
+static const char *EncodingNames[] = { "identity", "gzip", "deflate" };
+
+/* Internal Functions */
+
+static inline size_t encoding_cost(EncodingEntry *entry) {
+    return sizeof(EncodingEntry) + (entry->body ? entry->length : 0);
+}
+
+static void encoding_free(EncodingEntry *entry) {
+    free(entry->path);
+    free(entry->body);
+    free(entry);
+}
+
+/**
+ * Find entry for path and encoding (must hold EncodingLock).
+ **/
+static EncodingEntry * encoding_find(const char *path, Encoding encoding, size_t hash) {
+    LRUNode *node = lru_chain(&EncodingTable, hash);
+    while (node && (node->hash != hash || lru_entry(node, EncodingEntry)->encoding != encoding ||
+                    !streq(lru_entry(node, EncodingEntry)->path, path))) {
+        node = node->chain;
+    }
+    return lru_entry(node, EncodingEntry);
+}
+
+/**
+ * Read and compress file into a new entry.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   encoding    Content coding to compress with.
+ * @param   hash        Hash of path and encoding.
+ * @return  Newly allocated entry with one reference (whose body is NULL if
+ * compressing does not make the file smaller), or NULL on failure.
+ **/
+static EncodingEntry * encoding_load(Request *r, Encoding encoding, size_t hash) {
+    struct stat   *st    = &r->file->st;
+    EncodingEntry *entry = calloc(1, sizeof(EncodingEntry));
+    char          *data  = malloc(st->st_size);
+    z_stream       z     = {0};
+
+    if (!entry || !data || !(entry->path = strdup(r->path))) {
+        goto failure;
+    }
+
+    entry->encoding = encoding;
+    entry->ino      = st->st_ino;
+    entry->mtime    = st->st_mtim;
+    entry->size     = st->st_size;
+    entry->node.hash = hash;
+    entry->node.refs = 1;
+
+    off_t offset = 0;
+    while (offset < st->st_size) {
+        ssize_t nread = pread(r->file->fd, data + offset, st->st_size - offset, offset);
+        if (nread <= 0) {
+            goto failure;
+        }
+        offset += nread;
+    }
+
+    /* windowBits of 15 gives the zlib format (which is what HTTP calls
+     * deflate); adding 16 gives the gzip format */
+
+    if (deflateInit2(&z, ENCODING_LEVEL, Z_DEFLATED, encoding == ENCODING_GZIP ? 31 : 15,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        goto failure;
+    }
+
+    uLong bound = deflateBound(&z, st->st_size);
+    if (!(entry->body = malloc(bound))) {
+        deflateEnd(&z);
+        goto failure;
+    }
+
+    z.next_in   = (Bytef *)data;
+    z.avail_in  = st->st_size;
+    z.next_out  = (Bytef *)entry->body;
+    z.avail_out = bound;
+
+    int status = deflate(&z, Z_FINISH);
+    entry->length = z.total_out;
+    deflateEnd(&z);
+    free(data);
+
+    if (status != Z_STREAM_END || entry->length >= st->st_size) {
+        free(entry->body);
+        entry->body = NULL;
+    } else {
+        char *body = realloc(entry->body, entry->length);
+        entry->body = body ? body : entry->body;
+    }
+
+    entry->node.cost = encoding_cost(entry);
+    return entry;
+
+failure:
+    free(data);
+    if (entry) {
+        encoding_free(entry);
+    }
+    return NULL;
+}
+
+/**
+ * Determine whether a mime-type is worth compressing.
+ **/
+static bool encoding_compressible(const char *mimetype) {
+    static const char *Types[] = {
+        "application/javascript", "application/json", "application/xml",
+        "application/x-javascript", "application/ecmascript", NULL,
+    };
+
+    if (strncmp(mimetype, "text/", 5) == 0) {
+        return true;
+    }
+
+    for (const char **type = Types; *type; type++) {
+        if (streq(mimetype, *type)) {
+            return true;
+        }
+    }
+
+    const char *suffix = strrchr(mimetype, '+');
+    return suffix && (streq(suffix, "+xml") || streq(suffix, "+json"));
+}
+
+/**
+ * Parse the quality value of an Accept-Encoding element.
+ *
+ * @param   params      Parameters following the coding (e.g. ";q=0.5").
+ * @param   end         End of the element.
+ * @return  Quality value in thousandths (1000 if there is none).
+ **/
+static int encoding_quality(const char *params, const char *end) {
+    const char *q = params;
+
+    while ((q = memchr(q, ';', end - q))) {
+        q = skip_whitespace((char *)q + 1);
+        if ((*q == 'q' || *q == 'Q') && q[1] == '=') {
+            q += 2;
+            int quality = (*q == '1') ? 1000 : 0;
+            if (*q == '0' && *++q == '.') {
+                for (int scale = 100; scale && *++q >= '0' && *q <= '9'; scale /= 10) {
+                    quality += (*q - '0') * scale;
+                }
+            }
+            return quality;
+        }
+    }
+
+    return 1000;
+}
+
+/* Functions */
+
+/**
+ * Choose the content coding of a file response.
+ *
+ * @param   r           HTTP Request structure (for a regular file).
+ * @param   mimetype    Mime-type of file.
+ * @return  Preferred coding the client accepts (by quality value, and gzip
+ * over deflate), or ENCODING_IDENTITY.
+ *
+ * Only compressible mime-types of at least ENCODING_MIN_SIZE bytes are
+ * compressed, and only when Compress is on.  Range requests are always
+ * answered from the file as is, so that byte positions mean the same thing
+ * to every client.
+ **/
+Encoding encoding_negotiate(Request *r, const char *mimetype) {
+    const char *accept = request_header(r, "Accept-Encoding");
+    int quality[] = { 0, -1, -1 };      /* Unlisted codings go by "*" (if any) */
+    int any = 0;
+
+    if (!encoding_vary(mimetype) || !accept || r->file->st.st_size < ENCODING_MIN_SIZE ||
+        request_header(r, "Range")) {
+        return ENCODING_IDENTITY;
+    }
+
+    while (*(accept = skip_whitespace((char *)accept))) {
+        const char *end    = strchrnul(accept, ',');
+        size_t      length = strcspn(accept, ";, \t");
+        int         q      = encoding_quality(accept + length, end);
+
+        if ((length == 4 && strncasecmp(accept, "gzip", 4) == 0) ||
+            (length == 6 && strncasecmp(accept, "x-gzip", 6) == 0)) {
+            quality[ENCODING_GZIP] = q;
+        } else if (length == 7 && strncasecmp(accept, "deflate", 7) == 0) {
+            quality[ENCODING_DEFLATE] = q;
+        } else if (length == 1 && *accept == '*') {
+            any = q;
+        }
+
+        accept = *end ? end + 1 : end;
+    }
+
+    if (quality[ENCODING_GZIP] < 0)    quality[ENCODING_GZIP]    = any;
+    if (quality[ENCODING_DEFLATE] < 0) quality[ENCODING_DEFLATE] = any;
+
+    if (quality[ENCODING_GZIP] > 0 && quality[ENCODING_GZIP] >= quality[ENCODING_DEFLATE]) {
+        return ENCODING_GZIP;
+    }
+    return quality[ENCODING_DEFLATE] > 0 ? ENCODING_DEFLATE : ENCODING_IDENTITY;
+}
+
+/**
+ * Determine whether responses with a mime-type depend on Accept-Encoding.
+ *
+ * @param   mimetype    Mime-type of file.
+ * @return  Whether the response must carry "Vary: Accept-Encoding".
+ **/
+bool encoding_vary(const char *mimetype) {
+    return Compress && encoding_compressible(mimetype);
+}
+
+/**
+ * Name a content coding (as in Content-Encoding).
+ **/
+const char * encoding_name(Encoding encoding) {
+    return EncodingNames[encoding];
+}
+
+/**
+ * Get a reference to the compressed contents of a file.
+ *
+ * @param   r           HTTP Request structure (for a regular, readable file).
+ * @param   encoding    Content coding to compress with (gzip or deflate).
+ * @param   encoded     Where to store the compressed body, its length and
+ * its entity tag.
+ * @return  Whether there is a compressed body (to be released with
+ * encoding_release), or the file must be sent as is because it is too
+ * large, cannot be read, or does not get any smaller.
+ *
+ * Files are compressed once and kept, least recently used first, within
+ * ENCODING_BUDGET bytes; files that do not compress are remembered too, so
+ * they are not compressed again.  Entries are dropped once the file is
+ * replaced or its modification time or size changes (as seen by
+ * cache_lookup).  The entity tag is that of the file with the coding
+ * appended, so it differs from the tag of the file as is.
+ **/
+bool encoding_acquire(Request *r, Encoding encoding, Encoded *encoded) {
+    struct stat   *st      = &r->file->st;
+    EncodingEntry *entry   = NULL;
+    LRUNode       *evicted = NULL;
+
+    if (r->file->fd < 0 || st->st_size > ENCODING_MAX_SIZE) {
+        return false;
+    }
+
+    size_t hash = hash_string(r->path) ^ encoding;
+
+    pthread_mutex_lock(&EncodingLock);
+    entry = encoding_find(r->path, encoding, hash);
+    if (entry && (entry->size != st->st_size || entry->ino != st->st_ino ||
+                  entry->mtime.tv_sec != st->st_mtim.tv_sec || entry->mtime.tv_nsec != st->st_mtim.tv_nsec)) {
+        lru_discard(&EncodingTable, &entry->node, &evicted);
+        entry = NULL;
+    }
+
+    if (entry) {
+        entry->node.refs++;
+        EncodingHits++;
+    } else {
+        EncodingMisses++;
+    }
+    pthread_mutex_unlock(&EncodingLock);
+    stats_cache(STATS_CACHE_ENCODING, entry != NULL);
+
+    /* Miss: compress file and cache it (replacing any entry compressed
+     * concurrently) */
+
+    if (!entry && (entry = encoding_load(r, encoding, hash))) {
+        pthread_mutex_lock(&EncodingLock);
+        EncodingEntry *other = encoding_find(r->path, encoding, hash);
+        if (other) {
+            lru_discard(&EncodingTable, &other->node, &evicted);
+        }
+        lru_insert(&EncodingTable, &entry->node);
+        lru_evict(&EncodingTable, ENCODING_BUDGET, &evicted);
+        EncodingIn  += entry->size;
+        EncodingOut += entry->body ? entry->length : entry->size;
+        pthread_mutex_unlock(&EncodingLock);
+    }
+
+    while (evicted) {
+        LRUNode *next = evicted->chain;
+        encoding_free(lru_entry(evicted, EncodingEntry));
+        evicted = next;
+    }
+
+    if (entry && !entry->body) {
+        encoded->entry = entry;
+        encoding_release(encoded);
+        entry = NULL;
+    }
+
+    if (!entry) {
+        return false;
+    }
+
+    size_t tlength = strlen(r->file->etag) - 1;
+    snprintf(encoded->etag, sizeof(encoded->etag), "%.*s-%s\"",
+        (int)tlength, r->file->etag, EncodingNames[encoding]);
+    encoded->body   = entry->body;
+    encoded->length = entry->length;
+    encoded->entry  = entry;
+    return true;
+}
+
+/**
+ * Release a reference to compressed contents.
+ *
+ * @param   encoded     Compressed body (see encoding_acquire).
+ **/
+void encoding_release(Encoded *encoded) {
+    EncodingEntry *entry = (EncodingEntry *)encoded->entry;
+
+    pthread_mutex_lock(&EncodingLock);
+    bool last = --entry->node.refs == 0;
+    pthread_mutex_unlock(&EncodingLock);
+
+    if (last) {
+        encoding_free(entry);
+    }
+}
+
+/**
+ * Retrieve compression counters.
+ *
+ * @param   hits        Where to store the number of responses compressed
+ * earlier.
+ * @param   misses      Where to store the number of files compressed.
+ * @param   ratio       Where to store how many times smaller files got.
+ * @param   bytes       Where to store the number of bytes cached.
+ **/
+void encoding_stats(size_t *hits, size_t *misses, double *ratio, size_t *bytes) {
+    pthread_mutex_lock(&EncodingLock);
+    *hits   = EncodingHits;
+    *misses = EncodingMisses;
+    *ratio  = EncodingOut ? (double)EncodingIn / EncodingOut : 0.0;
+    *bytes  = EncodingTable.total;
+    pthread_mutex_unlock(&EncodingLock);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
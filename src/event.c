@@ -0,0 +1,435 @@
+/* event.c: Event-Driven HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define EVENT_MAX_EVENTS    256
+#define EVENT_QUEUE_SIZE    1024        /* Clients waiting for (or handed back by) workers */
+
+/* Event Clients */
+
+typedef struct EventClient EventClient;
+struct EventClient {
+    Connection  *connection;            /*< Client connection */
+    uint32_t     events;                /*< Events watched for (0 while with a worker) */
+    bool         eof;                   /*< Client has stopped sending */
+    bool         closing;               /*< Close once queued output is sent */
+    time_t       active;                /*< Time of last activity */
+    EventClient *prev;                  /*< Previous (less recently active) client */
+    EventClient *next;                  /*< Next (more recently active) client */
+};
+
+typedef struct {
+    EventClient *head;                  /*< Least recently active client */
+    EventClient *tail;                  /*< Most recently active client */
+} EventClients;
+
+/* Event Loop */
+
+typedef struct {
+    int          efd;                   /*< Epoll file descriptor */
+    int          wfd;                   /*< Eventfd workers wake the loop with */
+    Queue       *work;                  /*< Clients with requests that may block */
+    Queue       *done;                  /*< Clients workers are finished with */
+    EventClients clients;               /*< Clients on the loop */
+} EventLoop;
+
+/* Internal Functions */
+
+static void event_clients_remove(EventClients *clients, EventClient *client) {
+    if (client->prev) client->prev->next = client->next;
+    else              clients->head      = client->next;
+    if (client->next) client->next->prev = client->prev;
+    else              clients->tail      = client->prev;
+    client->prev = client->next = NULL;
+}
+
+static void event_clients_append(EventClients *clients, EventClient *client) {
+    client->active = time(NULL);
+    client->prev   = clients->tail;
+    client->next   = NULL;
+    if (clients->tail) clients->tail->next = client;
+    else               clients->head       = client;
+    clients->tail  = client;
+}
+
+/**
+ * Change the events a client is watched for.
+ *
+ * @param   loop        Event loop.
+ * @param   client      Event client.
+ * @param   events      Events to watch for (0 takes the client off the loop).
+ * @return  Whether the epoll set could be updated.
+ **/
+static bool event_client_watch(EventLoop *loop, EventClient *client, uint32_t events) {
+    struct epoll_event event = {
+        .events   = events,
+        .data.ptr = client,
+    };
+    int op = !client->events ? EPOLL_CTL_ADD : !events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+
+    if (events == client->events) {
+        return true;
+    }
+
+    if (epoll_ctl(loop->efd, op, client->connection->fd, &event) < 0) {
+        log("Unable to update client in event loop: %s", strerror(errno));
+        return false;
+    }
+
+    client->events = events;
+    return true;
+}
+
+/**
+ * Close a client connection and forget about it.
+ *
+ * @param   loop        Event loop.
+ * @param   client      Client to close (freed).
+ *
+ * The socket is taken out of the epoll set before it is closed, since a CGI
+ * child a worker forked (and has yet to exec) may hold a copy of it, which
+ * would otherwise keep it registered.
+ **/
+static void event_client_close(EventLoop *loop, EventClient *client) {
+    event_client_watch(loop, client, 0);
+    event_clients_remove(&loop->clients, client);
+    free_connection(client->connection);
+    free(client);
+}
+
+/**
+ * Accept all pending clients and register them with the event loop.
+ *
+ * @param   loop        Event loop.
+ * @param   sfd         Server socket file descriptor (non-blocking).
+ **/
+static void event_accept_clients(EventLoop *loop, int sfd) {
+    Connection *c;
+
+    while ((c = accept_connection(sfd))) {
+        EventClient *client = calloc(1, sizeof(EventClient));
+        if (!client) {
+            log("Unable to allocate client: %s", strerror(errno));
+            free_connection(c);
+            continue;
+        }
+        client->connection = c;
+
+        if (!connection_nonblock(c)) {
+            log("Unable to make client socket non-blocking: %s", strerror(errno));
+            free_connection(c);
+            free(client);
+            continue;
+        }
+
+        if (!event_client_watch(loop, client, EPOLLIN | EPOLLRDHUP)) {
+            free_connection(c);
+            free(client);
+            continue;
+        }
+
+        event_clients_append(&loop->clients, client);
+    }
+}
+
+/**
+ * Handle whatever requests are buffered on a client, then decide what the
+ * client waits for next.
+ *
+ * @param   loop        Event loop.
+ * @param   client      Event client (on the loop).
+ *
+ * Requests are handled on the loop until one may block (see
+ * request_blocks), which hands the client to a worker thread, or until
+ * output is queued (see connection_send), which has the client wait for its
+ * socket to drain.  If the work queue is full, the requests that may block
+ * are handled right here, waiting for the client as in the other modes.
+ **/
+static void event_client_serve(EventLoop *loop, EventClient *client) {
+    Connection *c    = client->connection;
+    bool        open = handle_requests(c, client->eof);
+
+    if (connection_queued(c)) {
+        client->closing = !open;
+        if (!event_client_watch(loop, client, EPOLLOUT)) {
+            event_client_close(loop, client);
+        }
+        return;
+    }
+
+    if (!open) {
+        event_client_close(loop, client);
+        return;
+    }
+
+    if (connection_ready(c) || (client->eof && c->offset < c->length)) {
+        if (event_client_watch(loop, client, 0)) {
+            event_clients_remove(&loop->clients, client);
+            if (queue_offer(loop->work, client)) {
+                return;
+            }
+            event_clients_append(&loop->clients, client);
+        }
+
+        c->queueing = false;
+        open = handle_requests(c, client->eof);
+        c->queueing = true;
+        if (!open) {
+            event_client_close(loop, client);
+            return;
+        }
+    }
+
+    if (!event_client_watch(loop, client, EPOLLIN | EPOLLRDHUP)) {
+        event_client_close(loop, client);
+    }
+}
+
+/**
+ * Read from a client and handle whatever requests are complete.
+ *
+ * @param   loop        Event loop.
+ * @param   client      Event client.
+ * @param   events      Events reported by epoll for the client socket.
+ *
+ * Input is read without blocking and requests are only dispatched once
+ * connection_ready says they are complete, so a slow or idle client never
+ * holds up anyone else while it is still sending.
+ **/
+static void event_client_read(EventLoop *loop, EventClient *client, uint32_t events) {
+    Connection *c = client->connection;
+    ssize_t nread = connection_fill(c, false);
+
+    if (nread < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+        event_client_close(loop, client);
+        return;
+    }
+
+    client->eof = client->eof || nread == 0 || (events & (EPOLLRDHUP | EPOLLHUP));
+    event_client_serve(loop, client);
+}
+
+/**
+ * Send a client's queued output, and once it is all sent, carry on with its
+ * buffered requests (or close it, if the last response asked for that).
+ *
+ * @param   loop        Event loop.
+ * @param   client      Event client (waiting for EPOLLOUT).
+ **/
+static void event_client_write(EventLoop *loop, EventClient *client) {
+    Connection *c = client->connection;
+
+    if (!connection_drain(c) || (!connection_queued(c) && client->closing)) {
+        event_client_close(loop, client);
+    } else if (!connection_queued(c)) {
+        event_client_serve(loop, client);
+    }
+}
+
+/**
+ * Handle requests that may block (see request_blocks) forever.
+ *
+ * @param   arg         Event loop.
+ * @return  Never returns.
+ *
+ * A worker takes a client off the work queue and handles all of its buffered
+ * requests, waiting for its socket (see connection_nonblock) as in the other
+ * modes.  The client is then closed, or handed back to the loop through the
+ * done queue.
+ **/
+static void * event_worker(void *arg) {
+    EventLoop *loop = arg;
+
+    while (true) {
+        EventClient *client = queue_pop(loop->work);
+        Connection  *c      = client->connection;
+
+        c->queueing = false;
+        bool open = handle_requests(c, client->eof);
+        c->queueing = true;
+
+        if (!open) {
+            free_connection(c);
+            free(client);
+            continue;
+        }
+
+        queue_push(loop->done, client);
+        eventfd_write(loop->wfd, 1);
+    }
+
+    return NULL;
+}
+
+/**
+ * Put clients the workers are finished with back on the loop.
+ *
+ * @param   loop        Event loop.
+ **/
+static void event_clients_resume(EventLoop *loop) {
+    eventfd_t   count;
+    EventClient *client;
+
+    eventfd_read(loop->wfd, &count);
+
+    while (queue_poll(loop->done, (void **)&client)) {
+        event_clients_append(&loop->clients, client);
+        if (!event_client_watch(loop, client, EPOLLIN | EPOLLRDHUP)) {
+            event_client_close(loop, client);
+        }
+    }
+}
+
+/**
+ * Close clients that have been idle for longer than KeepAliveTimeout.
+ *
+ * @param   loop        Event loop (with clients least recently active first).
+ *
+ * Clients waiting for their socket to take queued output count as idle
+ * while no output moves.
+ **/
+static void event_clients_expire(EventLoop *loop) {
+    time_t now = time(NULL);
+
+    while (loop->clients.head && now - loop->clients.head->active >= KeepAliveTimeout) {
+        debug("Closing idle connection from %s:%s", loop->clients.head->connection->host, loop->clients.head->connection->port);
+        event_client_close(loop, loop->clients.head);
+    }
+}
+
+/**
+ * Multiplex all client connections over a single epoll event loop.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @param   nworkers    Number of worker threads (for requests that may block).
+ * @return  Exit status of server (EXIT_SUCCESS or EXIT_FAILURE).
+ *
+ * The server socket and every accepted client are made non-blocking, and
+ * clients are kept in order of their last activity so that idle keep-alive
+ * connections can be expired cheaply.  Requests are handled on the loop,
+ * with whatever response output the socket cannot take queued and sent as
+ * EPOLLOUT allows.  Requests that may block (those with a body, and CGI or
+ * FastCGI scripts) are handed to a pool of worker threads instead, which
+ * give the client back to the loop (through an eventfd) once done.
+ **/
+int event_server(int sfd, size_t nworkers) {
+    struct epoll_event events[EVENT_MAX_EVENTS];
+    EventLoop loop = { -1, -1, NULL, NULL, { NULL, NULL } };
+
+    /* Create event loop, worker queues, and register server socket */
+
+    loop.efd  = epoll_create1(EPOLL_CLOEXEC);
+    loop.wfd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    loop.work = queue_create(EVENT_QUEUE_SIZE);
+    loop.done = queue_create(EVENT_QUEUE_SIZE + nworkers);
+    if (loop.efd < 0 || loop.wfd < 0 || !loop.work || !loop.done) {
+        log("Unable to create event loop: %s", strerror(errno));
+        goto fail;
+    }
+
+    int flags = fcntl(sfd, F_GETFL, 0);
+    if (flags < 0 || fcntl(sfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        log("Unable to make server socket non-blocking: %s", strerror(errno));
+        goto fail;
+    }
+
+    struct epoll_event event = {
+        .events   = EPOLLIN,
+        .data.ptr = NULL,                       /* NULL marks the server socket */
+    };
+
+    if (epoll_ctl(loop.efd, EPOLL_CTL_ADD, sfd, &event) < 0) {
+        log("Unable to add server socket to event loop: %s", strerror(errno));
+        goto fail;
+    }
+
+    event.data.ptr = &loop;                     /* The loop marks the eventfd */
+    if (epoll_ctl(loop.efd, EPOLL_CTL_ADD, loop.wfd, &event) < 0) {
+        log("Unable to add eventfd to event loop: %s", strerror(errno));
+        goto fail;
+    }
+
+    /* Start worker threads */
+
+    for (size_t i = 0; i < nworkers; i++) {
+        pthread_t thread;
+        int status = pthread_create(&thread, NULL, event_worker, &loop);
+        if (status != 0) {
+            log("Unable to create worker thread: %s", strerror(status));
+            if (i == 0) {
+                goto fail;
+            }
+            break;
+        }
+        pthread_detach(thread);
+    }
+    log("Started %zu event worker threads", nworkers);
+
+    /* Dispatch events (waking up every second to expire idle clients) */
+    while (true) {
+        int nevents = epoll_wait(loop.efd, events, EVENT_MAX_EVENTS, KeepAliveTimeout > 0 ? 1000 : -1);
+        if (nevents < 0) {
+            if (errno != EINTR) {
+                log("Unable to wait for events: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        for (int i = 0; i < nevents; i++) {
+            EventClient *client = events[i].data.ptr;
+
+            /* Accept new clients, and take back clients from workers */
+
+            if (!client) {
+                event_accept_clients(&loop, sfd);
+                continue;
+            }
+
+            if (client == (EventClient *)&loop) {
+                event_clients_resume(&loop);
+                continue;
+            }
+
+            /* Handle client input, or send queued output */
+
+            event_clients_remove(&loop.clients, client);
+            event_clients_append(&loop.clients, client);
+
+            if (client->events & EPOLLOUT) {
+                event_client_write(&loop, client);
+            } else {
+                event_client_read(&loop, client, events[i].events);
+            }
+        }
+
+        if (KeepAliveTimeout > 0) {
+            event_clients_expire(&loop);
+        }
+    }
+
+fail:
+    /* Close event loop and server socket */
+
+    if (loop.efd >= 0) close(loop.efd);
+    if (loop.wfd >= 0) close(loop.wfd);
+    queue_delete(loop.work);
+    queue_delete(loop.done);
+    close(sfd);
+
+    return EXIT_FAILURE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,744 @@
+/* fastcgi.c: FastCGI Worker Pools */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Protocol (https://fastcgi-archives.github.io/FastCGI_Specification.html) */
+
+#define FCGI_VERSION_1          1
+#define FCGI_BEGIN_REQUEST      1
+#define FCGI_END_REQUEST        3
+#define FCGI_PARAMS             4
+#define FCGI_STDIN              5
+#define FCGI_STDOUT             6
+#define FCGI_STDERR             7
+#define FCGI_RESPONDER          1
+#define FCGI_REQUEST_ID         1       /* One request per connection */
+#define FCGI_MAX_CONTENT        65535
+
+typedef struct {
+    unsigned char version;
+    unsigned char type;
+    unsigned char id[2];                /*< Request ID (big endian) */
+    unsigned char length[2];            /*< Content length (big endian) */
+    unsigned char padding;              /*< Padding length */
+    unsigned char reserved;
+} FastCGIHeader;
+
+/* Constants */
+
+#define FASTCGI_SUFFIX          ".fcgi"
+#define FASTCGI_HEAD_MAX        BUFSIZ  /* Bytes of CGI response headers accepted */
+#define FASTCGI_CONNECT_TRIES   100     /* Attempts at reaching a worker being started */
+
+/* Worker Pools */
+
+typedef struct fastcgi_pool FastCGIPool;
+struct fastcgi_pool {
+    char        *path;                  /*< Executable the workers run */
+    size_t       hash;                  /*< Hash of path (names worker sockets) */
+    pid_t       *pids;                  /*< Worker started by this process, per slot (or 0) */
+    bool        *busy;                  /*< Whether a request of ours is using the slot */
+    size_t       first;                 /*< Slot to try first */
+    FastCGIPool *chain;                 /*< Next pool */
+};
+
+/* Worker Process Group (shared by all server processes) */
+
+typedef struct {
+    pthread_mutex_t lock;               /*< Held while a worker is started */
+    pid_t           pgid;               /*< Process group of the workers (0 = none yet) */
+} FastCGIGroup;
+
+/* Globals */
+
+static FastCGIGroup *Group = NULL;
+
+static pthread_mutex_t FastCGILock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  FastCGIIdle = PTHREAD_COND_INITIALIZER;
+
+static FastCGIPool *FastCGIPools = NULL;
+
+static size_t FastCGIRequests = 0;
+static size_t FastCGIStarted  = 0;
+static size_t FastCGIWaited   = 0;
+static size_t FastCGIFailed   = 0;
+
+/* Internal Functions */
+
+/**
+ * Milliseconds of a monotonic clock.
+ **/
+static inline long long fastcgi_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/**
+ * Find (or create) the pool of an executable (must hold FastCGILock).
+ **/
+static FastCGIPool * fastcgi_pool(const char *path) {
+    size_t       hash = hash_string(path);
+    FastCGIPool *pool = FastCGIPools;
+
+    while (pool && (pool->hash != hash || !streq(pool->path, path))) {
+        pool = pool->chain;
+    }
+    if (pool) {
+        return pool;
+    }
+
+    if (!(pool = calloc(1, sizeof(FastCGIPool))) || !(pool->path = strdup(path)) ||
+        !(pool->pids = calloc(FastCGIWorkers, sizeof(pid_t))) ||
+        !(pool->busy = calloc(FastCGIWorkers, sizeof(bool)))) {
+        if (pool) {
+            free(pool->path);
+            free(pool->pids);
+            free(pool);
+        }
+        return NULL;
+    }
+    pool->hash   = hash;
+    pool->first  = getpid() % FastCGIWorkers;
+    pool->chain  = FastCGIPools;
+    FastCGIPools = pool;
+    return pool;
+}
+
+/**
+ * Name the socket of a worker slot in the abstract namespace.
+ *
+ * @return  Length of the address.
+ *
+ * The name is shared by every process of this server (same process group
+ * and port), so in the forking and prefork modes all processes use the same
+ * workers, which serve their connections one at a time.
+ **/
+static socklen_t fastcgi_address(FastCGIPool *pool, size_t slot, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    int length = snprintf(address->sun_path + 1, sizeof(address->sun_path) - 1, "spidey-fastcgi/%d/%s/%016zx/%zu",
+        (int)getpgrp(), Port, pool->hash, slot);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + length;
+}
+
+/**
+ * Lock the worker process group (taking over the lock of a process that died
+ * holding it).
+ **/
+static void fastcgi_group_lock(void) {
+    if (pthread_mutex_lock(&Group->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&Group->lock);
+    }
+}
+
+/**
+ * Start a worker listening on the socket of a slot.
+ *
+ * @return  Whether the socket is (now) being listened on, by this worker or
+ * by one that another process started first.
+ *
+ * The listening socket is the worker's stdin (as FastCGI prescribes) and its
+ * environment only holds PATH; request variables arrive with each request.
+ * Every other descriptor is closed, whether or not it is close-on-exec.
+ * Once started, the worker holds the only descriptor of the socket, so the
+ * name is freed when it exits (or crashes) and the next request through the
+ * slot starts a new one.
+ *
+ * All workers (of every server process) join one process group, so that
+ * fastcgi_stop can stop them together.  The group is created by the first
+ * worker, and again once all of its workers have exited.
+ **/
+static bool fastcgi_start(FastCGIPool *pool, size_t slot, struct sockaddr_un *address, socklen_t length) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t          attributes;
+    sigset_t                   defaults, mask;
+    pid_t                      pid;
+    const char                *path = getenv("PATH");
+    char                       variable[BUFSIZ];
+    char                      *argv[] = { pool->path, NULL };
+    char                      *envp[] = { variable, NULL };
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    if (bind(fd, (struct sockaddr *)address, length) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return errno == EADDRINUSE;
+    }
+
+    snprintf(variable, sizeof(variable), "PATH=%s", path ? path : "/usr/local/bin:/usr/bin:/bin");
+    sigemptyset(&mask);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    sigaddset(&defaults, SIGCHLD);
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fd, STDIN_FILENO);
+    posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setsigdefault(&attributes, &defaults);
+    posix_spawnattr_setsigmask(&attributes, &mask);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+
+    if (Group) {
+        fastcgi_group_lock();
+    }
+
+    pid_t group = Group ? Group->pgid : 0;
+    posix_spawnattr_setpgroup(&attributes, group);
+    int status = posix_spawn(&pid, pool->path, &actions, &attributes, argv, envp);
+
+    if (status == EPERM && group) {     /* The group is gone: start another */
+        posix_spawnattr_setpgroup(&attributes, group = 0);
+        status = posix_spawn(&pid, pool->path, &actions, &attributes, argv, envp);
+    }
+
+    if (Group) {
+        if (status == 0) {
+            Group->pgid = group ? group : pid;
+        }
+        pthread_mutex_unlock(&Group->lock);
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    close(fd);
+
+    if (status != 0) {
+        debug("Unable to spawn %s: %s", pool->path, strerror(status));
+        return false;
+    }
+
+    /* Reap the worker this one replaces (if it was ours) */
+
+    if (pool->pids[slot] > 0) {
+        waitpid(pool->pids[slot], NULL, WNOHANG);
+    }
+    pool->pids[slot] = pid;
+    __atomic_add_fetch(&FastCGIStarted, 1, __ATOMIC_RELAXED);
+    stats_spawn(STATS_SPAWN_FASTCGI);
+    debug("Started FastCGI worker %d for %s (slot %zu)", pid, pool->path, slot);
+    return true;
+}
+
+/**
+ * Connect to the worker of a slot, starting one if there is none.
+ *
+ * @return  Connected socket, or -1 on failure.
+ **/
+static int fastcgi_connect(FastCGIPool *pool, size_t slot) {
+    struct sockaddr_un address;
+    socklen_t          length = fastcgi_address(pool, slot, &address);
+
+    for (int tries = 0; tries < FASTCGI_CONNECT_TRIES; tries++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr *)&address, length) == 0) {
+            return fd;
+        }
+        close(fd);
+
+        if (tries > 0) {
+            usleep(1000);               /* Another process is starting it */
+        } else if (!fastcgi_start(pool, slot, &address, length)) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Write all of a buffer (or fail).
+ **/
+static bool fastcgi_send(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t nwritten = writev(fd, iov, count);
+        if (nwritten < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nwritten <= 0) {
+            return false;
+        }
+        while (count > 0 && (size_t)nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return true;
+}
+
+/**
+ * Write data as records of a type (an empty record if length is 0).
+ **/
+static bool fastcgi_write(int fd, unsigned char type, const void *data, size_t length) {
+    do {
+        size_t        size   = length < FCGI_MAX_CONTENT ? length : FCGI_MAX_CONTENT;
+        FastCGIHeader header = {
+            .version = FCGI_VERSION_1, .type = type,
+            .id      = { 0, FCGI_REQUEST_ID },
+            .length  = { size >> 8, size & 0xff },
+        };
+        struct iovec iov[] = {
+            { .iov_base = &header, .iov_len = sizeof(header) },
+            { .iov_base = (void *)data, .iov_len = size },
+        };
+        if (!fastcgi_send(fd, iov, 2)) {
+            return false;
+        }
+        data    = (const char *)data + size;
+        length -= size;
+    } while (length > 0);
+    return true;
+}
+
+/**
+ * Read exactly length bytes (or fail), before a deadline (in fastcgi_now
+ * milliseconds, 0 for none).
+ **/
+static bool fastcgi_read(int fd, void *data, size_t length, long long deadline) {
+    while (length > 0) {
+        if (deadline) {
+            struct pollfd pfd     = { .fd = fd, .events = POLLIN };
+            long long     timeout = deadline - fastcgi_now();
+            int           ready   = timeout > 0 ? poll(&pfd, 1, timeout) : 0;
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ready <= 0) {
+                return false;
+            }
+        }
+
+        ssize_t nread = read(fd, data, length);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            return false;
+        }
+        data    = (char *)data + nread;
+        length -= nread;
+    }
+    return true;
+}
+
+/**
+ * Send the request (its variables and body) to a worker.
+ *
+ * Variables are encoded as FastCGI name-value pairs: each length in one byte
+ * below 128, otherwise in four with the top bit set.
+ **/
+static bool fastcgi_request(Request *r, int fd) {
+    static const unsigned char begin[8] = { 0, FCGI_RESPONDER, 0 };
+    char      **environment = cgi_environment(r);
+    char       *params = NULL;
+    size_t      plength = 0;
+    FILE       *stream;
+    const char *data;
+    size_t      length;
+
+    if (!environment || !(stream = open_memstream(&params, &plength))) {
+        return false;
+    }
+    for (char **variable = environment; *variable; variable++) {
+        char  *equals = strchr(*variable, '=');
+        size_t lengths[] = { equals - *variable, strlen(equals + 1) };
+
+        for (int i = 0; i < 2; i++) {
+            if (lengths[i] < 128) {
+                fputc(lengths[i], stream);
+            } else {
+                fputc(0x80 | (lengths[i] >> 24), stream);
+                fputc(lengths[i] >> 16, stream);
+                fputc(lengths[i] >> 8, stream);
+                fputc(lengths[i], stream);
+            }
+        }
+        fwrite(*variable, 1, lengths[0], stream);
+        fwrite(equals + 1, 1, lengths[1], stream);
+    }
+    fclose(stream);
+
+    bool sent = fastcgi_write(fd, FCGI_BEGIN_REQUEST, begin, sizeof(begin)) &&
+                fastcgi_write(fd, FCGI_PARAMS, params, plength) &&
+                fastcgi_write(fd, FCGI_PARAMS, NULL, 0);
+    free(params);
+
+    while (sent && (data = request_body_next(r, &r->body, &length))) {
+        sent = fastcgi_write(fd, FCGI_STDIN, data, length);
+        request_body_consume(r, &r->body, length);
+    }
+    return sent && fastcgi_write(fd, FCGI_STDIN, NULL, 0);
+}
+
+/**
+ * Translate the CGI headers of a response into an HTTP response head.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   head        CGI headers (up to and including the blank line).
+ * @param   length      Where to store the Content-Length given (-1 if none).
+ * @return  Whether the body is sent chunked.
+ *
+ * The Status header (200 OK if there is none) becomes the status line.
+ * Without a Content-Length the body is sent chunked to HTTP/1.1 clients, and
+ * ends with the connection otherwise.
+ **/
+static bool fastcgi_head(Request *r, const char *head, off_t *length) {
+    FILE       *stream  = r->connection->stream;
+    const char *status  = "200 OK";
+    int         slength = 6;
+    const char *line, *next;
+    int         n;
+
+    /* Each line of head ends in a newline (and may have a carriage return) */
+
+    *length = -1;
+    for (line = head; *line; line = next + 1) {
+        next = strchr(line, '\n');
+        n    = next - line - (next > line && next[-1] == '\r');
+        if (strncasecmp(line, "Status:", 7) == 0) {
+            status  = skip_whitespace((char *)line + 7);
+            slength = line + n - status;
+        } else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            *length = strtoll(line + 15, NULL, 10);
+        }
+    }
+
+    bool chunked = *length < 0 && r->version > 0;
+    if (*length < 0 && !chunked) {
+        r->keep_alive = false;
+    }
+
+    fprintf(stream, "HTTP/1.%d %.*s\r\n", r->version, slength, status);
+    for (line = head; *line; line = next + 1) {
+        next = strchr(line, '\n');
+        n    = next - line - (next > line && next[-1] == '\r');
+        if (strncasecmp(line, "Status:", 7) != 0 && strncasecmp(line, "Connection:", 11) != 0) {
+            fprintf(stream, "%.*s\r\n", n, line);
+        }
+    }
+    if (chunked) {
+        fputs("Transfer-Encoding: chunked\r\n", stream);
+    }
+    fprintf(stream, "Connection: %s\r\n\r\n", r->keep_alive ? "keep-alive" : "close");
+    request_headers_end(r);
+    return chunked;
+}
+
+/**
+ * Relay part of a response body (as a chunk, if chunked).
+ **/
+static void fastcgi_body(Request *r, const char *data, size_t length, bool chunked) {
+    FILE *stream = r->connection->stream;
+
+    if (length == 0) {
+        return;
+    }
+    if (chunked) {
+        fprintf(stream, "%zx\r\n", length);
+    }
+    fwrite(data, 1, length, stream);
+    if (chunked) {
+        fputs("\r\n", stream);
+    }
+}
+
+/* Functions */
+
+/**
+ * Set up the process group of the workers (before any worker process exists).
+ *
+ * @return  Whether the group could be set up (without it, workers are not
+ * stopped with the server; see fastcgi_stop).
+ *
+ * Like the CGI limits (see cgi_init), the group lives in memory shared with
+ * the processes forked later, so that in the forking and prefork modes the
+ * workers they start all join it.
+ **/
+bool fastcgi_init(void) {
+    pthread_mutexattr_t attributes;
+
+    if (FastCGIWorkers == 0) {
+        return true;
+    }
+
+    Group = mmap(NULL, sizeof(FastCGIGroup), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Group == MAP_FAILED) {
+        Group = NULL;
+        return false;
+    }
+
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&Group->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+    return true;
+}
+
+/**
+ * Stop every FastCGI worker of the server (as it shuts down).
+ *
+ * Workers would otherwise live on until they are idle for long enough to
+ * exit by themselves.  This only sends SIGTERM to the workers' process
+ * group, so it may be called from a signal handler.
+ **/
+void fastcgi_stop(void) {
+    if (Group && Group->pgid > 0) {
+        kill(-Group->pgid, SIGTERM);
+    }
+}
+
+/**
+ * Determine whether a (CGI) request is served by a FastCGI worker pool.
+ *
+ * @param   r           HTTP Request structure (for an executable).
+ * @return  Whether pools are enabled and the executable's name ends in .fcgi.
+ **/
+bool fastcgi_handles(Request *r) {
+    size_t length = strlen(r->path);
+
+    return FastCGIWorkers > 0 && length > strlen(FASTCGI_SUFFIX) &&
+        streq(r->path + length - strlen(FASTCGI_SUFFIX), FASTCGI_SUFFIX);
+}
+
+/**
+ * Connect to an idle worker of the executable a request is for.
+ *
+ * @param   r           HTTP Request structure (for a .fcgi executable).
+ * @param   worker      Where to store the worker (release it with
+ * fastcgi_release).
+ * @return  Whether a worker could be reached.
+ *
+ * Each executable gets a pool of FastCGIWorkers slots, whose workers are
+ * started on first use and restarted whenever they are found gone.  Each
+ * slot serves one request of this process at a time; once all are busy,
+ * requests wait for one to be released.  Requests go to the first idle slot,
+ * so only as many workers are started as requests run concurrently, and
+ * they stay warm.  (Each process starts at a slot of its own, so that the
+ * processes of the forking and prefork modes spread over the workers.)
+ **/
+bool fastcgi_acquire(Request *r, FastCGIWorker *worker) {
+    trace_scope("fastcgi_acquire");
+    FastCGIPool *pool;
+    size_t       slot;
+
+    pthread_mutex_lock(&FastCGILock);
+    if (!(pool = fastcgi_pool(r->path))) {
+        pthread_mutex_unlock(&FastCGILock);
+        return false;
+    }
+
+    while (true) {
+        for (slot = 0; slot < FastCGIWorkers && pool->busy[(pool->first + slot) % FastCGIWorkers]; slot++);
+        if (slot < FastCGIWorkers) {
+            break;
+        }
+        FastCGIWaited++;
+        pthread_cond_wait(&FastCGIIdle, &FastCGILock);
+    }
+    slot = (pool->first + slot) % FastCGIWorkers;
+    pool->busy[slot] = true;
+    FastCGIRequests++;
+    pthread_mutex_unlock(&FastCGILock);
+
+    /* The slot is ours until released, so no other request of this process
+     * starts a worker for it while we do (without holding up the others) */
+
+    worker->pool = pool;
+    worker->slot = slot;
+    worker->fd   = fastcgi_connect(pool, slot);
+
+    if (worker->fd < 0) {
+        fastcgi_release(worker);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Release the slot of a worker.
+ *
+ * @param   worker      Worker (see fastcgi_acquire).
+ **/
+void fastcgi_release(FastCGIWorker *worker) {
+    FastCGIPool *pool = worker->pool;
+
+    if (worker->fd >= 0) {
+        close(worker->fd);
+        worker->fd = -1;
+    }
+
+    pthread_mutex_lock(&FastCGILock);
+    pool->busy[worker->slot] = false;
+    pthread_cond_broadcast(&FastCGIIdle);
+    pthread_mutex_unlock(&FastCGILock);
+}
+
+/**
+ * Pass a request to a worker and relay its response to the client.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   worker      Worker (see fastcgi_acquire).
+ * @return  Number of bytes of body relayed, or -1 if nothing was sent to the
+ * client (so an error response can still be sent).
+ *
+ * The whole request (variables and body, see request_body_next) is sent
+ * before the response is read, one request per connection to the worker.
+ * Output records are relayed as they arrive; error records go to stderr.
+ * The response keeps the connection alive if its length is known (given,
+ * or chunked), and it was complete.
+ *
+ * As with cgi_relay, a worker that has not finished its response within
+ * CGITimeout seconds (including time spent waiting on the client) is
+ * killed, and the next request through its slot starts a new one.
+ *
+ * Reading the body refills the connection's input buffer, so the request's
+ * method, uri, query and headers (which point into it) must not be used
+ * afterwards.
+ **/
+off_t fastcgi_relay(Request *r, FastCGIWorker *worker) {
+    trace_scope("fastcgi_relay");
+    FastCGIPool  *pool = worker->pool;
+    FastCGIHeader header;
+    char         *content = malloc(FCGI_MAX_CONTENT + 255);
+    char          head[FASTCGI_HEAD_MAX + 1];
+    size_t        hlength = 0;
+    bool          started = false;
+    bool          ended   = false;
+    bool          chunked = false;
+    off_t         expected = -1;
+    off_t         relayed  = 0;
+    long long     deadline = CGITimeout > 0 ? fastcgi_now() + CGITimeout * 1000LL : 0;
+
+    /* Bound writes to a worker that is not reading its input */
+
+    if (deadline) {
+        struct timeval timeout = { .tv_sec = CGITimeout };
+        setsockopt(worker->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+
+    if (!content || !fastcgi_request(r, worker->fd)) {
+        goto finish;
+    }
+
+    while (!ended && fastcgi_read(worker->fd, &header, sizeof(header), deadline)) {
+        size_t length = (header.length[0] << 8 | header.length[1]) + header.padding;
+        if (!fastcgi_read(worker->fd, content, length, deadline)) {
+            break;
+        }
+        length -= header.padding;
+
+        switch (header.type) {
+            case FCGI_STDOUT:
+                if (started) {
+                    fastcgi_body(r, content, length, chunked);
+                    relayed += length;
+                    break;
+                }
+
+                /* Collect the CGI headers until the blank line */
+
+                if (length > FASTCGI_HEAD_MAX - hlength) {
+                    ended = true;
+                    break;
+                }
+                memcpy(head + hlength, content, length);
+                hlength += length;
+                head[hlength] = '\0';
+
+                char *end = strstr(head, "\r\n\r\n");
+                char *lf  = strstr(head, "\n\n");
+                if (end) {
+                    end += 4;
+                }
+                if (lf && (!end || lf + 2 < end)) {
+                    end = lf + 2;
+                }
+                if (!end) {
+                    break;
+                }
+
+                size_t rest = head + hlength - end;
+                memcpy(content, end, rest);
+                end[end[-2] == '\r' ? -2 : -1] = '\0';     /* Cut at the blank line */
+                chunked = fastcgi_head(r, head, &expected);
+                started = true;
+                fastcgi_body(r, content, rest, chunked);
+                relayed += rest;
+                break;
+            case FCGI_STDERR:
+                fwrite(content, 1, length, stderr);
+                break;
+            case FCGI_END_REQUEST:
+                ended = true;
+                break;
+        }
+    }
+
+    if (started) {
+        if (chunked && ended) {
+            fputs("0\r\n\r\n", r->connection->stream);
+        }
+        if (!ended || (expected >= 0 && relayed != expected)) {
+            r->keep_alive = false;
+        }
+    }
+
+finish:
+    if (!ended && deadline && fastcgi_now() >= deadline && pool->pids[worker->slot] > 0) {
+        debug("Killing FastCGI worker %d: timed out", pool->pids[worker->slot]);
+        kill(pool->pids[worker->slot], SIGKILL);
+    }
+    if (!started) {
+        __atomic_add_fetch(&FastCGIFailed, 1, __ATOMIC_RELAXED);
+        r->keep_alive = false;
+    }
+    free(content);
+    return started ? relayed : -1;
+}
+
+/**
+ * Retrieve FastCGI counters.
+ *
+ * @param   requests    Where to store the number of requests passed to workers.
+ * @param   started     Where to store the number of workers started.
+ * @param   waited      Where to store the number of times all workers were busy.
+ * @param   failed      Where to store the number of requests without a response.
+ **/
+void fastcgi_stats(size_t *requests, size_t *started, size_t *waited, size_t *failed) {
+    pthread_mutex_lock(&FastCGILock);
+    *requests = FastCGIRequests;
+    *started  = __atomic_load_n(&FastCGIStarted, __ATOMIC_RELAXED);
+    *waited   = FastCGIWaited;
+    *failed   = __atomic_load_n(&FastCGIFailed, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&FastCGILock);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
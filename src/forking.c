@@ -9,20 +9,27 @@
 #include <unistd.h>
 
 /**
- * Fork incoming HTTP requests to handle the concurrently.
+ * Fork incoming HTTP connections to handle the concurrently.
  *
  * @param   sfd         Server socket file descriptor.
  * @return  Exit status of server (EXIT_SUCCESS).
  *
- * The parent should accept a request and then fork off and let the child
- * handle the request.
+ * The parent should accept a connection and then fork off and let the child
+ * handle the requests on it.
  **/
 int forking_server(int sfd) {
-    /* Accept and handle HTTP request */
+    /* Accept and handle HTTP connections */
     while (true) {
-    	/* Accept request */
+    	/* Accept connection */
 
-        Request* r = accept_request(sfd);
+        Connection* c = accept_connection(sfd);
+        if(!c){
+            continue;
+        }
+
+	/* Pick up any mime-type reload before children inherit the table */
+
+        mime_reload();
 
 	/* Ignore children */
 
@@ -34,17 +41,19 @@ int forking_server(int sfd) {
 
         if(pid < 0){
             debug("Fork has failed %s", strerror(errno));
-            free_request(r);
+            free_connection(c);
             continue;
         }
 
         if(pid == 0){ // child
-            debug("handling client request");
+            debug("handling client connection");
             close(sfd);
-            Status s = handle_request(r);
-            exit(s);
+            handle_connection(c);
+            free_connection(c);
+            exit(EXIT_SUCCESS);
         } else { // parent process
-            free_request(r);  
+            stats_connection(1); // the child closes (and counts) the connection
+            free_connection(c);
         }
 
     }
@@ -5,16 +5,22 @@
 #include <errno.h>
 #include <limits.h>
 #include <string.h>
+#include <strings.h>
 
-#include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 /* Internal Declarations */
 Status handle_browse_request(Request *request);
 Status handle_file_request(Request *request);
 Status handle_cgi_request(Request *request);
+Status handle_fastcgi_request(Request *request);
+Status handle_stats_request(Request *request);
+Status handle_range_request(Request *request, int fd, const char *mimetype, const char *validators, Range *ranges, size_t nranges);
 Status handle_error(Request *request, Status status);
+void   write_headers(Request *request, Status status, const char *mimetype, off_t length, const char *extra);
 
 /**
  * Handle HTTP Request.
@@ -28,6 +34,7 @@ Status handle_error(Request *request, Status status);
  * On error, handle_error should be used with an appropriate HTTP status code.
  **/
 Status  handle_request(Request *r) {
+    trace_scope("handle_request");
     Status result;
 
     /* Parse request */
@@ -38,39 +45,90 @@ Status  handle_request(Request *r) {
         return handle_error(r, HTTP_STATUS_BAD_REQUEST);
     }
 
-    /* Determine request path */
-    r->path = determine_request_path(r->uri);
+    journal_request(r);
 
-    if(!r->path) return handle_error(r, HTTP_STATUS_NOT_FOUND);
+    if(*StatsURI && streq(r->uri, StatsURI)) return handle_stats_request(r);
+
+    /* Determine request path and how to handle it (see cache_lookup) */
+    r->file = cache_lookup(r->connection, r->uri);
+
+    if(!r->file || r->file->kind == CACHE_MISSING) return handle_error(r, HTTP_STATUS_NOT_FOUND);
+
+    r->path = r->file->path;
 
     debug("HTTP REQUEST PATH: %s", r->path);
 
     /* Dispatch to appropriate request handler type based on file type */
 
-    struct stat request_stat;
-
-    if(stat(r->path, &request_stat) < 0){
-        return handle_error(r, HTTP_STATUS_NOT_FOUND);
+    switch(r->file->kind){
+        case CACHE_DIRECTORY:
+            debug("Handle directory request");
+            result = handle_browse_request(r);
+            break;
+        case CACHE_EXECUTABLE:
+            debug("Handle CGI request");
+            result = fastcgi_handles(r) ? handle_fastcgi_request(r) : handle_cgi_request(r);
+            break;
+        case CACHE_READABLE:
+            debug("Handle file request");
+            result = handle_file_request(r);
+            break;
+        default:
+            result = handle_error(r, HTTP_STATUS_BAD_REQUEST);
+            break;
     }
 
-    if(S_ISDIR(request_stat.st_mode)){
-        debug("Handle directory request");
-        result = handle_browse_request(r);
-    } 
-    else if (access(r->path, X_OK) == 0){
-        debug("Handle CGI request");
-        result = handle_cgi_request(r);
+    debug("HTTP REQUEST STATUS: %s", http_status_string(result));
+
+    return result;
+}
+
+/**
+ * Determine if the next request buffered on a connection may block.
+ *
+ * @param   c           Connection structure (with the request head parsed;
+ * see connection_ready).
+ * @return  Whether handling the request may wait on more than the client
+ * socket: on a request body still to be read, or on a CGI or FastCGI script.
+ *
+ * Only the parsed head is looked at (nothing is consumed), so the event loop
+ * can hand such requests to a worker thread instead (see event_server).
+ * Malformed requests never block (they only get a 400).
+ **/
+bool    request_blocks(Connection *c) {
+    Parser     *p    = &c->parser;
+    const char *data = c->buffer + c->offset;
+    char        uri[BUFSIZ];
+
+    if(p->state != PARSER_DONE)
+        return false;
+
+    for(size_t i = 0; i < p->nheaders; i++){
+        Slice name  = p->names[i];
+        Slice value = p->values[i];
+
+        if(name.length == strlen("Transfer-Encoding") && strncasecmp(data + name.offset, "Transfer-Encoding", name.length) == 0)
+            return true;
+        if(name.length == strlen("Content-Length") && strncasecmp(data + name.offset, "Content-Length", name.length) == 0 &&
+           !(value.length == 1 && data[value.offset] == '0'))
+            return true;
     }
-    else if(access(r->path, R_OK) == 0){
-        debug("Handle file request");
-        result = handle_file_request(r);
-    } 
-    else
-        return HTTP_STATUS_BAD_REQUEST;
 
-    log("HTTP REQUEST STATUS: %s", http_status_string(result));
+    /* Look up the resource as handle_request will (the entry stays cached) */
 
-    return result;
+    if(p->uri.length >= sizeof(uri))
+        return false;
+
+    memcpy(uri, data + p->uri.offset, p->uri.length);
+    uri[p->uri.length] = 0;
+
+    if(*StatsURI && streq(uri, StatsURI))
+        return false;
+
+    CacheEntry *file   = cache_lookup(c, uri);
+    bool        blocks = file && file->kind == CACHE_EXECUTABLE;
+    cache_release(file);
+    return blocks;
 }
 
 /**
@@ -79,68 +137,152 @@ Status  handle_request(Request *r) {
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP browse request.
  *
- * This lists the contents of a directory in HTML.
+ * This lists the contents of a directory in HTML (or in JSON, if asked for;
+ * see listing_format).  Listings are rendered once and sent from memory
+ * with a Content-Length until the directory changes (see listing_acquire);
+ * listings of large directories are streamed in sorted chunks instead (see
+ * listing_stream), chunked if the client speaks HTTP/1.1.
  *
  * If the path cannot be opened or scanned as a directory, then handle error
  * with HTTP_STATUS_NOT_FOUND.
  **/
 Status  handle_browse_request(Request *r) {
-    struct dirent **entries;
-    int n;
+    trace_scope("handle_browse_request");
+    ListingFormat format   = listing_format(r);
+    const char   *mimetype = format == LISTING_JSON ? "application/json" : "text/html";
+    Listing       listing;
 
-    /* Open a directory for reading or scanning */
+    if(!listing_acquire(r, format, &listing)){
+        debug("Unable to open directory: %s", strerror(errno));
+        return handle_error(r, HTTP_STATUS_NOT_FOUND);
+    }
 
-    n = scandir(r->path, &entries, NULL, alphasort);
+    /* Write HTTP Header with OK Status and Content-Type, then listing */
 
-    if(n < 0){
-        debug("Unable to open directory: %s", strerror(errno));
-        return HTTP_STATUS_BAD_REQUEST;
+    if(listing.body){
+        write_headers(r, HTTP_STATUS_OK, mimetype, listing.length, "Vary: Accept\r\n");
+        fwrite(listing.body, 1, listing.length, r->connection->stream);
+        listing_release(&listing);
+        return HTTP_STATUS_OK;
     }
 
-    /* Write HTTP Header with OK Status and text/html Content-Type */
+    if(r->version == 1){
+        write_headers(r, HTTP_STATUS_OK, mimetype, -1, "Vary: Accept\r\nTransfer-Encoding: chunked\r\n");
+        listing_stream(r, format, true);
+    }else{
+        write_headers(r, HTTP_STATUS_OK, mimetype, -1, "Vary: Accept\r\n");
+        listing_stream(r, format, false);
+    }
 
-    fprintf(r->stream, "HTTP/1.0 200 OK\r\n");
-    fprintf(r->stream, "Content-Type: text/html\r\n");
-    fprintf(r->stream, "\r\n");
+    /* Return OK */
+    return HTTP_STATUS_OK;
+}
 
-    /* For each entry in directory, emit HTML list item */
+/**
+ * Send part of a regular file to the client.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   file        Cache entry of the file.
+ * @param   fd          File descriptor of the file.
+ * @param   offset      Offset in file to start at.
+ * @param   length      Number of bytes to send.
+ * @return  Number of bytes sent (anything but length means the response was
+ * cut short).
+ *
+ * Only the bytes asked for are read: with sendfile(2) straight from the page
+ * cache (see connection_sendfile), or when SendFile is off from a shared
+ * mapping for large files (see mapping_send) and otherwise through a buffer.
+ * The cached descriptor is shared, so it is only ever read at explicit
+ * offsets.  On the event loop, files always go through connection_sendfile,
+ * so that what the socket cannot take yet is queued as a range of the file
+ * rather than copied (see connection_send).
+ **/
+static off_t send_file_range(Request *r, CacheEntry *file, int fd, off_t offset, off_t length) {
+    char    buffer[BUFSIZ];
+    off_t   sent;
+    ssize_t nread;
 
-    fprintf(r->stream, "<!DOCTYPE html>\n");
-    fprintf(r->stream, "<html>\n");
-    fprintf(r->stream, "<head>\n");
-    fprintf(r->stream, "<meta charset=\"utf-8\">\n");
-    fprintf(r->stream, "<link rel=\"stylesheet\" href=\"https://maxcdn.bootstrapcdn.com/bootstrap/4.0.0/css/bootstrap.min.css\" integrity=\"sha384-Gn5384xqQ1aoWXA+058RXPxPg6fy4IWvTNh0E263XmFcJlSAwiGgFAW/dAiS6JXm\" crossorigin=\"anonymous\">\n");
-    fprintf(r->stream, "</head>\n");
-    fprintf(r->stream, "<body>\n");
-    
+    if(SendFile || r->connection->queueing)
+        return connection_sendfile(r->connection, fd, offset, length);
 
-    fprintf(r->stream, "<ul class=\"list-group\">");
+    if((sent = mapping_send(r->connection, file, offset, length)) >= 0)
+        return sent;
 
-    for(int i = 0; i < n; i++){
+    sent = 0;
+    while(sent < length){
+        size_t chunk = length - sent < (off_t)sizeof(buffer) ? length - sent : sizeof(buffer);
+        if((nread = pread(fd, buffer, chunk, offset + sent)) <= 0)
+            break;
 
-        if(strcmp(entries[i]->d_name, ".") == 0){
-            free(entries[i]);
-            continue;
-        }
+        fwrite(buffer, 1, nread, r->connection->stream);
+        sent += nread;
+    }
 
-        if(r->uri[strlen(r->uri) - 1] == '/'){ // has / at the end of uri
-            fprintf(r->stream, "<li class=\"list-group-item\">\n<a href=\"%s%s\">%s</a>\n</li>\n", r->uri, entries[i]->d_name, entries[i]->d_name);
-        }
-        else{ // need to put / at end of uri
-            fprintf(r->stream, "<li class=\"list-group-item\">\n<a href=\"%s/%s\">%s</a>\n</li>\n", r->uri, entries[i]->d_name, entries[i]->d_name);
-        }
+    return sent;
+}
 
-        free(entries[i]);
+/**
+ * Send a compressed copy of a regular file.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   encoding    Content coding the client accepts (see
+ * encoding_negotiate).
+ * @param   mimetype    Mime-type of file.
+ * @param   status      Where to store the status of the response.
+ * @return  Whether a response was written (otherwise the caller must send
+ * the file as is).
+ *
+ * A gzip'ed sibling (file.gz, no older than the file) is sent like any
+ * other file; otherwise the file is compressed on the fly (see
+ * encoding_acquire).  Either way the copy has an entity tag of its own,
+ * which is what the client's If-None-Match is compared against.
+ **/
+static bool send_encoded(Request *r, Encoding encoding, const char *mimetype, Status *status) {
+    const char *name = encoding_name(encoding);
+    char    headers[BUFSIZ];
+    Encoded encoded;
+
+    if(encoding == ENCODING_GZIP){
+        char *uri = arena_alloc(&r->connection->arena, strlen(r->uri) + sizeof(".gz"));
+        sprintf(uri, "%s.gz", r->uri);
+
+        CacheEntry *sibling = cache_lookup(r->connection, uri);
+        if(sibling && sibling->kind == CACHE_READABLE && sibling->fd >= 0 &&
+           sibling->st.st_mtime >= r->file->st.st_mtime){
+            off_t size = sibling->st.st_size;
+
+            snprintf(headers, sizeof(headers), "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\nETag: %s\r\nLast-Modified: %s\r\n",
+                sibling->etag, r->file->modified);
+
+            if(conditional_not_modified(r, sibling->etag)){
+                write_headers(r, *status = HTTP_STATUS_NOT_MODIFIED, NULL, 0, headers);
+            }else{
+                write_headers(r, *status = HTTP_STATUS_OK, mimetype, size, headers);
+                if(send_file_range(r, sibling, sibling->fd, 0, size) != size)
+                    r->keep_alive = false;
+            }
+
+            cache_release(sibling);
+            return true;
+        }
+        cache_release(sibling);
     }
 
-    fprintf(r->stream, "</ul>");
-    fprintf(r->stream, "</body>");
-    fprintf(r->stream, "</html>");
+    if(!encoding_acquire(r, encoding, &encoded))
+        return false;
 
-    free(entries);
+    snprintf(headers, sizeof(headers), "Content-Encoding: %s\r\nVary: Accept-Encoding\r\nETag: %s\r\nLast-Modified: %s\r\n",
+        name, encoded.etag, r->file->modified);
 
-    /* Return OK */
-    return HTTP_STATUS_OK;
+    if(conditional_not_modified(r, encoded.etag)){
+        write_headers(r, *status = HTTP_STATUS_NOT_MODIFIED, NULL, 0, headers);
+    }else{
+        write_headers(r, *status = HTTP_STATUS_OK, mimetype, encoded.length, headers);
+        fwrite(encoded.body, 1, encoded.length, r->connection->stream);
+    }
+
+    encoding_release(&encoded);
+    return true;
 }
 
 /**
@@ -149,63 +291,188 @@ Status  handle_browse_request(Request *r) {
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This opens and streams the contents of the specified file to the socket.
+ * This streams the contents of the specified file to the socket, unless the
+ * client's copy is still current (see conditional_not_modified).  Regular
+ * files are already open (see cache_lookup) and are sent compressed if the
+ * client accepts it and their type is worth it (see send_encoded), without
+ * being copied where possible (see send_file_range), or just the byte ranges
+ * the client asked for with a Range header (see handle_range_request);
+ * anything else is copied through a buffer until the end.
  *
  * If the path cannot be opened for reading, then handle error with
  * HTTP_STATUS_NOT_FOUND.
  **/
 Status  handle_file_request(Request *r) {
-    FILE   *fs;
+    trace_scope("handle_file_request");
+    struct stat *st = &r->file->st;
+    int    fd = r->file->fd;
+    int    opened = -1;
     char   buffer[BUFSIZ];
-    char   *mimetype = NULL;
-    size_t nread;
+    const char *mimetype;
+    const char *range;
+    Encoding encoding;
+    Status  status;
+    char    headers[BUFSIZ];
+    Range   ranges[RANGE_MAX];
+    ssize_t nranges = -1;
+    ssize_t nread;
+
+    /* Determine mimetype */
+
+    mimetype = determine_mimetype(r->path);
 
-    /* Open file for reading */
+    /* Send a compressed copy of regular files to clients that accept one
+     * (see send_encoded) */
 
-    fs = fopen(r->path, "r");
-    if(!fs){
+    if(S_ISREG(st->st_mode) && (encoding = encoding_negotiate(r, mimetype)) != ENCODING_IDENTITY &&
+       send_encoded(r, encoding, mimetype, &status))
+        return status;
+
+    /* Regular files come with validators (see conditional_validators), and
+     * a copy the client revalidates needs no file */
+
+    if(S_ISREG(st->st_mode)){
+        snprintf(headers, sizeof(headers), "Accept-Ranges: bytes\r\n%sETag: %s\r\nLast-Modified: %s\r\n",
+            encoding_vary(mimetype) ? "Vary: Accept-Encoding\r\n" : "", r->file->etag, r->file->modified);
+
+        if(conditional_not_modified(r, r->file->etag)){
+            write_headers(r, HTTP_STATUS_NOT_MODIFIED, NULL, 0, headers);
+            return HTTP_STATUS_NOT_MODIFIED;
+        }
+    }
+
+    /* Open file for reading, unless the cache holds it open already (see
+     * cache_lookup); a file opened here is closed on the way out */
+
+    if(fd < 0 && (fd = opened = open(r->path, O_RDONLY | O_CLOEXEC)) < 0){
         debug("Unable to open file in handle file request");
         return handle_error(r, HTTP_STATUS_NOT_FOUND);
     }
-    /* Determine mimetype */
 
-    mimetype = determine_mimetype(r->path); // changed from r->uri @ 9:17 workingo
+    /* Serve byte ranges of regular files if asked to (and, with If-Range,
+     * only if they are ranges of the client's copy) */
 
-    if(!mimetype) goto fail;
+    if(S_ISREG(st->st_mode) && (range = request_header(r, "Range")) && conditional_range(r))
+        nranges = range_parse(range, st->st_size, ranges, RANGE_MAX);
 
-    /* Write HTTP Headers with OK status and determined Content-Type */
+    /* Respond from memory if the file is hot (see content_respond), or else
+     * write HTTP Headers with OK status, determined Content-Type and length */
 
-    fprintf(r->stream, "HTTP/1.0 200 OK\r\n"); 
-    fprintf(r->stream, "Content-Type: %s\r\n", mimetype);
-    fprintf(r->stream, "\r\n");
+    if(nranges >= 0){
+        status = handle_range_request(r, fd, mimetype, headers, ranges, nranges);
+    }else if(S_ISREG(st->st_mode) && content_respond(r, mimetype, headers)){
+        status = HTTP_STATUS_OK;
+    }else if(S_ISREG(st->st_mode)){
+        write_headers(r, HTTP_STATUS_OK, mimetype, st->st_size, headers);
 
-    /* Read from file and write to socket in chunks */
+        /* A short response can no longer be delimited by its Content-Length */
 
-    nread = fread(buffer, 1, BUFSIZ, fs);
+        if(send_file_range(r, r->file, fd, 0, st->st_size) != st->st_size)
+            r->keep_alive = false;
 
-    while( nread > 0 ){
-        
-        fwrite(buffer, 1, nread, r->stream);
-        nread = fread(buffer, 1, BUFSIZ, fs);
+        status = HTTP_STATUS_OK;
+    }else{
+        write_headers(r, HTTP_STATUS_OK, mimetype, -1, NULL);
 
+        /* Read from file and write to socket in chunks until the end */
+
+        while((nread = read(fd, buffer, sizeof(buffer))) > 0){
+            fwrite(buffer, 1, nread, r->connection->stream);
+        }
+
+        status = HTTP_STATUS_OK;
     }
 
-    /* Close file, deallocate mimetype, return OK */
+    /* Close file (if we opened it), return status */
 
-    fclose(fs);
+    if(opened >= 0)
+        close(opened);
 
-    free(mimetype);
+    return status;
+}
 
-    return HTTP_STATUS_OK;
+/**
+ * Handle range request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          File descriptor of the (regular) file.
+ * @param   mimetype    Mime-type of file.
+ * @param   validators  Header lines sent with the whole file (Accept-Ranges,
+ * ETag, ...).
+ * @param   ranges      Satisfiable ranges of the file (see range_parse).
+ * @param   nranges     Number of ranges.
+ * @return  Status of the HTTP range request.
+ *
+ * A single range is sent as is with a Content-Range header; several are sent
+ * as the parts of a multipart/byteranges body, each with its own
+ * Content-Type and Content-Range.  Either way the Content-Length is known up
+ * front, so the connection can be kept alive.  If no range is satisfiable,
+ * the response is an empty HTTP_STATUS_RANGE_NOT_SATISFIABLE with the size of
+ * the file.
+ **/
+Status  handle_range_request(Request *r, int fd, const char *mimetype, const char *validators, Range *ranges, size_t nranges) {
+    trace_scope("handle_range_request");
+    static const char *PartFormat = "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n";
+    static size_t Boundaries = 0;
+
+    FILE  *stream = r->connection->stream;
+    off_t  size   = r->file->st.st_size;
+    char   headers[BUFSIZ];
+    char   boundary[40];
+    off_t  length;
+
+    if(nranges == 0){
+        snprintf(headers, sizeof(headers), "Content-Range: bytes */%lld\r\n", (long long)size);
+        write_headers(r, HTTP_STATUS_RANGE_NOT_SATISFIABLE, mimetype, 0, headers);
+        return HTTP_STATUS_RANGE_NOT_SATISFIABLE;
+    }
+
+    /* Single range */
+
+    if(nranges == 1){
+        length = ranges[0].last - ranges[0].first + 1;
+        snprintf(headers, sizeof(headers), "%sContent-Range: bytes %lld-%lld/%lld\r\n",
+            validators, (long long)ranges[0].first, (long long)ranges[0].last, (long long)size);
+        write_headers(r, HTTP_STATUS_PARTIAL_CONTENT, mimetype, length, headers);
+
+        if(send_file_range(r, r->file, fd, ranges[0].first, length) != length)
+            r->keep_alive = false;
+
+        return HTTP_STATUS_PARTIAL_CONTENT;
+    }
+
+    /* Multiple ranges: size the multipart body, then send it part by part */
+
+    snprintf(boundary, sizeof(boundary), "%016llx%08zx",
+        (unsigned long long)r->file->st.st_ino * 0x9E3779B97F4A7C15ULL ^ (unsigned long long)r->file->st.st_mtim.tv_nsec,
+        __atomic_add_fetch(&Boundaries, 1, __ATOMIC_RELAXED));
+
+    length = snprintf(NULL, 0, "\r\n--%s--\r\n", boundary);
+    for(size_t i = 0; i < nranges; i++){
+        length += snprintf(NULL, 0, PartFormat, boundary, mimetype,
+            (long long)ranges[i].first, (long long)ranges[i].last, (long long)size);
+        length += ranges[i].last - ranges[i].first + 1;
+    }
+
+    char type[sizeof(boundary) + 32];
+    snprintf(type, sizeof(type), "multipart/byteranges; boundary=%s", boundary);
+    write_headers(r, HTTP_STATUS_PARTIAL_CONTENT, type, length, validators);
 
-fail:
-    /* Close file, free mimetype, return INTERNAL_SERVER_ERROR */
+    for(size_t i = 0; i < nranges; i++){
+        off_t part = ranges[i].last - ranges[i].first + 1;
 
-    if(fs) fclose(fs);
+        fprintf(stream, PartFormat, boundary, mimetype,
+            (long long)ranges[i].first, (long long)ranges[i].last, (long long)size);
+
+        if(send_file_range(r, r->file, fd, ranges[i].first, part) != part){
+            r->keep_alive = false;
+            return HTTP_STATUS_PARTIAL_CONTENT;
+        }
+    }
 
-    if(mimetype) free(mimetype);
+    fprintf(stream, "\r\n--%s--\r\n", boundary);
 
-    return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    return HTTP_STATUS_PARTIAL_CONTENT;
 }
 
 /**
@@ -214,75 +481,110 @@ fail:
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This popens and streams the results of the specified executables to the
- * socket.
+ * This spawns the specified executable (see cgi_spawn), streams the request
+ * body to it, and streams its output to the socket (see cgi_relay).  Output
+ * that may be reused is kept and sent again without running the executable
+ * (see memo_respond).
  *
- * If the path cannot be popened, then handle error with
- * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ * If too many scripts are running already (see cgi_acquire), then handle
+ * error with HTTP_STATUS_SERVICE_UNAVAILABLE; if the executable cannot be
+ * spawned, then handle error with HTTP_STATUS_INTERNAL_SERVER_ERROR.
  **/
 Status  handle_cgi_request(Request *r) {
-    FILE *pfs;
-    char buffer[BUFSIZ];
+    trace_scope("handle_cgi_request");
+    int   input, output, status;
+    pid_t pid;
+    Memo  memo;
 
-    /* Export CGI environment variables from request:
+    if(memo_respond(r, &memo))
+        return HTTP_STATUS_OK;
+
+    /* Spawn CGI script with its own environment:
      * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
-    
-    setenv("DOCUMENT_ROOT", RootPath, true ); // overwrite
-    setenv("QUERY_STRING", r->query, true);
-    setenv("REMOTE_ADDR", r->host, true);
-    setenv("REMOTE_PORT", r->port, true);
-    setenv("REQUEST_URI", r->uri, true);
-    setenv("REQUEST_METHOD", r->method, true);
-    setenv("SCRIPT_FILENAME", r->path, true);
-    setenv("SERVER_PORT", Port, true);
-
-    /* Export CGI environment variables from request headers */
-
-    for(Header* tmp = r->headers; tmp; tmp = tmp->next){
-
-        if(streq(tmp->name, "Host")){
-            setenv("HTTP_HOST", tmp->data, true);
-        }
-        else if (streq(tmp->name, "Connection")){
-            setenv("HTTP_CONNECTION", tmp->data, true);
-        }
-        else if (streq(tmp->name, "Accept")){
-            setenv("HTTP_ACCEPT", tmp->data, true);
-        }
-        else if (streq(tmp->name, "Accept-Language")){
-            setenv("HTTP_ACCEPT_LANGUAGE", tmp->data, true);
-        }
-        else if (streq(tmp->name, "Accept-Encoding")){
-            setenv("HTTP_ACCEPT_ENCODING", tmp->data, true);
-        }
-        else if(streq(tmp->name, "User-Agent")){
-            setenv("HTTP_USER_AGENT", tmp->data, true);
-        }
 
+    debug("query is: %s", r->query);
+
+    if(!cgi_acquire()){
+        debug("Too many CGI scripts running");
+        memo_finish(&memo, false);
+        r->keep_alive = false;
+        return handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
     }
 
+    if((pid = cgi_spawn(r, &input, &output)) < 0){
+        debug("Unable to spawn CGI");
+        cgi_release();
+        memo_finish(&memo, false);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
 
+    /* Copy data from script to socket (the script writes its own headers
+     * without a Content-Length, so its output ends with the connection) */
 
-    /* POpen CGI Script */
-    pfs = popen(r->path, "r");
+    r->keep_alive = false;
 
-    debug("query is: %s", r->query);
+    cgi_relay(r, pid, input, output, &memo);
 
-    if(!pfs){
-        debug("Unable to open CGI");
-        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
-    }
+    /* Reap script, keep its output if it succeeded, return OK */
+    bool succeeded = waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    cgi_release();
+    memo_finish(&memo, succeeded);
 
-    /* Copy data from popen to socket */
+    return HTTP_STATUS_OK;
+}
 
-    while(fgets(buffer, BUFSIZ, pfs)){
-        fputs(buffer, r->stream);
+/**
+ * Handle FastCGI request
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the HTTP file request.
+ *
+ * This passes the request to an idle worker of the executable's pool (see
+ * fastcgi_acquire), which answers with CGI headers that are turned into an
+ * HTTP response (see fastcgi_relay).
+ *
+ * If no worker can be reached or it does not answer, then handle error with
+ * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ **/
+Status  handle_fastcgi_request(Request *r) {
+    trace_scope("handle_fastcgi_request");
+    FastCGIWorker worker;
+    off_t         relayed = -1;
+
+    if(fastcgi_acquire(r, &worker)){
+        relayed = fastcgi_relay(r, &worker);
+        fastcgi_release(&worker);
     }
 
+    if(relayed < 0){
+        debug("Unable to reach FastCGI worker");
+        r->keep_alive = false;
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
 
-    /* Close popen, return OK */
-    pclose(pfs);
+    return HTTP_STATUS_OK;
+}
 
+/**
+ * Handle statistics request.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the HTTP statistics request.
+ *
+ * This reports the server's counters and latency histograms as JSON (see
+ * stats_render), over all worker processes.
+ **/
+Status  handle_stats_request(Request *r) {
+    trace_scope("handle_stats_request");
+    size_t length;
+    char  *page = stats_render(&length);
+
+    if(!page)
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+
+    write_headers(r, HTTP_STATUS_OK, "application/json", length, "Cache-Control: no-store\r\n");
+    fwrite(page, 1, length, r->connection->stream);
+    free(page);
     return HTTP_STATUS_OK;
 }
 
@@ -296,26 +598,65 @@ Status  handle_cgi_request(Request *r) {
  * notify the user of the error.
  **/
 Status  handle_error(Request *r, Status status) {
+    trace_scope("handle_error");
     const char *status_string = http_status_string(status);
+    char body[BUFSIZ];
 
-    /* Write HTTP Header */
-    fprintf(r->stream, "HTTP/1.0 %s\r\n", status_string);
-    fprintf(r->stream, "Content-Type: text/html\r\n");
-    fprintf(r->stream, "\r\n");
-
-    /* Write HTML Description of Error*/
+    /* Format HTML Description of Error*/
 
     char* theWay = "https://i0.wp.com/tommyeturnertalks.com/wp-content/uploads/2019/12/mandalorian-episode-5-release-time-disney-plus.jpeg?fit=1300%2C651&ssl=1";
 
-    fprintf(r->stream, "<center>\n");
-    fprintf(r->stream, "<h1 class=\"display-1\">%s</h1>", status_string);
-    fprintf(r->stream, "<h2 class=\"display-2\">This is not the way</h2>\n");
-    fprintf(r->stream, "<img src=\"%s\">\n", theWay);
-    fprintf(r->stream, "</center>");
+    int length = snprintf(body, sizeof(body),
+        "<center>\n"
+        "<h1 class=\"display-1\">%s</h1>"
+        "<h2 class=\"display-2\">This is not the way</h2>\n"
+        "<img src=\"%s\">\n"
+        "</center>", status_string, theWay);
+
+    /* Write HTTP Header and HTML Description of Error */
+
+    write_headers(r, status, "text/html", length, NULL);
+    fwrite(body, 1, length, r->connection->stream);
 
 
     /* Return specified status */
     return status;
 }
 
+/**
+ * Write HTTP response headers.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   status      HTTP status of response.
+ * @param   mimetype    Content-Type of response.
+ * @param   length      Content-Length of response (-1 if unknown).
+ * (Neither is sent with HTTP_STATUS_NOT_MODIFIED, which has no body.)
+ * @param   extra       Further header lines, each ending in CRLF (or NULL).
+ *
+ * The status line echoes the request's HTTP version.  A response of unknown
+ * length can only be delimited by closing the connection (unless extra says
+ * it is sent chunked), so it turns keep-alive off; either way the Connection
+ * header tells the client whether the connection stays open.  Whatever the
+ * handler writes after the headers is dropped for HEAD requests (see
+ * request_headers_end).
+ **/
+void    write_headers(Request *r, Status status, const char *mimetype, off_t length, const char *extra) {
+    FILE *stream = r->connection->stream;
+
+    if(length < 0 && !(extra && strstr(extra, "Transfer-Encoding: chunked\r\n")))
+        r->keep_alive = false;
+
+    fprintf(stream, "HTTP/1.%d %s\r\n", r->version, http_status_string(status));
+    if(status != HTTP_STATUS_NOT_MODIFIED){
+        fprintf(stream, "Content-Type: %s\r\n", mimetype);
+        if(length >= 0)
+            fprintf(stream, "Content-Length: %lld\r\n", (long long)length);
+    }
+    if(extra)
+        fputs(extra, stream);
+    fprintf(stream, "Connection: %s\r\n", r->keep_alive ? "keep-alive" : "close");
+    fprintf(stream, "\r\n");
+    request_headers_end(r);
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,359 @@
+/* journal.c: Access Journal */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define JOURNAL_RING_SIZE   4096        /* Records per ring (a power of two) */
+#define JOURNAL_INTERVAL    50          /* Milliseconds between writer passes */
+#define JOURNAL_BATCH       (64 << 10)  /* Bytes of log lines per write */
+#define JOURNAL_LINE        512         /* Longest formatted record */
+
+_Static_assert(sizeof(JournalRecord) == 256, "journal records are fixed-size");
+
+/* Structures */
+
+typedef struct journal_ring JournalRing;
+struct journal_ring {
+    JournalRecord records[JOURNAL_RING_SIZE];
+    size_t       head;                  /* Next slot to fill (producer) */
+    size_t       tail;                  /* Next slot to write (writer) */
+    size_t       dropped;               /* Records lost because the ring was full */
+    JournalRing *next;                  /* Next ring in this process */
+};
+
+/* Globals */
+
+static pthread_mutex_t JournalLock = PTHREAD_MUTEX_INITIALIZER;    /* One drain at a time */
+static pthread_mutex_t JournalWakeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  JournalWake = PTHREAD_COND_INITIALIZER;
+
+static int          JournalFd      = -1;        /* Where access lines go (-1 = off) */
+static JournalRing *JournalRings   = NULL;      /* Rings of this process's threads */
+static pthread_once_t JournalWriting = PTHREAD_ONCE_INIT;   /* Writer thread started */
+
+static size_t JournalWritten = 0;
+static size_t JournalDropped = 0;
+
+static __thread JournalRing *Ring = NULL;       /* This thread's ring */
+
+/* Internal Functions */
+
+static inline uint64_t journal_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Write a whole batch to the journal (giving up on errors).
+ **/
+static void journal_write(const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t nwritten = write(JournalFd, data, length);
+        if (nwritten < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nwritten <= 0) {
+            debug("Unable to write access journal: %s", strerror(errno));
+            return;
+        }
+        data   += nwritten;
+        length -= nwritten;
+    }
+}
+
+/**
+ * Format one record as a line of Common Log Format followed by the latency
+ * in seconds.
+ *
+ * @param   record      Journal record.
+ * @param   line        Where to format the line (JOURNAL_LINE bytes).
+ * @return  Length of the line.
+ **/
+static size_t journal_format(const JournalRecord *record, char *line) {
+    static __thread time_t stamped = 0;         /* Second the date was rendered for */
+    static __thread char   date[32];
+    int length;
+
+    if (record->time != stamped) {
+        struct tm tm;
+        localtime_r(&record->time, &tm);
+        strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z", &tm);
+        stamped = record->time;
+    }
+
+    if (record->method[0]) {
+        length = snprintf(line, JOURNAL_LINE, "%s - - [%s] \"%s %s HTTP/1.%d\" %d %lld %.6f\n",
+            record->host, date, record->method, record->uri, record->version,
+            record->status, (long long)record->bytes, record->latency / 1e6);
+    } else {
+        length = snprintf(line, JOURNAL_LINE, "%s - - [%s] \"-\" %d %lld %.6f\n",
+            record->host, date, record->status, (long long)record->bytes, record->latency / 1e6);
+    }
+
+    return length < JOURNAL_LINE ? length : JOURNAL_LINE - 1;
+}
+
+/**
+ * Write out everything the producers have published so far.
+ *
+ * Only one drain runs at a time (JournalLock); it consumes each ring up to
+ * the head it saw, formats the records into batches, and writes each batch
+ * with a single write(2).  Producers never take JournalLock, so a slow disk
+ * only ever holds up the writer.
+ **/
+static void journal_drain(void) {
+    char   batch[JOURNAL_BATCH];
+    size_t used    = 0;
+    size_t dropped = 0;
+
+    pthread_mutex_lock(&JournalLock);
+
+    for (JournalRing *ring = __atomic_load_n(&JournalRings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        while (ring->tail != head) {
+            if (used > JOURNAL_BATCH - JOURNAL_LINE) {
+                journal_write(batch, used);
+                used = 0;
+            }
+            used += journal_format(&ring->records[ring->tail & (JOURNAL_RING_SIZE - 1)], batch + used);
+            __atomic_add_fetch(&JournalWritten, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+        }
+
+        dropped += __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    }
+
+    if (used) {
+        journal_write(batch, used);
+    }
+
+    pthread_mutex_unlock(&JournalLock);
+
+    if (dropped) {
+        __atomic_add_fetch(&JournalDropped, dropped, __ATOMIC_RELAXED);
+        log("Access journal full: %zu records dropped", dropped);
+    }
+}
+
+/**
+ * Writer thread: drain the rings every JOURNAL_INTERVAL milliseconds, or as
+ * soon as a producer finds its ring half full.
+ **/
+static void * journal_writer(void *arg) {
+    while (true) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += JOURNAL_INTERVAL * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(&JournalWakeLock);
+        pthread_cond_timedwait(&JournalWake, &JournalWakeLock, &deadline);
+        pthread_mutex_unlock(&JournalWakeLock);
+
+        journal_drain();
+    }
+
+    return NULL;
+}
+
+static void journal_start(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, journal_writer, NULL) == 0) {
+        pthread_detach(thread);
+    } else {
+        log("Unable to start access journal writer: %s", strerror(errno));
+    }
+}
+
+/**
+ * Give the calling thread a ring (and this process a writer thread).
+ *
+ * @return  The thread's ring, or NULL on failure.
+ *
+ * Rings are pushed onto JournalRings without locking and stay there for the
+ * life of the process (worker threads are never retired).
+ **/
+static JournalRing * journal_ring(void) {
+    JournalRing *ring = calloc(1, sizeof(JournalRing));
+    if (!ring) {
+        return NULL;
+    }
+
+    ring->next = __atomic_load_n(&JournalRings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&JournalRings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    pthread_once(&JournalWriting, journal_start);
+    return Ring = ring;
+}
+
+/**
+ * Forget the parent's rings and writer in a newly forked child.
+ *
+ * The parent writes what was already in its rings; the forking thread keeps
+ * its ring (now empty) as the child's only one, and the child starts its own
+ * writer thread with its next record.
+ **/
+static void journal_fork_child(void) {
+    pthread_mutex_init(&JournalLock, NULL);
+    pthread_mutex_init(&JournalWakeLock, NULL);
+    pthread_cond_init(&JournalWake, NULL);
+
+    JournalRings   = NULL;
+    JournalWriting = (pthread_once_t)PTHREAD_ONCE_INIT;
+
+    if (Ring) {
+        Ring->tail    = Ring->head;
+        Ring->dropped = 0;
+        Ring = NULL;
+    }
+}
+
+/* Functions */
+
+/**
+ * Open the access journal.
+ *
+ * @param   path        Path to append access lines to ("-" for standard
+ *                      error, "" for none).
+ * @return  Whether the journal could be opened.
+ *
+ * This is done once in main, before any worker process or thread exists.
+ **/
+bool journal_open(const char *path) {
+    if (!*path) {
+        return true;
+    }
+
+    if (streq(path, "-")) {
+        JournalFd = STDERR_FILENO;
+    } else {
+        JournalFd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (JournalFd < 0) {
+            return false;
+        }
+    }
+
+    pthread_atfork(NULL, NULL, journal_fork_child);
+    atexit(journal_drain);
+    return true;
+}
+
+/**
+ * Start recording a request.
+ *
+ * @param   record      Journal record (typically on the caller's stack).
+ * @param   c           Connection structure the request arrives on.
+ *
+ * The request is timed (and its response bytes counted) even with the
+ * journal off, for the server statistics (see stats_request).
+ **/
+void journal_begin(JournalRecord *record, Connection *c) {
+    record->started = journal_now();
+    record->bytes   = connection_sent(c);
+
+    if (JournalFd < 0) {
+        return;
+    }
+
+    record->time      = time(NULL);
+    record->method[0] = 0;
+    record->uri[0]    = 0;
+    strncpy(record->host, c->host, sizeof(record->host) - 1);
+    record->host[sizeof(record->host) - 1] = 0;
+}
+
+/**
+ * Record the request line of a parsed request.
+ *
+ * @param   r           Request structure (with r->access, if any, begun).
+ *
+ * This copies (and truncates) the method and URI (with its query) as soon as they are parsed,
+ * since reading the request body may move the input they point into.
+ **/
+void journal_request(Request *r) {
+    JournalRecord *record = r->access;
+
+    if (!record || JournalFd < 0) {
+        return;
+    }
+
+    strncpy(record->method, r->method, sizeof(record->method) - 1);
+    record->method[sizeof(record->method) - 1] = 0;
+    snprintf(record->uri, sizeof(record->uri), "%s%s%s", r->uri, r->query && *r->query ? "?" : "", r->query ? r->query : "");
+    record->version = r->version;
+}
+
+/**
+ * Finish recording a request and hand it to the writer.
+ *
+ * @param   record      Journal record (started with journal_begin).
+ * @param   c           Connection structure the request arrived on.
+ * @param   status      Status of the response (see Status).
+ *
+ * The record is copied into the calling thread's ring; this never blocks
+ * and never does I/O (beyond waking the writer early once the ring is half
+ * full).  If the writer has fallen a full ring behind, the record is dropped
+ * (and counted) instead.  Bytes include the response
+ * headers and body, whether or not they have left the output buffer yet.
+ **/
+void journal_end(JournalRecord *record, Connection *c, int status) {
+    record->latency = (journal_now() - record->started) / 1000;
+    record->bytes   = connection_sent(c) - record->bytes;
+
+    if (JournalFd < 0) {
+        return;
+    }
+
+    JournalRing *ring = Ring ? Ring : journal_ring();
+    if (!ring) {
+        return;
+    }
+
+    record->status = atoi(http_status_string(status));
+
+    size_t head    = ring->head;
+    size_t pending = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (pending == JOURNAL_RING_SIZE) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    ring->records[head & (JOURNAL_RING_SIZE - 1)] = *record;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    if (pending == JOURNAL_RING_SIZE / 2) {
+        pthread_cond_signal(&JournalWake);
+    }
+}
+
+/**
+ * Retrieve journal counters.
+ *
+ * @param   written     Where to store the number of access lines written.
+ * @param   dropped     Where to store the number of records dropped.
+ **/
+void journal_stats(size_t *written, size_t *dropped) {
+    *written = __atomic_load_n(&JournalWritten, __ATOMIC_RELAXED);
+    *dropped = __atomic_load_n(&JournalDropped, __ATOMIC_RELAXED);
+
+    /* Including drops the (possibly stuck) writer has not collected yet */
+    for (JournalRing *ring = __atomic_load_n(&JournalRings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        *dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,519 @@
+/* listing.c: Directory Listings */
+
+#include "spidey.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/* Listed Names */
+
+typedef struct {
+    unsigned char type;                 /*< d_type of entry */
+    char          name[];               /*< Name of entry */
+} ListingName;
+
+/* Rendered Listings */
+
+typedef struct listing_entry ListingEntry;
+struct listing_entry {
+    LRUNode       node;                 /*< Hash (of URI and format), cost and LRU links */
+    char         *uri;                  /*< URI the listing was rendered for */
+    ListingFormat format;               /*< Format of body */
+    ino_t         ino;                  /*< Inode of listed directory */
+    struct timespec mtime;              /*< Modification time of listed directory */
+
+    char         *body;                 /*< Rendered listing (NULL if too large to keep) */
+    size_t        length;               /*< Length of body */
+};
+
+/* Globals */
+
+static pthread_mutex_t ListingLock = PTHREAD_MUTEX_INITIALIZER;
+
+static LRUNode  *ListingBuckets[256];
+static LRUTable ListingTable = LRU_TABLE(ListingBuckets);  /* Cached entries (costing their bytes) */
+
+static size_t ListingHits   = 0;
+static size_t ListingMisses = 0;
+static size_t ListingStreamed = 0;
+
+/* Internal Functions */
+
+static inline size_t listing_cost(ListingEntry *entry) {
+    return sizeof(ListingEntry) + (entry->body ? entry->length : 0);
+}
+
+static void listing_free(ListingEntry *entry) {
+    free(entry->uri);
+    free(entry->body);
+    free(entry);
+}
+
+/**
+ * Find entry for URI and format (must hold ListingLock).
+ **/
+static ListingEntry * listing_find(const char *uri, ListingFormat format, size_t hash) {
+    LRUNode *node = lru_chain(&ListingTable, hash);
+    while (node && (node->hash != hash || lru_entry(node, ListingEntry)->format != format ||
+                    !streq(lru_entry(node, ListingEntry)->uri, uri))) {
+        node = node->chain;
+    }
+    return lru_entry(node, ListingEntry);
+}
+
+/**
+ * Order names like alphasort (falling back to bytes, so that no two names
+ * are ever equal).
+ **/
+static int listing_compare(const char *a, const char *b) {
+    int order = strcoll(a, b);
+    return order ? order : strcmp(a, b);
+}
+
+static int listing_sort(const void *a, const void *b) {
+    return listing_compare((*(ListingName * const *)a)->name, (*(ListingName * const *)b)->name);
+}
+
+/**
+ * Restore the max-heap property below index i.
+ **/
+static void listing_sift_down(ListingName **heap, size_t n, size_t i) {
+    while (true) {
+        size_t largest = i;
+        size_t left    = 2 * i + 1;
+        size_t right   = left + 1;
+
+        if (left  < n && listing_compare(heap[left]->name,  heap[largest]->name) > 0) largest = left;
+        if (right < n && listing_compare(heap[right]->name, heap[largest]->name) > 0) largest = right;
+        if (largest == i) {
+            return;
+        }
+
+        ListingName *swap = heap[i];
+        heap[i] = heap[largest];
+        heap[largest] = swap;
+        i = largest;
+    }
+}
+
+/**
+ * Restore the max-heap property above index i.
+ **/
+static void listing_sift_up(ListingName **heap, size_t i) {
+    while (i > 0 && listing_compare(heap[i]->name, heap[(i - 1) / 2]->name) > 0) {
+        ListingName *swap = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = swap;
+        i = (i - 1) / 2;
+    }
+}
+
+/**
+ * Read the next chunk of names from a directory, in sorted order.
+ *
+ * @param   dir         Directory stream (rewound by this function).
+ * @param   after       Last name of the previous chunk (or NULL for the first).
+ * @param   names       Where to store the names (each to be freed).
+ * @param   capacity    Number of names that fit in names.
+ * @return  Number of names stored (fewer than capacity once the last chunk
+ * is reached), or -1 on failure.
+ *
+ * Each chunk is one pass over the directory that keeps the capacity
+ * smallest names sorting after the previous chunk in a max-heap, so no
+ * more than capacity names are ever held, however large the directory.
+ **/
+static ssize_t listing_chunk(DIR *dir, const ListingName *after, ListingName **names, size_t capacity) {
+    struct dirent *d;
+    size_t count = 0;
+
+    rewinddir(dir);
+    while ((d = readdir(dir))) {
+        if (streq(d->d_name, ".") || (after && listing_compare(d->d_name, after->name) <= 0) ||
+            (count == capacity && listing_compare(d->d_name, names[0]->name) > 0)) {
+            continue;
+        }
+
+        size_t length = strlen(d->d_name) + 1;
+        ListingName *name = malloc(sizeof(ListingName) + length);
+        if (!name) {
+            while (count) free(names[--count]);
+            return -1;
+        }
+        name->type = d->d_type;
+        memcpy(name->name, d->d_name, length);
+
+        if (count < capacity) {
+            names[count] = name;
+            listing_sift_up(names, count++);
+        } else {
+            free(names[0]);
+            names[0] = name;
+            listing_sift_down(names, count, 0);
+        }
+    }
+
+    qsort(names, count, sizeof(ListingName *), listing_sort);
+    return count;
+}
+
+/**
+ * Write a string as a JSON string literal.
+ **/
+static void listing_json_string(FILE *stream, const char *s) {
+    fputc('"', stream);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fputc('\\', stream);
+            fputc(c, stream);
+        } else if (c < 0x20) {
+            fprintf(stream, "\\u%04x", c);
+        } else {
+            fputc(c, stream);
+        }
+    }
+    fputc('"', stream);
+}
+
+/**
+ * Render the start of a listing.
+ **/
+static void listing_render_head(FILE *stream, Request *r, ListingFormat format) {
+    if (format == LISTING_JSON) {
+        fputs("{\"uri\":", stream);
+        listing_json_string(stream, r->uri);
+        fputs(",\"entries\":[", stream);
+        return;
+    }
+
+    fputs("<!DOCTYPE html>\n"
+          "<html>\n"
+          "<head>\n"
+          "<meta charset=\"utf-8\">\n"
+          "<link rel=\"stylesheet\" href=\"https://maxcdn.bootstrapcdn.com/bootstrap/4.0.0/css/bootstrap.min.css\" integrity=\"sha384-Gn5384xqQ1aoWXA+058RXPxPg6fy4IWvTNh0E263XmFcJlSAwiGgFAW/dAiS6JXm\" crossorigin=\"anonymous\">\n"
+          "</head>\n"
+          "<body>\n"
+          "<ul class=\"list-group\">", stream);
+}
+
+/**
+ * Render a chunk of (sorted) entries of a listing.
+ *
+ * @param   stream      Stream to render into.
+ * @param   r           HTTP Request structure (for a directory).
+ * @param   format      Format of listing.
+ * @param   names       Names of entries.
+ * @param   count       Number of names.
+ * @param   first       Whether no entry has been rendered yet (updated).
+ **/
+static void listing_render_names(FILE *stream, Request *r, ListingFormat format, ListingName **names, size_t count, bool *first) {
+    static const char *Types[] = {
+        [DT_DIR] = "directory", [DT_REG] = "file", [DT_LNK] = "link",
+        [DT_FIFO] = "other", [DT_SOCK] = "other", [DT_CHR] = "other", [DT_BLK] = "other",
+    };
+    const char *slash = r->uri[strlen(r->uri) - 1] == '/' ? "" : "/";
+
+    for (size_t i = 0; i < count; i++) {
+        if (format == LISTING_HTML) {
+            fprintf(stream, "<li class=\"list-group-item\">\n<a href=\"%s%s%s\">%s</a>\n</li>\n",
+                r->uri, slash, names[i]->name, names[i]->name);
+            continue;
+        }
+
+        unsigned char type = names[i]->type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", r->path, names[i]->name);
+            type = lstat(path, &st) < 0 ? DT_UNKNOWN : IFTODT(st.st_mode);
+        }
+
+        fputs(*first ? "{\"name\":" : ",{\"name\":", stream);
+        listing_json_string(stream, names[i]->name);
+        fprintf(stream, ",\"type\":\"%s\"}",
+            type < sizeof(Types) / sizeof(Types[0]) && Types[type] ? Types[type] : "other");
+        *first = false;
+    }
+}
+
+/**
+ * Render the end of a listing.
+ **/
+static void listing_render_tail(FILE *stream, ListingFormat format) {
+    fputs(format == LISTING_JSON ? "]}\n" : "</ul></body></html>", stream);
+}
+
+/**
+ * Render a listing of at most LISTING_CHUNK entries into a new entry.
+ *
+ * @param   r           HTTP Request structure (for a directory).
+ * @param   format      Format of listing.
+ * @param   hash        Hash of URI and format.
+ * @return  Newly allocated entry with one reference (whose body is NULL if
+ * the directory has too many entries to keep), or NULL on failure.
+ **/
+static ListingEntry * listing_load(Request *r, ListingFormat format, size_t hash) {
+    ListingName  **names = malloc(LISTING_CHUNK * sizeof(ListingName *));
+    ListingEntry  *entry = calloc(1, sizeof(ListingEntry));
+    DIR           *dir   = opendir(r->path);
+    ssize_t        count = -1;
+    FILE          *stream;
+
+    if (!names || !entry || !dir || !(entry->uri = strdup(r->uri)) ||
+        (count = listing_chunk(dir, NULL, names, LISTING_CHUNK)) < 0) {
+        goto failure;
+    }
+
+    entry->format = format;
+    entry->ino    = r->file->st.st_ino;
+    entry->mtime  = r->file->st.st_mtim;
+    entry->node.hash = hash;
+    entry->node.refs = 1;
+
+    if (count < LISTING_CHUNK) {
+        bool first = true;
+        if (!(stream = open_memstream(&entry->body, &entry->length))) {
+            goto failure;
+        }
+        listing_render_head(stream, r, format);
+        listing_render_names(stream, r, format, names, count, &first);
+        listing_render_tail(stream, format);
+        fclose(stream);
+    }
+    entry->node.cost = listing_cost(entry);
+
+    while (count > 0) free(names[--count]);
+    free(names);
+    closedir(dir);
+    return entry;
+
+failure:
+    while (count > 0) free(names[--count]);
+    free(names);
+    if (dir) closedir(dir);
+    if (entry) listing_free(entry);
+    return NULL;
+}
+
+/**
+ * Write part of a streamed listing (as a chunk, if chunked).
+ **/
+static void listing_write(Request *r, const char *data, size_t length, bool chunked) {
+    FILE *stream = r->connection->stream;
+
+    if (length == 0) {
+        return;
+    }
+    if (chunked) {
+        fprintf(stream, "%zx\r\n", length);
+    }
+    fwrite(data, 1, length, stream);
+    if (chunked) {
+        fputs("\r\n", stream);
+    }
+}
+
+/* Functions */
+
+/**
+ * Choose the format of a directory listing.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  LISTING_JSON if asked for with "format=json" in the query or an
+ * Accept header that prefers application/json; otherwise LISTING_HTML.
+ **/
+ListingFormat listing_format(Request *r) {
+    const char *accept = request_header(r, "Accept");
+
+    for (const char *query = r->query; (query = strstr(query, "format=json")); query++) {
+        if ((query == r->query || query[-1] == '&') && (query[11] == '\0' || query[11] == '&')) {
+            return LISTING_JSON;
+        }
+    }
+
+    return accept && strncasecmp(skip_whitespace((char *)accept), "application/json", 16) == 0 ?
+        LISTING_JSON : LISTING_HTML;
+}
+
+/**
+ * Get a reference to the rendered listing of a directory.
+ *
+ * @param   r           HTTP Request structure (for a directory).
+ * @param   format      Format of listing (see listing_format).
+ * @param   listing     Where to store the rendered body and its length.
+ * @return  Whether the directory could be read.  The body is NULL if the
+ * directory has LISTING_CHUNK entries or more, which are not kept but
+ * streamed (see listing_stream); otherwise it must be released with
+ * listing_release.
+ *
+ * Listings are rendered once per URI and format and kept, least recently
+ * used first, within LISTING_BUDGET bytes.  They are only rendered again
+ * once the directory is replaced or its modification time changes (as seen
+ * by cache_lookup), which is whenever an entry is added, removed or renamed.
+ **/
+bool listing_acquire(Request *r, ListingFormat format, Listing *listing) {
+    struct stat  *st      = &r->file->st;
+    ListingEntry *entry   = NULL;
+    LRUNode      *evicted = NULL;
+    size_t        hash    = hash_string(r->uri) ^ format;
+
+    pthread_mutex_lock(&ListingLock);
+    entry = listing_find(r->uri, format, hash);
+    if (entry && (entry->ino != st->st_ino || entry->mtime.tv_sec != st->st_mtim.tv_sec ||
+                  entry->mtime.tv_nsec != st->st_mtim.tv_nsec)) {
+        lru_discard(&ListingTable, &entry->node, &evicted);
+        entry = NULL;
+    }
+
+    if (entry) {
+        entry->node.refs++;
+        ListingHits++;
+    } else {
+        ListingMisses++;
+    }
+    pthread_mutex_unlock(&ListingLock);
+    stats_cache(STATS_CACHE_LISTING, entry != NULL);
+
+    /* Miss: render listing and cache it (replacing any entry rendered
+     * concurrently) */
+
+    if (!entry && (entry = listing_load(r, format, hash))) {
+        pthread_mutex_lock(&ListingLock);
+        ListingEntry *other = listing_find(r->uri, format, hash);
+        if (other) {
+            lru_discard(&ListingTable, &other->node, &evicted);
+        }
+        lru_insert(&ListingTable, &entry->node);
+        lru_evict(&ListingTable, LISTING_BUDGET, &evicted);
+        pthread_mutex_unlock(&ListingLock);
+    }
+
+    while (evicted) {
+        LRUNode *next = evicted->chain;
+        listing_free(lru_entry(evicted, ListingEntry));
+        evicted = next;
+    }
+
+    if (!entry) {
+        return false;
+    }
+
+    listing->entry  = entry;
+    listing->body   = entry->body;
+    listing->length = entry->length;
+
+    if (!entry->body) {
+        listing_release(listing);
+    }
+    return true;
+}
+
+/**
+ * Release a reference to a rendered listing.
+ *
+ * @param   listing     Rendered listing (see listing_acquire).
+ **/
+void listing_release(Listing *listing) {
+    ListingEntry *entry = (ListingEntry *)listing->entry;
+
+    pthread_mutex_lock(&ListingLock);
+    bool last = --entry->node.refs == 0;
+    pthread_mutex_unlock(&ListingLock);
+
+    if (last) {
+        listing_free(entry);
+    }
+    listing->entry = NULL;
+}
+
+/**
+ * Stream the listing of a large directory in sorted chunks.
+ *
+ * @param   r           HTTP Request structure (for a directory).
+ * @param   format      Format of listing (see listing_format).
+ * @param   chunked     Whether to use chunked transfer coding (otherwise
+ * the listing ends with the connection).
+ * @return  Whether the whole listing was sent.
+ *
+ * Only LISTING_CHUNK names are held at a time (see listing_chunk), and each
+ * chunk is rendered and written before the next is read, so the memory
+ * used does not grow with the directory.
+ **/
+bool listing_stream(Request *r, ListingFormat format, bool chunked) {
+    ListingName **names = malloc(LISTING_CHUNK * sizeof(ListingName *));
+    ListingName  *last  = NULL;
+    DIR          *dir   = opendir(r->path);
+    bool          first = true;
+    bool          done  = false;
+    char         *data  = NULL;
+    size_t        length;
+    FILE         *stream;
+
+    __atomic_add_fetch(&ListingStreamed, 1, __ATOMIC_RELAXED);
+
+    if (!names || !dir) {
+        goto finish;
+    }
+
+    while (!done) {
+        ssize_t count = listing_chunk(dir, last, names, LISTING_CHUNK);
+        if (count < 0 || !(stream = open_memstream(&data, &length))) {
+            break;
+        }
+
+        if (!last) {
+            listing_render_head(stream, r, format);
+        }
+        listing_render_names(stream, r, format, names, count, &first);
+        if ((done = count < LISTING_CHUNK)) {
+            listing_render_tail(stream, format);
+        }
+        fclose(stream);
+
+        listing_write(r, data, length, chunked);
+        free(data);
+
+        free(last);
+        last = count ? names[--count] : NULL;
+        while (count > 0) free(names[--count]);
+    }
+
+finish:
+    free(last);
+    free(names);
+    if (dir) closedir(dir);
+
+    /* A listing cut short can only be ended by closing the connection */
+
+    if (!done) {
+        r->keep_alive = false;
+    } else if (chunked) {
+        fputs("0\r\n\r\n", r->connection->stream);
+    }
+    return done;
+}
+
+/**
+ * Retrieve directory listing counters.
+ *
+ * @param   hits        Where to store the number of listings sent from cache.
+ * @param   misses      Where to store the number of listings rendered.
+ * @param   streamed    Where to store the number of listings streamed.
+ * @param   bytes       Where to store the number of bytes cached.
+ **/
+void listing_stats(size_t *hits, size_t *misses, size_t *streamed, size_t *bytes) {
+    pthread_mutex_lock(&ListingLock);
+    *hits     = ListingHits;
+    *misses   = ListingMisses;
+    *streamed = __atomic_load_n(&ListingStreamed, __ATOMIC_RELAXED);
+    *bytes    = ListingTable.total;
+    pthread_mutex_unlock(&ListingLock);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
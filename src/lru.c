@@ -0,0 +1,140 @@
+/* lru.c: Refcounted LRU Hash Tables */
+
+#include "spidey.h"
+
+#include <string.h>
+
+/**
+ * Allocate the buckets of an empty table.
+ *
+ * @param   table       LRU table.
+ * @param   nbuckets    Minimum number of hash buckets (rounded up to a power
+ * of two, so that hashes can be mapped to buckets with a mask).
+ * @return  Whether the buckets could be allocated.
+ *
+ * Tables with a fixed number of buckets can be set up statically with
+ * LRU_TABLE instead.
+ **/
+bool lru_init(LRUTable *table, size_t nbuckets) {
+    size_t size = 16;
+    while (size < nbuckets) {
+        size <<= 1;
+    }
+
+    memset(table, 0, sizeof(*table));
+    table->buckets = calloc(size, sizeof(LRUNode *));
+    table->mask    = table->buckets ? size - 1 : 0;
+    return table->buckets != NULL;
+}
+
+/**
+ * Find the first node in the bucket of a hash (the caller walks the chain
+ * links for the node whose key matches).
+ *
+ * @param   table       LRU table.
+ * @param   hash        Hash of key.
+ * @return  First node in bucket (or NULL if it is empty).
+ **/
+LRUNode * lru_chain(LRUTable *table, size_t hash) {
+    return table->buckets[hash & table->mask];
+}
+
+/**
+ * Insert node at the front of the LRU list.
+ *
+ * @param   table       LRU table.
+ * @param   node        Node (with its hash and cost set).
+ *
+ * The table takes a reference of its own, and node->cost is added to the
+ * table's total.
+ **/
+void lru_insert(LRUTable *table, LRUNode *node) {
+    LRUNode **bucket = &table->buckets[node->hash & table->mask];
+    node->chain = *bucket;
+    *bucket     = node;
+
+    node->prev = NULL;
+    node->next = table->head;
+    if (table->head) table->head->prev = node; else table->tail = node;
+    table->head = node;
+
+    table->count++;
+    table->total += node->cost;
+    node->refs++;
+}
+
+/**
+ * Remove node from the hash table and LRU list.
+ *
+ * @param   table       LRU table.
+ * @param   node        Node (in the table).
+ * @return  Whether the table's reference was the last one (and the caller
+ * must free the entry after dropping its lock).
+ **/
+bool lru_remove(LRUTable *table, LRUNode *node) {
+    LRUNode **link = &table->buckets[node->hash & table->mask];
+    while (*link != node) {
+        link = &(*link)->chain;
+    }
+    *link = node->chain;
+
+    if (node->prev) node->prev->next = node->next; else table->head = node->next;
+    if (node->next) node->next->prev = node->prev; else table->tail = node->prev;
+
+    table->count--;
+    table->total -= node->cost;
+    return --node->refs == 0;
+}
+
+/**
+ * Remove node, pushing it onto a list of nodes to free if that was the last
+ * reference.
+ *
+ * @param   table       LRU table.
+ * @param   node        Node (in the table).
+ * @param   evicted     List that nodes which must be freed (after dropping
+ * the lock) are pushed onto, through their chain links.
+ **/
+void lru_discard(LRUTable *table, LRUNode *node, LRUNode **evicted) {
+    if (lru_remove(table, node)) {
+        node->chain = *evicted;
+        *evicted    = node;
+    }
+}
+
+/**
+ * Move node to the front of the LRU list.
+ *
+ * @param   table       LRU table.
+ * @param   node        Node (in the table).
+ **/
+void lru_touch(LRUTable *table, LRUNode *node) {
+    if (node == table->head) {
+        return;
+    }
+
+    node->prev->next = node->next;
+    if (node->next) node->next->prev = node->prev; else table->tail = node->prev;
+
+    node->prev = NULL;
+    node->next = table->head;
+    table->head->prev = node;
+    table->head = node;
+}
+
+/**
+ * Evict least recently used nodes until the total is within budget, or only
+ * the most recently used node is left.
+ *
+ * @param   table       LRU table.
+ * @param   budget      Largest total to keep.
+ * @param   evicted     List that nodes which must be freed are pushed onto
+ * (see lru_discard).
+ **/
+void lru_evict(LRUTable *table, size_t budget, LRUNode **evicted) {
+    while (table->total > budget && table->tail != table->head) {
+        lru_discard(table, table->tail, evicted);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,299 @@
+/* mapping.c: Shared File Mappings */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Mapped Files */
+
+typedef struct mapping Mapping;
+struct mapping {
+    LRUNode     node;                   /*< Hash (of inode) and LRU links (bytes are counted apart) */
+    dev_t       dev;                    /*< Device of mapped file */
+    ino_t       ino;                    /*< Inode of mapped file */
+    off_t       size;                   /*< Size of mapped file (and mapping) */
+    struct timespec mtime;              /*< Modification time when mapped */
+    char       *data;                   /*< Start of mapping */
+
+    time_t      used;                   /*< When a response last used the mapping */
+};
+
+/* Globals */
+
+static pthread_mutex_t MappingLock = PTHREAD_MUTEX_INITIALIZER;
+
+static LRUNode  *MappingBuckets[256];
+static LRUTable MappingTable = LRU_TABLE(MappingBuckets);  /* Mappings by inode */
+static size_t   MappingBytes = 0;       /* Bytes mapped (in the table or not) */
+
+static size_t MappingHits   = 0;
+static size_t MappingMisses = 0;
+
+/* Internal Functions */
+
+static inline size_t mapping_hash(dev_t dev, ino_t ino) {
+    return dev * 31 + ino;
+}
+
+/**
+ * Find the mapping of an inode (must hold MappingLock).
+ **/
+static Mapping * mapping_find(dev_t dev, ino_t ino) {
+    LRUNode *node = lru_chain(&MappingTable, mapping_hash(dev, ino));
+    while (node && (lru_entry(node, Mapping)->dev != dev || lru_entry(node, Mapping)->ino != ino)) {
+        node = node->chain;
+    }
+    return lru_entry(node, Mapping);
+}
+
+/**
+ * Unmap mappings whose last reference is gone.
+ *
+ * @param   unmapped    List of mappings (through their chain links).
+ **/
+static void mapping_free(LRUNode *unmapped) {
+    while (unmapped) {
+        LRUNode *next = unmapped->chain;
+        Mapping *m    = lru_entry(unmapped, Mapping);
+        munmap(m->data, m->size);
+        free(m);
+        unmapped = next;
+    }
+}
+
+/**
+ * Retire a mapping whose last reference is gone (must hold MappingLock).
+ *
+ * @param   m           Mapping.
+ * @param   unmapped    List that the mapping is pushed onto (to be unmapped
+ * after dropping the lock).
+ **/
+static void mapping_retire(Mapping *m, LRUNode **unmapped) {
+    MappingBytes -= m->size;
+    m->node.chain = *unmapped;
+    *unmapped     = &m->node;
+}
+
+/**
+ * Drop a reference to a mapping (must hold MappingLock).
+ **/
+static void mapping_put(Mapping *m, LRUNode **unmapped) {
+    if (--m->node.refs == 0) {
+        mapping_retire(m, unmapped);
+    }
+}
+
+/**
+ * Remove mapping from the hash table and LRU list (must hold MappingLock).
+ **/
+static void mapping_remove(Mapping *m, LRUNode **unmapped) {
+    if (lru_remove(&MappingTable, &m->node)) {
+        mapping_retire(m, unmapped);
+    }
+}
+
+/**
+ * Remove idle mappings (must hold MappingLock).
+ *
+ * @param   now         Current time.
+ * @param   needed      Bytes about to be mapped.
+ * @param   unmapped    List that removed mappings are pushed onto.
+ *
+ * Mappings nobody is using are dropped once they have been idle for
+ * MAPPING_IDLE seconds, or sooner (least recently used first) to make room
+ * for needed bytes within MAPPING_BUDGET.  Mappings in use are left alone.
+ **/
+static void mapping_trim(time_t now, size_t needed, LRUNode **unmapped) {
+    LRUNode *node = MappingTable.tail;
+
+    while (node) {
+        LRUNode *prev = node->prev;
+        Mapping *m    = lru_entry(node, Mapping);
+        if (node->refs == 1 && (MappingBytes + needed > MAPPING_BUDGET || now - m->used >= MAPPING_IDLE)) {
+            mapping_remove(m, unmapped);
+        }
+        node = prev;
+    }
+}
+
+/**
+ * Ask the kernel to read part of a mapping ahead of writing it.
+ **/
+static void mapping_prefetch(Mapping *m, off_t offset, off_t length) {
+    off_t start = offset & ~((off_t)getpagesize() - 1);
+    madvise(m->data + start, offset + length - start, MADV_WILLNEED);
+}
+
+/**
+ * Get a reference to the mapping of a file, mapping it if necessary.
+ *
+ * @param   file        Cache entry of a regular, open file.
+ * @return  Mapping with a reference for the caller, or NULL if the file
+ * cannot be mapped within MAPPING_BUDGET.
+ **/
+static Mapping * mapping_acquire(CacheEntry *file) {
+    struct stat *st       = &file->st;
+    LRUNode     *unmapped = NULL;
+    Mapping     *m;
+    time_t       now      = time(NULL);
+
+    pthread_mutex_lock(&MappingLock);
+
+    /* Share an existing mapping unless the file changed since */
+
+    m = mapping_find(st->st_dev, st->st_ino);
+
+    if (m && (m->size != st->st_size || m->mtime.tv_sec != st->st_mtim.tv_sec ||
+              m->mtime.tv_nsec != st->st_mtim.tv_nsec)) {
+        mapping_remove(m, &unmapped);
+        m = NULL;
+    }
+
+    if (m) {
+        m->node.refs++;
+        m->used = now;
+        MappingHits++;
+        lru_touch(&MappingTable, &m->node);
+    } else {
+        MappingMisses++;
+    }
+
+    /* Otherwise reserve room for a new one */
+
+    mapping_trim(now, m ? 0 : st->st_size, &unmapped);
+
+    bool reserved = !m && MappingBytes + st->st_size <= MAPPING_BUDGET;
+    if (reserved) {
+        MappingBytes += st->st_size;
+    }
+
+    pthread_mutex_unlock(&MappingLock);
+    mapping_free(unmapped);
+
+    if (m || !reserved) {
+        return m;
+    }
+
+    /* Map the file (without holding the lock) */
+
+    char *data = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, file->fd, 0);
+    m = data != MAP_FAILED ? calloc(1, sizeof(Mapping)) : NULL;
+    if (!m) {
+        debug("Unable to map %s: %s", file->path, strerror(errno));
+        if (data != MAP_FAILED) {
+            munmap(data, st->st_size);
+        }
+        pthread_mutex_lock(&MappingLock);
+        MappingBytes -= st->st_size;
+        pthread_mutex_unlock(&MappingLock);
+        return NULL;
+    }
+
+    madvise(data, st->st_size, MADV_SEQUENTIAL);
+
+    m->dev   = st->st_dev;
+    m->ino   = st->st_ino;
+    m->size  = st->st_size;
+    m->mtime = st->st_mtim;
+    m->data  = data;
+    m->used  = now;
+    m->node.hash = mapping_hash(m->dev, m->ino);
+    m->node.refs = 1;
+
+    /* Share it, unless another request mapped the same file concurrently */
+
+    pthread_mutex_lock(&MappingLock);
+    if (!mapping_find(m->dev, m->ino)) {
+        lru_insert(&MappingTable, &m->node);
+    }
+    pthread_mutex_unlock(&MappingLock);
+
+    return m;
+}
+
+/* Functions */
+
+/**
+ * Send part of a regular file to the client from a shared memory mapping.
+ *
+ * @param   c           Connection structure.
+ * @param   file        Cache entry of a regular, open file.
+ * @param   offset      Offset in file to start at.
+ * @param   length      Number of bytes to send.
+ * @return  Number of bytes sent, or -1 if the file was not mapped (in which
+ * case the caller must send it some other way).
+ *
+ * This is the alternative to sendfile (when SendFile is off) for files of at
+ * least MmapThreshold bytes: instead of copying the file through a buffer,
+ * the mapping is written to the socket directly (see connection_write).
+ * Concurrent responses for the same file share one read-only mapping, which
+ * is read ahead MAPPING_CHUNK bytes at a time.
+ *
+ * Mappings are reference counted and outlive a response only while idle for
+ * less than MAPPING_IDLE seconds; at most MAPPING_BUDGET bytes are mapped at
+ * once, so a directory of large assets cannot pin unbounded memory.  Files
+ * that do not fit are left to the caller.
+ **/
+off_t mapping_send(Connection *c, CacheEntry *file, off_t offset, off_t length) {
+    off_t size = file->st.st_size;
+    off_t sent = 0;
+
+    if (MmapThreshold == 0 || size < (off_t)MmapThreshold || size == 0 || file->fd < 0) {
+        return -1;
+    }
+
+    Mapping *m = mapping_acquire(file);
+    if (!m) {
+        return -1;
+    }
+
+    mapping_prefetch(m, offset, length < MAPPING_CHUNK ? length : MAPPING_CHUNK);
+
+    while (sent < length) {
+        off_t chunk = length - sent < MAPPING_CHUNK ? length - sent : MAPPING_CHUNK;
+
+        if (sent + chunk < length) {
+            off_t ahead = length - sent - chunk;
+            mapping_prefetch(m, offset + sent + chunk, ahead < MAPPING_CHUNK ? ahead : MAPPING_CHUNK);
+        }
+
+        off_t nwritten = connection_write(c, m->data + offset + sent, chunk);
+        if (nwritten > 0) {
+            sent += nwritten;
+        }
+        if (nwritten != chunk) {
+            break;
+        }
+    }
+
+    LRUNode *unmapped = NULL;
+    pthread_mutex_lock(&MappingLock);
+    mapping_put(m, &unmapped);
+    pthread_mutex_unlock(&MappingLock);
+    mapping_free(unmapped);
+
+    return sent;
+}
+
+/**
+ * Retrieve shared mapping counters.
+ *
+ * @param   hits        Where to store the number of responses sharing a mapping.
+ * @param   misses      Where to store the number of responses not sharing one.
+ * @param   bytes       Where to store the number of bytes mapped.
+ **/
+void mapping_stats(size_t *hits, size_t *misses, size_t *bytes) {
+    pthread_mutex_lock(&MappingLock);
+    *hits   = MappingHits;
+    *misses = MappingMisses;
+    *bytes  = MappingBytes;
+    pthread_mutex_unlock(&MappingLock);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,357 @@
+/* memo.c: CGI Response Memos */
+
+#include "spidey.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+/* Memoized Responses */
+
+typedef struct memo_entry MemoEntry;
+struct memo_entry {
+    LRUNode     node;                   /*< Hash (of key), cost (bytes held) and LRU links */
+    char       *key;                    /*< Script, query and varied headers */
+    size_t      klength;                /*< Length of key */
+    time_t      stored;                 /*< When the response was captured */
+    time_t      expires;                /*< When its max-age runs out */
+
+    char       *status;                 /*< Status line (as the script wrote it) */
+    char       *head;                   /*< Header lines (CRLF terminated) */
+    char       *body;                   /*< Response body */
+    size_t      length;                 /*< Length of body */
+};
+
+/* Globals */
+
+static pthread_mutex_t MemoLock = PTHREAD_MUTEX_INITIALIZER;
+
+static LRUNode  *MemoBuckets[256];
+static LRUTable MemoTable = LRU_TABLE(MemoBuckets);    /* Cached entries (costing their bytes) */
+
+static size_t MemoHits   = 0;
+static size_t MemoMisses = 0;
+static size_t MemoStored = 0;
+
+/* Internal Functions */
+
+static void memo_free(MemoEntry *entry) {
+    free(entry->key);
+    free(entry->status);
+    free(entry->head);
+    free(entry->body);
+    free(entry);
+}
+
+/**
+ * Find entry for key (must hold MemoLock).
+ **/
+static MemoEntry * memo_find(const char *key, size_t klength, size_t hash) {
+    LRUNode *node = lru_chain(&MemoTable, hash);
+    while (node && (node->hash != hash || lru_entry(node, MemoEntry)->klength != klength ||
+                    memcmp(lru_entry(node, MemoEntry)->key, key, klength) != 0)) {
+        node = node->chain;
+    }
+    return lru_entry(node, MemoEntry);
+}
+
+/**
+ * Free a list of evicted entries (without holding MemoLock).
+ **/
+static void memo_free_all(LRUNode *evicted) {
+    while (evicted) {
+        LRUNode *next = evicted->chain;
+        memo_free(lru_entry(evicted, MemoEntry));
+        evicted = next;
+    }
+}
+
+/**
+ * Build the key of a request: script, query, and the value of each header
+ * in MemoHeaders, separated by NULs.
+ **/
+static char * memo_key(Request *r, size_t *klength) {
+    char  *key = NULL;
+    FILE  *stream = open_memstream(&key, klength);
+
+    if (!stream) {
+        return NULL;
+    }
+
+    fprintf(stream, "%s%c%s", r->path, '\0', r->query);
+    for (const char *name = MemoHeaders; *name; ) {
+        size_t length = strcspn(name, ",");
+        char   header[BUFSIZ];
+
+        if (length > 0 && length < sizeof(header)) {
+            memcpy(header, name, length);
+            header[length] = '\0';
+            const char *value = request_header(r, header);
+            fprintf(stream, "%c%s", '\0', value ? value : "");
+        }
+        name += length + (name[length] == ',');
+    }
+
+    fclose(stream);
+    return key;
+}
+
+/**
+ * Parse captured script output into a new entry, if it may be reused.
+ *
+ * @return  Newly allocated entry with one reference, or NULL if the response
+ * is not a complete 200 OK with a positive Cache-Control max-age (and neither
+ * no-store, no-cache, private, nor a Set-Cookie header).
+ *
+ * Scripts write their own status line, as for cgi_relay, and it is kept as
+ * is (protocol version included), so a memoized response starts the same way
+ * as the script's own.  Header lines are kept CRLF terminated, less
+ * Content-Length and Connection, which are written afresh for each response.
+ **/
+static MemoEntry * memo_parse(Memo *memo) {
+    char  *output = memo->output;
+    char  *end    = NULL;
+    long   maxage = 0;
+    size_t hlength;
+    FILE  *stream;
+
+    if (memo->length < 7 || memo->length > MEMO_MAX_SIZE || memcmp(output, "HTTP/1.", 7) != 0) {
+        return NULL;
+    }
+
+    /* Find end of headers (the blank line) */
+
+    for (char *line = output; line < output + memo->length; ) {
+        char *newline = memchr(line, '\n', output + memo->length - line);
+        if (!newline) {
+            return NULL;
+        }
+        if (newline == line || (newline == line + 1 && *line == '\r')) {
+            end = newline + 1;
+            break;
+        }
+        line = newline + 1;
+    }
+    if (!end) {
+        return NULL;
+    }
+
+    MemoEntry *entry = calloc(1, sizeof(MemoEntry));
+    if (!entry || !(stream = open_memstream(&entry->head, &hlength))) {
+        free(entry);
+        return NULL;
+    }
+
+    for (char *line = output, *newline; line < end; line = newline + 1) {
+        newline = memchr(line, '\n', end - line);
+        int length = newline - line - (newline > line && newline[-1] == '\r');
+
+        if (line == output) {
+            char *space = memchr(line, ' ', length);
+            if (space && strncmp(space + 1, "200 ", 4) == 0) {
+                entry->status = strndup(line, length);
+            }
+            continue;
+        }
+        if (length == 0) {
+            break;
+        }
+        if (strncasecmp(line, "Cache-Control:", 14) == 0) {
+            char *value = strndup(line + 14, length - 14);
+            char *age   = value ? strcasestr(value, "max-age=") : NULL;
+
+            if (!value || strcasestr(value, "no-store") || strcasestr(value, "no-cache") || strcasestr(value, "private")) {
+                maxage = -1;
+            } else if (age && maxage >= 0) {
+                maxage = atol(age + 8);
+            }
+            free(value);
+        } else if (strncasecmp(line, "Set-Cookie:", 11) == 0) {
+            maxage = -1;
+        } else if (strncasecmp(line, "Content-Length:", 15) == 0 || strncasecmp(line, "Connection:", 11) == 0) {
+            continue;
+        }
+        fprintf(stream, "%.*s\r\n", length, line);
+    }
+    fclose(stream);
+
+    entry->length = output + memo->length - end;
+    if (!entry->status || maxage <= 0 || !(entry->body = malloc(entry->length + 1))) {
+        memo_free(entry);
+        return NULL;
+    }
+    memcpy(entry->body, end, entry->length);
+
+    entry->key     = memo->key;
+    entry->klength = memo->klength;
+    entry->stored  = time(NULL);
+    entry->expires = entry->stored + maxage;
+    entry->node.hash = hash_bytes(memo->key, memo->klength);
+    entry->node.cost = sizeof(MemoEntry) + entry->klength + hlength + entry->length + strlen(entry->status);
+    entry->node.refs = 1;
+    memo->key      = NULL;
+    return entry;
+}
+
+/* Functions */
+
+/**
+ * Respond to a CGI request with a memoized response, if there is one.
+ *
+ * @param   r           HTTP Request structure (for an executable).
+ * @param   memo        Where to prepare capturing the script's output
+ * otherwise (see memo_append), to be passed to memo_finish once the script
+ * has finished.
+ * @return  Whether the response was written (and the script must not run).
+ *
+ * Only GET requests without a body are memoized, keyed on the script, the
+ * query string, and the request headers named in MemoHeaders.  A hit writes
+ * the captured response with an Age header and a Content-Length (so the
+ * connection can stay open) until the max-age the script gave runs out.
+ **/
+bool memo_respond(Request *r, Memo *memo) {
+    MemoEntry *entry   = NULL;
+    LRUNode   *evicted = NULL;
+
+    memset(memo, 0, sizeof(*memo));
+    if (MemoBudget == 0 || !streq(r->method, "GET") ||
+        request_header(r, "Content-Length") || request_header(r, "Transfer-Encoding") ||
+        !(memo->key = memo_key(r, &memo->klength))) {
+        return false;
+    }
+
+    size_t hash = hash_bytes(memo->key, memo->klength);
+    time_t now  = time(NULL);
+
+    pthread_mutex_lock(&MemoLock);
+    entry = memo_find(memo->key, memo->klength, hash);
+    if (entry && entry->expires <= now) {
+        lru_discard(&MemoTable, &entry->node, &evicted);
+        entry = NULL;
+    }
+
+    if (entry) {
+        lru_touch(&MemoTable, &entry->node);
+        entry->node.refs++;
+        MemoHits++;
+    } else {
+        MemoMisses++;
+    }
+    pthread_mutex_unlock(&MemoLock);
+    stats_cache(STATS_CACHE_MEMO, entry != NULL);
+
+    memo_free_all(evicted);
+    if (!entry) {
+        return false;
+    }
+
+    FILE *stream = r->connection->stream;
+    fprintf(stream, "%s\r\n", entry->status);
+    fputs(entry->head, stream);
+    fprintf(stream, "Age: %ld\r\nContent-Length: %zu\r\nConnection: %s\r\n\r\n",
+        (long)(now - entry->stored), entry->length, r->keep_alive ? "keep-alive" : "close");
+    fwrite(entry->body, 1, entry->length, stream);
+
+    pthread_mutex_lock(&MemoLock);
+    bool last = --entry->node.refs == 0;
+    pthread_mutex_unlock(&MemoLock);
+
+    if (last) {
+        memo_free(entry);
+    }
+    free(memo->key);
+    memo->key = NULL;
+    return true;
+}
+
+/**
+ * Capture script output (while it is relayed).
+ *
+ * @param   memo        Memo prepared by memo_respond.
+ * @param   data        Output.
+ * @param   length      Length of output.
+ *
+ * Capturing stops (and nothing is stored) once the output exceeds
+ * MEMO_MAX_SIZE.
+ **/
+void memo_append(Memo *memo, const char *data, size_t length) {
+    if (!memo->key || memo->length + length > MEMO_MAX_SIZE) {
+        memo->length += length;
+        return;
+    }
+
+    if (memo->length + length > memo->capacity) {
+        size_t capacity = memo->capacity ? memo->capacity : BUFSIZ;
+        while (capacity < memo->length + length) {
+            capacity *= 2;
+        }
+        char *output = realloc(memo->output, capacity);
+        if (!output) {
+            free(memo->key);
+            memo->key = NULL;
+            return;
+        }
+        memo->output   = output;
+        memo->capacity = capacity;
+    }
+
+    memcpy(memo->output + memo->length, data, length);
+    memo->length += length;
+}
+
+/**
+ * Store captured script output, if it may be reused, and free the capture.
+ *
+ * @param   memo        Memo prepared by memo_respond.
+ * @param   complete    Whether the script ran to a successful exit.
+ *
+ * Responses are kept, least recently used first, within MemoBudget bytes.
+ **/
+void memo_finish(Memo *memo, bool complete) {
+    MemoEntry *entry   = NULL;
+    LRUNode   *evicted = NULL;
+
+    if (memo->key && complete && (entry = memo_parse(memo)) && entry->node.cost <= MemoBudget) {
+        pthread_mutex_lock(&MemoLock);
+        MemoEntry *other = memo_find(entry->key, entry->klength, entry->node.hash);
+        if (other) {
+            lru_discard(&MemoTable, &other->node, &evicted);
+        }
+        lru_insert(&MemoTable, &entry->node);
+        lru_evict(&MemoTable, MemoBudget, &evicted);
+        MemoStored++;
+        bool last = --entry->node.refs == 0;
+        pthread_mutex_unlock(&MemoLock);
+
+        if (last) {
+            memo_free(entry);
+        }
+    } else if (entry) {
+        memo_free(entry);
+    }
+
+    memo_free_all(evicted);
+    free(memo->key);
+    free(memo->output);
+    memset(memo, 0, sizeof(*memo));
+}
+
+/**
+ * Retrieve CGI response memo counters.
+ *
+ * @param   hits        Where to store the number of responses sent from memos.
+ * @param   misses      Where to store the number of scripts run.
+ * @param   stored      Where to store the number of responses memoized.
+ * @param   bytes       Where to store the number of bytes cached.
+ **/
+void memo_stats(size_t *hits, size_t *misses, size_t *stored, size_t *bytes) {
+    pthread_mutex_lock(&MemoLock);
+    *hits   = MemoHits;
+    *misses = MemoMisses;
+    *stored = MemoStored;
+    *bytes  = MemoTable.total;
+    pthread_mutex_unlock(&MemoLock);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
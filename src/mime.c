@@ -0,0 +1,344 @@
+/* mime.c: Mime-Type Lookup Table */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Table Types */
+
+typedef struct {
+    const char *extension;              /*< File extension (without the .) */
+    const char *mimetype;               /*< Interned mime-type string */
+} MimeEntry;
+
+typedef struct mime_table MimeTable;
+struct mime_table {
+    char       *data;                   /*< Contents of MimeTypesPath (strings point here) */
+    MimeEntry  *entries;                /*< Open-addressed slots (power of two) */
+    size_t      mask;                   /*< Number of slots minus one */
+    size_t      count;                  /*< Number of extensions */
+    size_t      retired;                /*< Generation that replaced the table */
+    MimeTable  *next;                   /*< Next retired table */
+};
+
+typedef struct mime_reader MimeReader;
+struct mime_reader {
+    size_t      generation;             /*< Generation the thread's request began in (0 = none) */
+    MimeReader *next;                   /*< Next reader in this process */
+};
+
+/* Globals */
+
+static MimeTable  *MimeTypes      = NULL;   /* Current table (swapped atomically) */
+static MimeTable  *MimeRetired    = NULL;   /* Replaced tables not yet freed */
+static size_t      MimeGeneration = 1;      /* Bumped whenever the table is replaced */
+static MimeReader *MimeReaders    = NULL;   /* Readers of this process's threads */
+
+static pthread_mutex_t MimeLoadLock = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t MimeReloadRequested = 0;
+
+static __thread MimeReader Reader;         /* This thread's reader (listed on first use) */
+static __thread bool       Reading = false; /* Whether Reader is on MimeReaders */
+
+/* Internal Functions */
+
+static void mime_signal_handler(int signum) {
+    MimeReloadRequested = 1;
+}
+
+static void mime_free(MimeTable *table) {
+    if (table) {
+        free(table->entries);
+        free(table->data);
+        free(table);
+    }
+}
+
+/**
+ * Free the retired tables no request can still be using (must hold
+ * MimeLoadLock).
+ *
+ * A table retired in generation G may only be in use by requests that began
+ * before G; once every thread is either between requests or in a request
+ * that began in G or later, it is freed.
+ **/
+static void mime_reclaim(void) {
+    size_t oldest = SIZE_MAX;
+
+    for (MimeReader *reader = __atomic_load_n(&MimeReaders, __ATOMIC_ACQUIRE); reader; reader = reader->next) {
+        size_t generation = __atomic_load_n(&reader->generation, __ATOMIC_SEQ_CST);
+        if (generation && generation < oldest) {
+            oldest = generation;
+        }
+    }
+
+    for (MimeTable **link = &MimeRetired; *link; ) {
+        MimeTable *table = *link;
+        if (table->retired <= oldest) {
+            *link = table->next;
+            mime_free(table);
+        } else {
+            link = &table->next;
+        }
+    }
+}
+
+/**
+ * Forget the requests of the parent's other threads in a forked child.
+ **/
+static void mime_fork_child(void) {
+    pthread_mutex_init(&MimeLoadLock, NULL);
+    for (MimeReader *reader = MimeReaders; reader; reader = reader->next) {
+        reader->generation = 0;
+    }
+}
+
+static void mime_watch_fork(void) {
+    pthread_atfork(NULL, NULL, mime_fork_child);
+}
+
+/**
+ * Insert extension into table unless already present.
+ *
+ * @param   table       Mime table structure.
+ * @param   extension   File extension.
+ * @param   mimetype    Mime-type for extension.
+ *
+ * The first rule for an extension wins, as when scanning the file in order.
+ **/
+static void mime_insert(MimeTable *table, const char *extension, const char *mimetype) {
+    for (size_t i = hash_string(extension) & table->mask; ; i = (i + 1) & table->mask) {
+        MimeEntry *entry = &table->entries[i];
+        if (!entry->extension) {
+            entry->extension = extension;
+            entry->mimetype  = mimetype;
+            table->count++;
+            return;
+        }
+        if (streq(entry->extension, extension)) {
+            return;
+        }
+    }
+}
+
+/**
+ * Read mime.types file and build table from it.
+ *
+ * @param   path        Path to mime.types file.
+ * @return  Newly allocated table or NULL on failure.
+ *
+ * The whole file is read into one buffer, whose lines have the form:
+ *
+ *  <MIMETYPE>      <EXT1> <EXT2> ...
+ *
+ * Every token is NUL-terminated in place, so the table's extension and
+ * mime-type strings all point into that buffer and each mime-type is stored
+ * once no matter how many extensions map to it.
+ **/
+static MimeTable * mime_build(const char *path) {
+    MimeTable  *table = calloc(1, sizeof(MimeTable));
+    struct stat st;
+    int         fd    = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (!table || fd < 0 || fstat(fd, &st) < 0) {
+        goto fail;
+    }
+
+    /* Read file */
+
+    table->data = malloc(st.st_size + 1);
+    if (!table->data) {
+        goto fail;
+    }
+
+    size_t length = 0;
+    while (length < (size_t)st.st_size) {
+        ssize_t nread = read(fd, table->data + length, st.st_size - length);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            break;
+        }
+        length += nread;
+    }
+    table->data[length] = '\0';
+    close(fd);
+    fd = -1;
+
+    /* Size table to at most half full (every token is at worst an extension) */
+
+    size_t ntokens = 0;
+    for (char *s = table->data; *(s = skip_whitespace(s)); s = skip_nonwhitespace(s)) {
+        ntokens++;
+    }
+
+    size_t nslots = 16;
+    while (nslots < 2 * ntokens) {
+        nslots *= 2;
+    }
+
+    table->entries = calloc(nslots, sizeof(MimeEntry));
+    if (!table->entries) {
+        goto fail;
+    }
+    table->mask = nslots - 1;
+
+    /* Parse rules, skipping comments */
+
+    char *lineptr;
+    for (char *line = strtok_r(table->data, "\n", &lineptr); line; line = strtok_r(NULL, "\n", &lineptr)) {
+        char *tokenptr;
+        char *mimetype = strtok_r(line, WHITESPACE, &tokenptr);
+        if (!mimetype || mimetype[0] == '#') {
+            continue;
+        }
+
+        char *extension;
+        while ((extension = strtok_r(NULL, WHITESPACE, &tokenptr))) {
+            mime_insert(table, extension, mimetype);
+        }
+    }
+
+    return table;
+
+fail:
+    debug("Unable to load %s: %s", path, strerror(errno));
+    if (fd >= 0) {
+        close(fd);
+    }
+    mime_free(table);
+    return NULL;
+}
+
+/* Functions */
+
+/**
+ * Load MimeTypesPath into the mime-type lookup table.
+ *
+ * @return  0 on success and -1 on error (in which case the current table, if
+ * any, stays in use).
+ *
+ * The new table replaces the current one with an atomic pointer swap, so
+ * concurrent lookups see either the old or the new table.  Lookups return
+ * pointers into the table, so the replaced table is only retired, and freed
+ * once every request that may have borrowed from it has finished (see
+ * mime_begin).
+ **/
+int mime_load(void) {
+    static pthread_once_t forking = PTHREAD_ONCE_INIT;
+    MimeTable *table = mime_build(MimeTypesPath);
+    if (!table) {
+        return -1;
+    }
+
+    pthread_once(&forking, mime_watch_fork);
+    pthread_mutex_lock(&MimeLoadLock);
+    MimeTable *previous = __atomic_exchange_n(&MimeTypes, table, __ATOMIC_SEQ_CST);
+    if (previous) {
+        previous->retired = __atomic_add_fetch(&MimeGeneration, 1, __ATOMIC_SEQ_CST);
+        previous->next    = MimeRetired;
+        __atomic_store_n(&MimeRetired, previous, __ATOMIC_RELEASE);
+    }
+    mime_reclaim();
+    pthread_mutex_unlock(&MimeLoadLock);
+
+    log("Loaded %zu mime-type extensions from %s", table->count, MimeTypesPath);
+    return 0;
+}
+
+/**
+ * Reload the mime-type table if a reload was requested with SIGHUP.
+ *
+ * @return  Whether or not the table was reloaded.
+ *
+ * Only the first caller to notice the request performs the reload.
+ **/
+bool mime_reload(void) {
+    if (!MimeReloadRequested || !__sync_bool_compare_and_swap(&MimeReloadRequested, 1, 0)) {
+        return false;
+    }
+
+    return mime_load() == 0;
+}
+
+/**
+ * Start a request's use of the mime-type table.
+ *
+ * Mime-types looked up from here until mime_end stay valid even if the
+ * table is reloaded meanwhile.  The thread publishes the generation its
+ * request began in; a replaced table is kept until no thread is in a request
+ * that began before the replacement (see mime_reclaim).  Each thread's reader
+ * stays listed for the life of the process (worker threads are never
+ * retired).
+ **/
+void mime_begin(void) {
+    if (!Reading) {
+        MimeReader *reader = &Reader;
+        reader->next = __atomic_load_n(&MimeReaders, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&MimeReaders, &reader->next, reader, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        Reading = true;
+    }
+
+    __atomic_store_n(&Reader.generation, __atomic_load_n(&MimeGeneration, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+/**
+ * End a request's use of the mime-type table (see mime_begin), freeing any
+ * replaced table this was the last user of.
+ **/
+void mime_end(void) {
+    __atomic_store_n(&Reader.generation, 0, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(&MimeRetired, __ATOMIC_ACQUIRE) && pthread_mutex_trylock(&MimeLoadLock) == 0) {
+        mime_reclaim();
+        pthread_mutex_unlock(&MimeLoadLock);
+    }
+}
+
+/**
+ * Request a reload of the mime-type table whenever SIGHUP arrives.
+ *
+ * The reload itself happens on the next mime_reload (which every lookup
+ * calls), outside of signal context.
+ **/
+void mime_watch(void) {
+    struct sigaction action = { .sa_handler = mime_signal_handler, .sa_flags = SA_RESTART };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGHUP, &action, NULL);
+}
+
+/**
+ * Look up mime-type of file extension.
+ *
+ * @param   extension   File extension (without the .).
+ * @return  Mime-type for extension, or NULL if unknown.
+ *
+ * The returned string is borrowed from the table and must not be freed.
+ **/
+const char * mime_lookup(const char *extension) {
+    MimeTable *table = __atomic_load_n(&MimeTypes, __ATOMIC_SEQ_CST);     /* After mime_begin */
+    if (!table) {
+        return NULL;
+    }
+
+    for (size_t i = hash_string(extension) & table->mask; ; i = (i + 1) & table->mask) {
+        MimeEntry *entry = &table->entries[i];
+        if (!entry->extension) {
+            return NULL;
+        }
+        if (streq(entry->extension, extension)) {
+            return entry->mimetype;
+        }
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
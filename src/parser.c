@@ -0,0 +1,209 @@
+/* parser.c: Incremental HTTP Request Parser */
+
+#include "spidey.h"
+
+#include <string.h>
+
+/* Internal Functions */
+
+static inline bool parser_isblank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+/* Spans are scanned inline for this many bytes before the rest is handed
+ * to the scan kernel (see Scan): most are a few bytes long (the blank after
+ * a method or a colon, the version), and an indirect call costs more than
+ * it saves on those.  Long URIs and their queries go through the kernel. */
+#define PARSER_INLINE_SCAN      16
+
+/**
+ * Count characters up to the first blank (or n).
+ **/
+static inline size_t parser_blank(const char *s, size_t n) {
+    size_t i = 0;
+    while (i < n && i < PARSER_INLINE_SCAN && !parser_isblank(s[i])) i++;
+    return i == PARSER_INLINE_SCAN && i < n ? i + Scan->blank(s + i, n - i) : i;
+}
+
+/**
+ * Count blanks (up to n).
+ **/
+static inline size_t parser_nonblank(const char *s, size_t n) {
+    size_t i = 0;
+    while (i < n && i < PARSER_INLINE_SCAN && parser_isblank(s[i])) i++;
+    return i == PARSER_INLINE_SCAN && i < n ? i + Scan->nonblank(s + i, n - i) : i;
+}
+
+/**
+ * Parse request line.
+ *
+ * @param   p           Parser structure.
+ * @param   data        Start of request.
+ * @param   start       Offset of start of line.
+ * @param   end         Offset of end of line (excluding CRLF).
+ * @return  0 on success and -1 on error.
+ *
+ *  <METHOD> <URI>[?QUERY] HTTP/<VERSION>
+ **/
+static int parser_request_line(Parser *p, const char *data, size_t start, size_t end) {
+    size_t i = start;
+
+    /* Method */
+    p->method.offset = i;
+    i += parser_blank(data + i, end - i);
+    p->method.length = i - p->method.offset;
+    i += parser_nonblank(data + i, end - i);
+
+    /* URI and Query */
+    p->uri.offset = i;
+    i += parser_blank(data + i, end - i);
+    p->uri.length = i - p->uri.offset;
+    i += parser_nonblank(data + i, end - i);
+
+    const char *query = memchr(data + p->uri.offset, '?', p->uri.length);
+    if (query) {
+        p->query.offset = query - data + 1;
+        p->query.length = p->uri.offset + p->uri.length - p->query.offset;
+        p->uri.length   = query - data - p->uri.offset;
+    }
+
+    /* Version */
+    p->version.offset = i;
+    i += parser_blank(data + i, end - i);
+    p->version.length = i - p->version.offset;
+    i += parser_nonblank(data + i, end - i);
+
+    if (!p->method.length || !p->uri.length || !p->version.length || i != end) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Parse header line.
+ *
+ * @param   p           Parser structure.
+ * @param   data        Start of request.
+ * @param   start       Offset of start of line.
+ * @param   end         Offset of end of line (excluding CRLF).
+ * @return  0 on success and -1 on error.
+ *
+ *  <NAME>: <DATA>
+ **/
+static int parser_header_line(Parser *p, const char *data, size_t start, size_t end) {
+    const char *colon = memchr(data + start, ':', end - start);
+
+    if (!colon || colon == data + start || p->nheaders == PARSER_MAX_HEADERS) {
+        return -1;
+    }
+
+    /* Name (trailing whitespace trimmed) */
+    size_t i = colon - data;
+    Slice *name = &p->names[p->nheaders];
+    name->offset = start;
+    name->length = i - start;
+    while (name->length && parser_isblank(data[start + name->length - 1])) name->length--;
+
+    /* Data (surrounding whitespace trimmed) */
+    Slice *value = &p->values[p->nheaders];
+    i++;
+    i += parser_nonblank(data + i, end - i);
+    value->offset = i;
+    value->length = end - i;
+    while (value->length && parser_isblank(data[i + value->length - 1])) value->length--;
+
+    if (!name->length) {
+        return -1;
+    }
+
+    p->nheaders++;
+    return 0;
+}
+
+/* Functions */
+
+/**
+ * Reset parser for a new request.
+ *
+ * @param   p           Parser structure.
+ **/
+void parser_init(Parser *p) {
+    p->state    = PARSER_REQUEST_LINE;
+    p->line     = 0;
+    p->cursor   = 0;
+    p->length   = 0;
+    p->nheaders = 0;
+    p->query    = (Slice){ 0, 0 };
+}
+
+/**
+ * Parse as much of a request as has arrived.
+ *
+ * @param   p           Parser structure.
+ * @param   data        Start of request.
+ * @param   length      Number of bytes of the request that have arrived.
+ * @return  PARSE_COMPLETE once the whole request head has been parsed,
+ * PARSE_INCOMPLETE if more input is needed, and PARSE_ERROR if the request
+ * is malformed.
+ *
+ * The request is scanned exactly once: when more data arrives, the parser
+ * is called again with the same (possibly moved) start of request and a
+ * larger length, and picks up where it stopped.  Method, URI, query, version,
+ * and headers are recorded as slices (offset and length from the start of
+ * the request), so nothing is copied or allocated and the slices stay valid
+ * if the request is moved.  Empty lines before the request line are skipped.
+ **/
+int parser_parse(Parser *p, const char *data, size_t length) {
+    while (p->state == PARSER_REQUEST_LINE || p->state == PARSER_HEADERS) {
+        const char *eol = memchr(data + p->cursor, '\n', length - p->cursor);
+        if (!eol) {
+            p->cursor = length;
+            return PARSE_INCOMPLETE;
+        }
+
+        size_t start = p->line;
+        size_t end   = eol - data;
+
+        p->line = p->cursor = end + 1;
+        if (end > start && data[end - 1] == '\r') {
+            end--;
+        }
+
+        if (p->state == PARSER_REQUEST_LINE) {
+            if (end == start) {
+                continue;
+            }
+            if (parser_request_line(p, data, start, end) < 0) {
+                p->state = PARSER_ERROR;
+                break;
+            }
+            p->state = PARSER_HEADERS;
+        } else if (end == start) {
+            p->state  = PARSER_DONE;
+            p->length = p->line;
+        } else if (parser_header_line(p, data, start, end) < 0) {
+            p->state = PARSER_ERROR;
+        }
+    }
+
+    return p->state == PARSER_DONE ? PARSE_COMPLETE : PARSE_ERROR;
+}
+
+/**
+ * Return NUL-terminated string for slice of request.
+ *
+ * @param   data        Start of request.
+ * @param   slice       Slice of request.
+ * @return  Pointer to slice within request.
+ *
+ * The byte following the slice (always a delimiter that is no longer
+ * needed) is overwritten with a NUL, so the slice can be used as a string
+ * in place.
+ **/
+char * parser_string(char *data, Slice slice) {
+    data[slice.offset + slice.length] = '\0';
+    return data + slice.offset;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
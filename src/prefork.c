@@ -0,0 +1,282 @@
+/* prefork.c: Pre-Forked HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Worker Slots */
+
+typedef struct {
+    int     sfd;                        /*< Server socket of slot's shard */
+    int     cpu;                        /*< CPU slot is pinned to (-1 = none) */
+    pid_t   pid;                        /*< Process id of current worker */
+    time_t  started;                    /*< Time current worker was spawned */
+    size_t  requests;                   /*< Requests handled by current worker */
+    size_t  total;                      /*< Requests handled by slot overall */
+    size_t  respawns;                   /*< Number of times slot was respawned */
+    size_t  hits;                       /*< File cache hits of current worker */
+    size_t  misses;                     /*< File cache misses of current worker */
+    size_t  content_hits;               /*< Content cache hits of current worker */
+    size_t  content_misses;             /*< Content cache misses of current worker */
+} WorkerSlot;
+
+/* Signal Flags */
+
+static volatile sig_atomic_t ReportRequested   = 0;
+static volatile sig_atomic_t ReloadRequested   = 0;
+static volatile sig_atomic_t ShutdownRequested = 0;
+
+static void prefork_signal_handler(int signum) {
+    if (signum == SIGUSR1) {
+        ReportRequested = 1;
+    } else if (signum == SIGHUP) {
+        ReloadRequested = 1;
+    } else {
+        ShutdownRequested = 1;
+    }
+}
+
+/**
+ * Accept and handle HTTP requests forever in a worker process.
+ *
+ * @param   slot        Shared worker slot used to publish request counts.
+ * @param   mask        Signal mask to restore once the worker's own signal
+ * dispositions are in place.
+ **/
+static void prefork_worker(WorkerSlot *slot, const sigset_t *mask) {
+    int sfd = slot->sfd;
+
+    signal(SIGINT,  SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGUSR1, SIG_IGN);
+    mime_watch();
+    prctl(PR_SET_PDEATHSIG, SIGTERM);   /* Do not outlive the master */
+    sigprocmask(SIG_SETMASK, mask, NULL);
+
+    if (slot->cpu >= 0) {
+        socket_pin_cpu(slot->cpu);
+    }
+
+    while (true) {
+        Connection *c = accept_connection(sfd);
+        if (!c) {
+            continue;
+        }
+
+        size_t nrequests = handle_connection(c);
+        free_connection(c);
+
+        __atomic_add_fetch(&slot->requests, nrequests, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&slot->total, nrequests, __ATOMIC_RELAXED);
+
+        size_t hits, misses, rejected, bytes;
+        cache_stats(&hits, &misses);
+        __atomic_store_n(&slot->hits, hits, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->misses, misses, __ATOMIC_RELAXED);
+        content_stats(&hits, &misses, &rejected, &bytes);
+        __atomic_store_n(&slot->content_hits, hits, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->content_misses, misses, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Fork a worker process into the specified slot.
+ *
+ * @param   slot        Shared worker slot.
+ * @return  Process id of the worker (or -1 on failure).
+ **/
+static pid_t prefork_spawn(WorkerSlot *slot) {
+    slot->requests = 0;
+    slot->hits     = 0;
+    slot->misses   = 0;
+    slot->content_hits   = 0;
+    slot->content_misses = 0;
+    slot->started  = time(NULL);
+
+    /* Hold off the master's signals until the worker has replaced the
+     * master's handlers (a SIGTERM caught by a copy of them would be lost) */
+
+    sigset_t signals, mask;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGHUP);
+    sigprocmask(SIG_BLOCK, &signals, &mask);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        prefork_worker(slot, &mask);
+        exit(EXIT_SUCCESS);
+    }
+
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    if (pid < 0) {
+        log("Unable to fork worker: %s", strerror(errno));
+        return -1;
+    }
+
+    slot->pid = pid;
+    return pid;
+}
+
+/**
+ * Log the request counts of every worker slot.
+ *
+ * @param   slots       Array of shared worker slots.
+ * @param   nslots      Number of worker slots.
+ **/
+static void prefork_report(WorkerSlot *slots, size_t nslots) {
+    size_t total = 0;
+
+    for (size_t i = 0; i < nslots; i++) {
+        size_t requests = __atomic_load_n(&slots[i].requests, __ATOMIC_RELAXED);
+        size_t overall  = __atomic_load_n(&slots[i].total, __ATOMIC_RELAXED);
+        size_t hits     = __atomic_load_n(&slots[i].hits, __ATOMIC_RELAXED);
+        size_t misses   = __atomic_load_n(&slots[i].misses, __ATOMIC_RELAXED);
+        size_t chits    = __atomic_load_n(&slots[i].content_hits, __ATOMIC_RELAXED);
+        size_t cmisses  = __atomic_load_n(&slots[i].content_misses, __ATOMIC_RELAXED);
+        log("Worker %2zu: pid %5d, %zu requests (%zu overall, %zu respawns), file cache %zu hits / %zu misses, content cache %zu hits / %zu misses",
+            i, slots[i].pid, requests, overall, slots[i].respawns, hits, misses, chits, cmisses);
+        total += overall;
+    }
+
+    log("Workers handled %zu requests in total", total);
+}
+
+/**
+ * Handle HTTP requests with a pool of long-lived worker processes.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @param   nworkers    Number of worker processes.
+ * @return  Exit status of server (EXIT_SUCCESS or EXIT_FAILURE).
+ *
+ * The master forks nworkers processes up front, each of which runs its own
+ * accept/handle loop on the shared server socket (or, when Sharded, on its own
+ * SO_REUSEPORT socket while pinned to its own CPU).  The master then only
+ * supervises: dead workers are respawned into the same slot, SIGUSR1 logs the
+ * per-worker request counts, SIGHUP reloads the mime-type table (in the master,
+ * for future workers, and in every current worker), and SIGINT/SIGTERM stop
+ * the pool (logging the counts one last time).
+ **/
+int prefork_server(int sfd, size_t nworkers) {
+    /* Allocate worker slots in memory shared with the workers */
+
+    WorkerSlot *slots = mmap(NULL, nworkers * sizeof(WorkerSlot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) {
+        log("Unable to allocate worker slots: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    memset(slots, 0, nworkers * sizeof(WorkerSlot));
+
+    /* Assign server sockets (and CPUs) to slots */
+
+    int *sfds = socket_shards(sfd, nworkers);
+    if (!sfds) {
+        log("Unable to open shard sockets: %s", strerror(errno));
+        munmap(slots, nworkers * sizeof(WorkerSlot));
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < nworkers; i++) {
+        slots[i].sfd = sfds[i];
+        slots[i].cpu = Sharded ? socket_shard_cpu(i) : -1;
+        if (Sharded) {
+            log("Shard %2zu: fd %d -> CPU %d", i, slots[i].sfd, slots[i].cpu);
+        }
+    }
+    free(sfds);
+
+    /* Install supervisor signal handlers (without SA_RESTART so wait returns) */
+
+    struct sigaction action = { .sa_handler = prefork_signal_handler };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+    sigaction(SIGHUP,  &action, NULL);
+    sigaction(SIGINT,  &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    /* Fork workers */
+
+    for (size_t i = 0; i < nworkers; i++) {
+        prefork_spawn(&slots[i]);
+    }
+    log("Started %zu workers", nworkers);
+
+    /* Supervise workers */
+
+    while (!ShutdownRequested) {
+        int   status;
+        pid_t pid = wait(&status);
+
+        if (ReportRequested) {
+            ReportRequested = 0;
+            prefork_report(slots, nworkers);
+        }
+
+        if (ReloadRequested) {
+            ReloadRequested = 0;
+            mime_load();
+            for (size_t i = 0; i < nworkers; i++) {
+                kill(slots[i].pid, SIGHUP);
+            }
+        }
+
+        if (pid < 0) {
+            if (errno == ECHILD) {
+                sleep(1);
+            }
+            continue;
+        }
+
+        for (size_t i = 0; i < nworkers; i++) {
+            if (slots[i].pid != pid) {
+                continue;
+            }
+
+            log("Worker %zu (pid %d) exited with status %d after %zu requests",
+                i, pid, WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status), slots[i].requests);
+
+            /* Back off if the worker died right after being spawned */
+            if (time(NULL) - slots[i].started < 1) {
+                sleep(1);
+            }
+
+            slots[i].respawns++;
+            prefork_spawn(&slots[i]);
+            break;
+        }
+    }
+
+    /* Stop workers */
+
+    for (size_t i = 0; i < nworkers; i++) {
+        if (slots[i].pid > 0) {
+            kill(slots[i].pid, SIGTERM);
+        }
+    }
+    while (wait(NULL) > 0);
+
+    prefork_report(slots, nworkers);
+    /* Close server sockets */
+
+    for (size_t i = 0; i < nworkers; i++) {
+        if (i == 0 || slots[i].sfd != sfd) {
+            close(slots[i].sfd);
+        }
+    }
+    munmap(slots, nworkers * sizeof(WorkerSlot));
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
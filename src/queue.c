@@ -0,0 +1,220 @@
+/* queue.c: Bounded Lock-Free MPMC Queue */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Allocate a bounded queue.
+ *
+ * @param   capacity    Minimum number of elements the queue can hold.
+ * @return  Newly allocated Queue structure (or NULL on failure).
+ *
+ * The capacity is rounded up to a power of two so that positions can be
+ * mapped to cells with a mask.  Every cell starts with its sequence number
+ * equal to its index, which marks it as free for the producer that claims
+ * that position.
+ **/
+Queue * queue_create(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    Queue *q = calloc(1, sizeof(Queue));
+    if (!q) {
+        return NULL;
+    }
+
+    q->cells = calloc(size, sizeof(QueueCell));
+    if (!q->cells) {
+        free(q);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        q->cells[i].sequence = i;
+    }
+    q->mask = size - 1;
+
+    if (sem_init(&q->items, 0, 0) < 0 || sem_init(&q->slots, 0, size) < 0) {
+        debug("Unable to initialize queue semaphores: %s", strerror(errno));
+        free(q->cells);
+        free(q);
+        return NULL;
+    }
+
+    return q;
+}
+
+/**
+ * Deallocate queue (any remaining elements are not freed).
+ *
+ * @param   q           Queue structure.
+ **/
+void queue_delete(Queue *q) {
+    if (!q) {
+        return;
+    }
+
+    sem_destroy(&q->items);
+    sem_destroy(&q->slots);
+    free(q->cells);
+    free(q);
+}
+
+/**
+ * Try to add an element to the queue without blocking.
+ *
+ * @param   q           Queue structure.
+ * @param   data        Element to add.
+ * @return  true if the element was added, false if the queue is full.
+ *
+ * A producer claims the tail position with a CAS once the cell there is
+ * free (sequence == position), stores the element, and then publishes it by
+ * advancing the cell's sequence to position + 1.
+ **/
+bool queue_try_push(Queue *q, void *data) {
+    size_t position = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+    while (true) {
+        QueueCell *cell     = &q->cells[position & q->mask];
+        size_t     sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t   diff     = (intptr_t)sequence - (intptr_t)position;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->data = data;
+                __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            position = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Try to remove an element from the queue without blocking.
+ *
+ * @param   q           Queue structure.
+ * @param   data        Where to store the removed element.
+ * @return  true if an element was removed, false if the queue is empty.
+ *
+ * A consumer claims the head position with a CAS once the cell there has
+ * been published (sequence == position + 1), takes the element, and then
+ * frees the cell for the next lap by advancing its sequence by the capacity.
+ **/
+bool queue_try_pop(Queue *q, void **data) {
+    size_t position = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+    while (true) {
+        QueueCell *cell     = &q->cells[position & q->mask];
+        size_t     sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t   diff     = (intptr_t)sequence - (intptr_t)(position + 1);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *data = cell->data;
+                __atomic_store_n(&cell->sequence, position + q->mask + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            position = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Add an element to the queue, blocking while the queue is full.
+ *
+ * @param   q           Queue structure.
+ * @param   data        Element to add.
+ *
+ * The semaphores only count free slots and published items so that threads
+ * can sleep instead of spin; the queue itself is never locked.  A producer
+ * holding a slot can still briefly lose the race for a cell to another
+ * producer, in which case it yields and retries.
+ **/
+void queue_push(Queue *q, void *data) {
+    while (sem_wait(&q->slots) < 0 && errno == EINTR);
+
+    while (!queue_try_push(q, data)) {
+        sched_yield();
+    }
+
+    sem_post(&q->items);
+}
+
+/**
+ * Remove an element from the queue, blocking while the queue is empty.
+ *
+ * @param   q           Queue structure.
+ * @return  Removed element.
+ **/
+void * queue_pop(Queue *q) {
+    void *data;
+
+    while (sem_wait(&q->items) < 0 && errno == EINTR);
+
+    while (!queue_try_pop(q, &data)) {
+        sched_yield();
+    }
+
+    sem_post(&q->slots);
+    return data;
+}
+
+/**
+ * Add an element to the queue if it has a free slot, without blocking.
+ *
+ * @param   q           Queue structure.
+ * @param   data        Element to add.
+ * @return  true if the element was added, false if the queue is full.
+ *
+ * Unlike queue_try_push, this keeps the semaphores' counts, so it can be
+ * mixed with queue_push and queue_pop.
+ **/
+bool queue_offer(Queue *q, void *data) {
+    if (sem_trywait(&q->slots) < 0) {
+        return false;
+    }
+
+    while (!queue_try_push(q, data)) {
+        sched_yield();
+    }
+
+    sem_post(&q->items);
+    return true;
+}
+
+/**
+ * Remove an element from the queue if it has one, without blocking.
+ *
+ * @param   q           Queue structure.
+ * @param   data        Where to store the removed element.
+ * @return  true if an element was removed, false if the queue is empty.
+ *
+ * Like queue_offer, this can be mixed with queue_push and queue_pop.
+ **/
+bool queue_poll(Queue *q, void **data) {
+    if (sem_trywait(&q->items) < 0) {
+        return false;
+    }
+
+    while (!queue_try_pop(q, data)) {
+        sched_yield();
+    }
+
+    sem_post(&q->slots);
+    return true;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,120 @@
+/* range.c: HTTP Range Requests */
+
+#include "spidey.h"
+
+#include <string.h>
+#include <strings.h>
+
+/* Constants */
+
+#define RANGE_POSITION_MAX  ((off_t)(((unsigned long long)1 << (sizeof(off_t) * 8 - 1)) - 1))
+
+/* Internal Functions */
+
+/**
+ * Parse a decimal byte position.
+ *
+ * @param   s           String to parse (advanced past the digits).
+ * @param   position    Where to store the position.
+ * @return  Whether there were digits (that did not overflow).
+ **/
+static bool range_position(const char **s, off_t *position) {
+    const char *start = *s;
+    off_t value = 0;
+
+    while (**s >= '0' && **s <= '9') {
+        int digit = *(*s)++ - '0';
+        if (value > (RANGE_POSITION_MAX - digit) / 10) {
+            return false;
+        }
+        value = value * 10 + digit;
+    }
+
+    *position = value;
+    return *s != start;
+}
+
+/* Functions */
+
+/**
+ * Parse the value of a Range header against a file of a given size.
+ *
+ * @param   spec        Value of Range header (e.g. "bytes=0-99,-100").
+ * @param   size        Size of the file.
+ * @param   ranges      Where to store the satisfiable ranges.
+ * @param   nranges     Number of ranges that fit in ranges.
+ * @return  Number of satisfiable ranges stored; 0 if none of the ranges is
+ * satisfiable (416); or -1 if the header is malformed or asks for more than
+ * nranges ranges, in which case it must be ignored (and the whole file sent).
+ *
+ * Ranges come in three forms:
+ *
+ *  first-last      Bytes first through last (clamped to the end of the file)
+ *  first-          Bytes first through the end of the file
+ *  -suffix         The last suffix bytes of the file
+ *
+ * Ranges starting past the end of the file (and empty suffixes) are not
+ * satisfiable and are dropped.  Ranges are kept in the order requested.
+ **/
+ssize_t range_parse(const char *spec, off_t size, Range *ranges, size_t nranges) {
+    size_t count     = 0;
+    size_t requested = 0;
+
+    if (strncasecmp(spec, "bytes=", 6) != 0) {
+        return -1;
+    }
+    spec += 6;
+
+    while (true) {
+        off_t first, last;
+
+        spec = skip_whitespace((char *)spec);
+        if (*spec == ',') {
+            spec++;
+            continue;
+        }
+        if (*spec == '\0') {
+            break;
+        }
+
+        if (*spec == '-') {
+            spec++;
+            if (!range_position(&spec, &last)) {
+                return -1;
+            }
+            first = size - (last < size ? last : size);
+            last  = last ? size - 1 : -1;
+        } else {
+            if (!range_position(&spec, &first) || *spec++ != '-') {
+                return -1;
+            }
+            if (!range_position(&spec, &last)) {
+                last = size - 1;
+            } else if (last < first) {
+                return -1;
+            }
+            if (last >= size) {
+                last = size - 1;
+            }
+        }
+
+        spec = skip_whitespace((char *)spec);
+        if (*spec != ',' && *spec != '\0') {
+            return -1;
+        }
+
+        if (++requested > nranges) {
+            return -1;
+        }
+
+        if (first < size && first <= last) {
+            ranges[count].first = first;
+            ranges[count].last  = last;
+            count++;
+        }
+    }
+
+    return requested ? (ssize_t)count : -1;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
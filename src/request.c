@@ -3,7 +3,9 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <strings.h>
 
 #include <unistd.h>
 
@@ -11,74 +13,27 @@ int parse_request_method(Request *r);
 int parse_request_headers(Request *r);
 
 /**
- * Accept request from server socket.
+ * Create request for the next request on a connection.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   c           Connection structure the request arrives on.
  * @return  Newly allocated Request structure.
  *
- * This function does the following:
- *
- *  1. Allocates a request struct initialized to 0.
- *  2. Initializes the headers list in the request struct.
- *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
- *  6. Returns the request struct.
- *
+ * The request struct, and everything allocated for the request afterwards
+ * (such as its headers list), is carved from the connection's arena.
  * The returned request struct must be deallocated using free_request.
  **/
-Request * accept_request(int sfd) {
-    
-
-    /* TODO Allocate request struct (zeroed) */
+Request * create_request(Connection *c) {
+    /* Allocate request struct (zeroed) from the connection's arena */
 
-    Request* r = calloc(1, sizeof(Request));
+    Request* r = arena_calloc(&c->arena, sizeof(Request));
 
     if(!r){
         debug("Unable to allocate request: %s", strerror(errno));
-        goto fail;
+        return NULL;
     }
 
-    /* TODO Accept a client */
-
-    struct sockaddr raddr;
-    socklen_t rlen = sizeof(struct sockaddr);
-
-    r->fd= accept(sfd, &raddr, &rlen);
-    if(r->fd < 0){
-        debug("Unable to accept: %s", strerror(errno));
-        goto fail;
-    }
-    debug("Client accepted");
-
-    /* TODO Lookup client information */
-
-    int flags = NI_NUMERICHOST | NI_NUMERICSERV; // combine flags
-
-    // store name of client in r->host
-    int status = getnameinfo(&raddr, rlen, r->host, sizeof(r->host), r->port, sizeof(r->port), flags);
-    if( status < 0){
-            debug("Unable to lookup request: %s", gai_strerror(status));
-            goto fail;
-    }
-
-    /* TODO Open socket stream */
-
-    r->stream = fdopen(r->fd, "w+"); // convert file descriptor into file stream
-    if(!r->stream){
-        debug("Unable to open socket stream: %s", strerror(errno));
-        goto fail;
-    }
-    debug("Socket stream opened");
-
-    log("Accepted request from %s:%s", r->host, r->port);
+    r->connection = c;
     return r;
-
-fail:
-    /* Deallocate request struct */
-
-    free_request(r); // closes file in this func
-    return NULL;
 }
 
 /**
@@ -86,56 +41,19 @@ fail:
  *
  * @param   r           Request structure.
  *
- * This function does the following:
- *
- *  1. Closes the request socket stream or file descriptor.
- *  2. Frees all allocated strings in request struct.
- *  3. Frees all of the headers (including any allocated fields).
- *  4. Frees request struct.
+ * This releases the request's cache entry (which its path points into).
+ * The request struct and its headers list live in the connection's arena, so
+ * the rest is a single arena reset.  The method, uri, query, and header
+ * strings point into the connection's input buffer.  The connection the
+ * request arrived on stays open (see free_connection).
  **/
 void free_request(Request *r) {
     if (!r) {
     	return;
     }
 
-    /* Close socket or fd */
-
-    if(fclose(r->stream) < 0){ // if FILE close it else close fd
-        close(r->fd);
-    }
-
-    /* Free allocated struct strings */
-
-    if(r->method)   free(r->method);
-    if(r->uri)      free(r->uri);
-    if(r->path)     free(r->path);
-    if(r->query)    free(r->query);
-
-    /* Free headers list */
-
-    if(r->headers){
-
-        Header* curr = r->headers;
-        Header* next;
-    
-        while(curr){
-
-            next = curr->next;
-            if(curr->name) free(curr->name);
-            if(curr->data) free(curr->data);
-
-            free(curr);
-
-            curr = next;
-
-        }
-
-    }
-
-    /* Free request */
-
-    free(r);
-
+    cache_release(r->file);
+    arena_reset(&r->connection->arena);
 }
 
 /**
@@ -145,15 +63,34 @@ void free_request(Request *r) {
  * @return  -1 on error and 0 on success.
  *
  * This function first parses the request method, any query, and then the
- * headers, returning 0 on success, and -1 on error.
+ * headers, returning 0 on success, and -1 on error.  The request head must
+ * already have been scanned by the connection's parser (see
+ * connection_ready); this only turns its slices into strings and consumes
+ * the request head from the connection's input.
+ *
+ * Finally it decides whether the connection can be kept alive after this
+ * request: HTTP/1.1 defaults to yes and HTTP/1.0 to no, either of which the
+ * client can override with a Connection header.  Keep-alive is never used
+ * when it is disabled (KeepAliveTimeout of 0) or when the connection has
+ * reached KeepAliveMax requests.  A request body does not prevent it: the
+ * body's framing is determined here (see request_body_init), and whatever
+ * of the body the handler leaves unread is skipped before the next request
+ * (see request_body_skip).
  **/
 int parse_request(Request *r) {
+    trace_scope("parse_request");
 
     if(!r){
         debug("No request to parse into");
         return -1;
     }
 
+    Connection *c = r->connection;
+    if(parser_parse(&c->parser, c->buffer + c->offset, c->length - c->offset) != PARSE_COMPLETE){
+        debug("Malformed or incomplete request");
+        return -1;
+    }
+
     /* Parse HTTP Request Method */
     int methodStatus = parse_request_method(r);
     if(methodStatus < 0){
@@ -169,6 +106,28 @@ int parse_request(Request *r) {
         return -1;
     }
 
+    /* Determine whether to keep connection alive */
+
+    r->keep_alive = r->version >= 1;
+
+    for(Header *header = r->headers; header; header = header->next){
+        if(strcasecmp(header->name, "Connection") == 0){
+            if(strcasecmp(header->data, "close") == 0)
+                r->keep_alive = false;
+            else if(strcasecmp(header->data, "keep-alive") == 0)
+                r->keep_alive = true;
+        }
+    }
+
+    if(KeepAliveTimeout <= 0 || r->connection->nrequests + 1 >= KeepAliveMax)
+        r->keep_alive = false;
+
+    /* Consume request head and prepare for the next request */
+
+    c->offset += c->parser.length;
+    parser_init(&c->parser);
+
+    request_body_init(r, &r->body);
     return 0;
 }
 
@@ -187,66 +146,29 @@ int parse_request(Request *r) {
  *  GET / HTTP/1.1
  *  GET /cgi.script?q=foo HTTP/1.0
  *
- * This function extracts the method, uri, and query (if it exists).
+ * This function extracts the method, uri, query (if it exists), and the minor
+ * HTTP version from the parser's slices.  The strings are terminated in
+ * place in the connection's input buffer rather than copied.
  **/
 int parse_request_method(Request *r) {
-    char buffer[BUFSIZ];
-    char *method;
-    char *uri;
-    char *query;
-
-    /* TODO Read line from socket */
-
-    if(!fgets(buffer, BUFSIZ, r->stream)){
-            debug("r->stream is %p", r->stream);
-            debug("Unable to read line from socket");
-            goto fail;
-    }
-
-    /* TODO Parse method and uri */
-
-
-    method = strtok(buffer, WHITESPACE);
-    r->method = strdup(method);
-    debug("method is: %s", r->method);
+    Connection *c    = r->connection;
+    Parser     *p    = &c->parser;
+    char       *data = c->buffer + c->offset;
 
-    uri = strtok(NULL, WHITESPACE);
-    debug("initial uri: %s", uri);
+    /* Record method, uri, query, and version in request struct */
 
-    query = strtok(uri, "?");
-    query = strtok(NULL, WHITESPACE);
-    debug("searching for query: %s", query);
+    r->method = parser_string(data, p->method);
+    r->uri    = parser_string(data, p->uri);
+    r->query  = p->query.length ? parser_string(data, p->query) : "";
 
-    if(query){
-        r->query = strdup(query);
-    } else {
-        query = " ";
-        r->query = strdup(query);
-    }
-    
-    uri = strtok(uri, "?");
-    debug("uri is: %s", uri);
-
-    if(uri)
-        r->uri = strdup(uri);
-    else
-        goto fail;
+    char *version = parser_string(data, p->version);
+    r->version = streq(version, "HTTP/1.1") ? 1 : 0;
 
-    debug("method is: %s, query is: %s", method, query);
-
-    /* Record method, uri, and query in request struct */
     debug("HTTP METHOD: %s", r->method);
     debug("HTTP URI:    %s", r->uri);
     debug("HTTP QUERY:  %s", r->query);
 
     return 0;
-
-fail:
-    debug("Failed to parse");
-    debug("HTTP METHOD: %s", r->method);
-    debug("HTTP URI:    %s", r->uri);
-    debug("HTTP QUERY:  %s", r->query);
-    return -1;
 }
 
 /**
@@ -268,71 +190,190 @@ fail:
  *  Accept-Encoding: gzip, deflate
  *  Connection: keep-alive
  *
- * This function parses the stream from the request socket using the following
- * pseudo-code:
- *
- *  while (buffer = read_from_socket() and buffer is not empty):
- *      name, data  = buffer.split(':')
- *      header      = new Header(name, data)
- *      headers.append(header)
+ * This function links the parser's header slices into the request's headers
+ * list.  All nodes are carved out of the connection's arena, and their name
+ * and data point into the connection's input buffer.
  **/
 int parse_request_headers(Request *r) {
-    Header *curr = NULL;
-    char buffer[BUFSIZ];
-    char *name;
-    char *data;
+    Connection *c    = r->connection;
+    Parser     *p    = &c->parser;
+    char       *data = c->buffer + c->offset;
 
-    Header* tail = NULL;
+    if(p->nheaders == 0){
+        return 0;
+    }
 
-    /* Parse headers from socket */
+    /* Allocate headers memory */
 
-    while(fgets(buffer, BUFSIZ, r->stream) && strlen(buffer) > 2){
+    Header *headers = arena_alloc(&c->arena, p->nheaders * sizeof(Header));
+    if(!headers){
+        return -1;
+    }
 
-        // Allocate headers memory
-        curr = calloc(1, sizeof(Header));
-        if(!curr){
-           return -1; 
-        }
+    for(size_t i = 0; i < p->nheaders; i++){
+        headers[i].name = parser_string(data, p->names[i]);
+        headers[i].data = parser_string(data, p->values[i]);
+        headers[i].next = i + 1 < p->nheaders ? &headers[i + 1] : NULL;
+    }
 
-        chomp(buffer);
+    r->headers = headers;
 
-        name = strtok(buffer, ":");
-        if(!name){
-            goto fail;
-        }
+#ifndef NDEBUG
+    for (Header *header = r->headers; header; header = header->next) {
+    	debug("HTTP HEADER %s = %s", header->name, header->data);
+    }
+#endif
+    return 0;
+}
 
-        data = strtok(NULL, WHITESPACE);
-        if(!data){
-            goto fail;
-        }
+/**
+ * Look up a request header.
+ *
+ * @param   r           Request structure.
+ * @param   name        Name of header (compared case-insensitively).
+ * @return  Data of the first header with that name, or NULL if absent.
+ **/
+const char * request_header(Request *r, const char *name) {
+    for(Header *header = r->headers; header; header = header->next){
+        if(strcasecmp(header->name, name) == 0)
+            return header->data;
+    }
+
+    return NULL;
+}
+
+/**
+ * Determine how the request body (if any) is framed.
+ *
+ * @param   r           Request structure.
+ * @param   body        Body framing state to initialize.
+ **/
+void request_body_init(Request *r, RequestBody *body) {
+    const char *value;
+
+    body->state     = BODY_NONE;
+    body->remaining = 0;
+
+    if((value = request_header(r, "Transfer-Encoding")) && strcasestr(value, "chunked")){
+        body->state = BODY_CHUNK_SIZE;
+    }else if((value = request_header(r, "Content-Length")) && (body->remaining = atoll(value)) > 0){
+        body->state = BODY_LENGTH;
+    }
+}
+
+/**
+ * Take the next piece of the request body from the connection's input.
+ *
+ * @param   r           Request structure.
+ * @param   body        Body framing state.
+ * @param   length      Where to store the length of the piece.
+ * @return  Start of the piece in the connection's input buffer (to be
+ * consumed with request_body_consume once used), or NULL once the body is
+ * over (or cut short, which leaves body->state BODY_CUT).
+ *
+ * Content-Length bodies are passed on as is; chunked bodies are decoded
+ * (their chunk-size lines and trailers are skipped).  Input is read from the
+ * socket (blocking, up to the idle timeout) whenever nothing is buffered.
+ *
+ * Reading refills the connection's input buffer, so the request's method,
+ * uri, query and headers (which point into it) must not be used afterwards.
+ **/
+const char * request_body_next(Request *r, RequestBody *body, size_t *length) {
+    Connection *c = r->connection;
 
-        data = skip_whitespace(data);
-        curr->name = strdup(name);
-        curr->data = strdup(data);
+    while(body->state != BODY_NONE && body->state != BODY_CUT){
+        if(c->offset == c->length && connection_fill(c, true) <= 0)
+            break;
 
-        debug("current name: %s", curr->name);
-        debug("current data: %s", curr->data);
+        char  *data      = c->buffer + c->offset;
+        size_t available = c->length - c->offset;
 
-        if(!(r->headers)){ // first header
-            r->headers = curr;
-            tail = curr;
-        } else { // has headers before it
-            tail->next = curr;
-            tail = curr;
+        if(body->state == BODY_LENGTH || body->state == BODY_CHUNK_DATA){
+            *length = available < (size_t)body->remaining ? available : (size_t)body->remaining;
+            return data;
         }
 
-    }  
+        /* Everything else is a line: wait until all of it is buffered */
 
-#ifndef NDEBUG
-    for (Header *header = r->headers; header; header = header->next) {
-    	debug("HTTP HEADER %s = %s", header->name, header->data);
+        char *newline = memchr(data, '\n', available);
+        if(!newline){
+            if(connection_fill(c, true) <= 0)
+                break;
+            continue;
+        }
+        c->offset += newline - data + 1;
+
+        switch(body->state){
+            case BODY_CHUNK_SIZE:
+                body->remaining = strtoll(data, NULL, 16);
+                body->state     = body->remaining > 0 ? BODY_CHUNK_DATA : BODY_TRAILERS;
+                if(body->remaining < 0)
+                    body->state = BODY_CUT;
+                break;
+            case BODY_CHUNK_END:
+                body->state = BODY_CHUNK_SIZE;
+                break;
+            default:
+                if(newline == data || (newline == data + 1 && data[0] == '\r'))
+                    body->state = BODY_NONE;
+                break;
+        }
     }
-#endif
-    return 0;
 
-fail:
-    free(curr);
-    return -1;
+    if(body->state != BODY_NONE)
+        body->state = BODY_CUT;
+    return NULL;
+}
+
+/**
+ * Consume bytes of the request body that were used.
+ *
+ * @param   r           Request structure.
+ * @param   body        Body framing state.
+ * @param   length      Number of bytes used (from request_body_next).
+ **/
+void request_body_consume(Request *r, RequestBody *body, size_t length) {
+    r->connection->offset += length;
+    body->remaining -= length;
+
+    if(body->remaining == 0)
+        body->state = body->state == BODY_CHUNK_DATA ? BODY_CHUNK_END : BODY_NONE;
+}
+
+/**
+ * Skip whatever of the request body the handler left unread.
+ *
+ * @param   r           Request structure (with its response written).
+ * @return  Whether the whole body was read, so the next request on the
+ * connection starts right after it.
+ *
+ * This runs after every request, so a handler that ignores the body (say, a
+ * static file answering a POST) does not cost the client its connection.
+ **/
+bool request_body_skip(Request *r) {
+    const char *data;
+    size_t      length;
+
+    while((data = request_body_next(r, &r->body, &length)))
+        request_body_consume(r, &r->body, length);
+
+    return r->body.state == BODY_NONE;
+}
+
+/**
+ * Mark the end of the headers of the response to a request.
+ *
+ * @param   r           Request structure.
+ *
+ * A HEAD request is answered with the headers a GET would get and nothing
+ * else.  Handlers write the whole response either way, so for HEAD the
+ * connection drops everything after the headers (see connection_discard)
+ * until the request completes (see handle_requests).  The Content-Length is
+ * that of the body not sent, so the connection can stay open.
+ **/
+void request_headers_end(Request *r) {
+    if(r->method && streq(r->method, "HEAD"))
+        connection_discard(r->connection, true);
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,134 @@
+/* scan.c: Vectorized Character Class Scanning */
+
+#include "spidey.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+/* Scalar Kernel */
+
+static inline bool scan_isblank(unsigned char c) {
+    return c == ' ' || c == '\t';
+}
+
+static inline size_t scalar_blank(const char *s, size_t n) {
+    size_t i = 0;
+    while (i < n && !scan_isblank(s[i])) i++;
+    return i;
+}
+
+static inline size_t scalar_nonblank(const char *s, size_t n) {
+    size_t i = 0;
+    while (i < n && scan_isblank(s[i])) i++;
+    return i;
+}
+
+#ifdef SCAN_X86
+
+/* SSE2 Kernel (16 bytes at a time) */
+
+__attribute__((target("sse2"), always_inline))
+static inline unsigned sse2_blank_mask(const char *s) {
+    __m128i v = _mm_loadu_si128((const __m128i *)s);
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    return _mm_movemask_epi8(m);
+}
+
+#define SCAN_SSE2(name, mask, invert, scalar)                           \
+    __attribute__((target("sse2")))                                     \
+    static size_t name(const char *s, size_t n) {                       \
+        size_t i = 0;                                                   \
+        for (; i + 16 <= n; i += 16) {                                  \
+            unsigned m = mask(s + i) ^ (invert ? 0xFFFF : 0);           \
+            if (m) return i + __builtin_ctz(m);                         \
+        }                                                               \
+        return i + scalar(s + i, n - i);                                \
+    }
+
+SCAN_SSE2(sse2_blank,    sse2_blank_mask, false, scalar_blank)
+SCAN_SSE2(sse2_nonblank, sse2_blank_mask, true,  scalar_nonblank)
+
+/* AVX2 Kernel (32 bytes at a time) */
+
+__attribute__((target("avx2"), always_inline))
+static inline unsigned avx2_blank_mask(const char *s) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)s);
+    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+    return _mm256_movemask_epi8(m);
+}
+
+/* The 16 byte step and scalar tail are inlined so they are VEX encoded too;
+ * calling the SSE2 kernel with dirty upper halves would stall on the
+ * AVX-SSE transition. */
+#define SCAN_AVX2(name, mask, mask16, invert, scalar)                   \
+    __attribute__((target("avx2")))                                     \
+    static size_t name(const char *s, size_t n) {                       \
+        size_t i = 0;                                                   \
+        for (; i + 32 <= n; i += 32) {                                  \
+            unsigned m = mask(s + i) ^ (invert ? 0xFFFFFFFFu : 0);      \
+            if (m) return i + __builtin_ctz(m);                         \
+        }                                                               \
+        if (i + 16 <= n) {                                              \
+            unsigned m = mask16(s + i) ^ (invert ? 0xFFFF : 0);         \
+            if (m) return i + __builtin_ctz(m);                         \
+            i += 16;                                                    \
+        }                                                               \
+        return i + scalar(s + i, n - i);                                \
+    }
+
+SCAN_AVX2(avx2_blank,    avx2_blank_mask, sse2_blank_mask, false, scalar_blank)
+SCAN_AVX2(avx2_nonblank, avx2_blank_mask, sse2_blank_mask, true,  scalar_nonblank)
+
+#endif
+
+/* Globals */
+
+const ScanKernel ScanKernels[] = {
+    { "scalar", scalar_blank, scalar_nonblank },
+#ifdef SCAN_X86
+    { "sse2",   sse2_blank,   sse2_nonblank },
+    { "avx2",   avx2_blank,   avx2_nonblank },
+#endif
+    { NULL },
+};
+
+const ScanKernel *Scan = &ScanKernels[0];
+
+/* Functions */
+
+/**
+ * Determine whether the CPU supports a scan kernel.
+ *
+ * @param   kernel      Scan kernel.
+ * @return  Whether or not the kernel can run on this CPU.
+ **/
+bool scan_supported(const ScanKernel *kernel) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (streq(kernel->name, "sse2")) return __builtin_cpu_supports("sse2");
+    if (streq(kernel->name, "avx2")) return __builtin_cpu_supports("avx2");
+#endif
+    return streq(kernel->name, "scalar");
+}
+
+/**
+ * Select the widest scan kernel the CPU supports.
+ *
+ * Runs before main, so Scan is always set by the time a request is parsed.
+ **/
+__attribute__((constructor))
+static void scan_init(void) {
+    for (const ScanKernel *k = ScanKernels; k->name; k++) {
+        if (scan_supported(k)) {
+            Scan = k;
+        }
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
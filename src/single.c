@@ -8,27 +8,27 @@
 #include <unistd.h>
 
 /**
- * Handle one HTTP request at a time.
+ * Handle one HTTP connection at a time.
  *
  * @param   sfd         Server socket file descriptor.
  * @return  Exit status of server (EXIT_SUCCESS).
  **/
 int single_server(int sfd) {
-    /* Accept and handle HTTP request */
+    /* Accept and handle HTTP connections */
     while (true) {
-    	/* Accept request */
+    	/* Accept connection */
 
-        Request *r = accept_request(sfd);
-        if(!r){
-            log("Unable to accept request: %s\n", strerror(errno));
+        Connection *c = accept_connection(sfd);
+        if(!c){
+            log("Unable to accept connection: %s\n", strerror(errno));
             continue;
         }
 
-	/* Handle request */
-        handle_request(r);
+	/* Handle requests */
+        handle_connection(c);
 
-	/* Free request */
-        free_request(r);
+	/* Free connection */
+        free_connection(c);
 
     }
 
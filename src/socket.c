@@ -9,6 +9,7 @@
 
 #include <netdb.h>
 #include <netinet/in.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -16,9 +17,11 @@
  * Allocate socket, bind it, and listen to specified port.
  *
  * @param   port        Port number to bind to and listen on.
+ * @param   reuseport   Whether to set SO_REUSEPORT so that several sockets
+ *                      can listen on the same port (one accept queue each).
  * @return  Allocated server socket file descriptor.
  **/
-int socket_listen(const char *port) {
+int socket_listen(const char *port, bool reuseport) {
 
     /* Lookup server address information */
     struct addrinfo hints = {
@@ -43,11 +46,22 @@ int socket_listen(const char *port) {
 
 	/* Allocate socket */
 
-        if((server_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0){
+        // close-on-exec, so no CGI script or FastCGI worker holds the port
+        if((server_fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol)) < 0){
             fprintf(stderr, "Unable to make socket: %s\n", strerror(errno));
             continue;
         }
 
+        // rebind right away even if closed connections linger in TIME_WAIT
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+
+        if(reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0){
+            fprintf(stderr, "Unable to set SO_REUSEPORT: %s\n", strerror(errno));
+            close(server_fd);
+            server_fd = -1;
+            continue;
+        }
+
 	/* Bind socket */
 
         if(bind(server_fd, p->ai_addr, p->ai_addrlen) < 0){
@@ -76,4 +90,95 @@ int socket_listen(const char *port) {
     return server_fd;
 }
 
+/**
+ * Allocate one server socket per worker shard.
+ *
+ * @param   sfd         Server socket file descriptor (used for shard 0).
+ * @param   nshards     Number of worker shards.
+ * @return  Allocated array of nshards server socket file descriptors (or NULL
+ * on failure).
+ *
+ * When Sharded is set, every shard after the first gets its own SO_REUSEPORT
+ * socket (sfd must then also have been opened with reuseport), so the kernel
+ * balances new connections across per-shard accept queues.  Otherwise every
+ * shard simply shares sfd.
+ *
+ * The returned array must be free'd.
+ **/
+int * socket_shards(int sfd, size_t nshards) {
+    int *sfds = calloc(nshards, sizeof(int));
+    if (!sfds) {
+        return NULL;
+    }
+
+    sfds[0] = sfd;
+    for (size_t i = 1; i < nshards; i++) {
+        sfds[i] = Sharded ? socket_listen(Port, true) : sfd;
+        if (sfds[i] < 0) {
+            for (size_t j = 1; j < i; j++) {
+                close(sfds[j]);
+            }
+            free(sfds);
+            return NULL;
+        }
+    }
+
+    return sfds;
+}
+
+/**
+ * Determine which CPU a worker shard should be pinned to.
+ *
+ * @param   shard       Index of worker shard.
+ * @return  CPU number (or -1 if the allowed CPUs cannot be determined).
+ *
+ * Shards are assigned round-robin over the CPUs the server is allowed to run
+ * on, so the mapping is the same whether it is computed by the master (for
+ * logging) or by the worker itself (for pinning).
+ **/
+int socket_shard_cpu(size_t shard) {
+    cpu_set_t allowed;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        return -1;
+    }
+
+    size_t ncpus = CPU_COUNT(&allowed);
+    if (ncpus == 0) {
+        return -1;
+    }
+
+    shard %= ncpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && shard-- == 0) {
+            return cpu;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Pin the calling process or thread to the CPU of a worker shard.
+ *
+ * @param   cpu         CPU number from socket_shard_cpu.
+ * @return  0 on success and -1 on error.
+ **/
+int socket_pin_cpu(int cpu) {
+    cpu_set_t set;
+
+    if (cpu < 0) {
+        return -1;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        debug("Unable to pin to CPU %d: %s", cpu, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -2,17 +2,22 @@
 
 #include "spidey.h"
 
+#include <ctype.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <string.h>
 
 #include <unistd.h>
 
-/* Global Variables */
-char *Port	      = "9424";
-char *MimeTypesPath   = "/etc/mime.types";
-char *DefaultMimeType = "text/plain";
-char *RootPath	      = "www";
+/* Concurrency Mode Names */
+static const char *ModeNames[] = {
+    "Single",
+    "Forking",
+    "Event",
+    "Prefork",
+    "Threaded",
+};
 
 /**
  * Display usage message and exit with specified status code.
@@ -21,14 +26,33 @@ char *RootPath	      = "www";
  * @param   status      Exit status.
  */
 void usage(const char *progname, int status) {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [hcmMprskKSebxzfCHntulA]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -h            Display help message\n");
-    fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -c mode [N]   Single, Forking, Event, Prefork or Threaded (N workers) mode\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
     fprintf(stderr, "    -p port       Port to listen on\n");
     fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -s            Shard workers over SO_REUSEPORT sockets pinned to CPUs\n");
+    fprintf(stderr, "    -k seconds    Keep-alive idle timeout (0 disables keep-alive)\n");
+    fprintf(stderr, "    -K requests   Maximum requests per connection\n");
+    fprintf(stderr, "    -S            Copy files through a buffer instead of sendfile\n");
+    fprintf(stderr, "    -e entries    Size of file metadata cache (0 disables)\n");
+    fprintf(stderr, "    -b bytes      Size of hot file contents cache (0 disables)\n");
+    fprintf(stderr, "    -x bytes      Map files this large instead of copying them with -S (0 disables)\n");
+    fprintf(stderr, "    -z            Do not compress responses (gzip or deflate)\n");
+    fprintf(stderr, "    -f workers    FastCGI workers per .fcgi script (0 runs them as CGI)\n");
+    fprintf(stderr, "    -C bytes      Size of cache of CGI responses with a max-age (0, the default, disables)\n");
+    fprintf(stderr, "    -H headers    Request headers cached CGI responses vary on (comma-separated)\n");
+    fprintf(stderr, "    -n scripts    Maximum CGI scripts running at once (0 disables)\n");
+    fprintf(stderr, "    -t seconds    Kill CGI scripts running longer than this (0 disables)\n");
+    fprintf(stderr, "    -u seconds    CPU time CGI scripts may use (0 disables)\n");
+    fprintf(stderr, "    -l path       Access log (- is standard error, empty disables)\n");
+    fprintf(stderr, "    -A uri        URI of the statistics page (empty disables)\n");
+#ifdef TRACE
+    fprintf(stderr, "    -T path       Trace events file (Chrome trace JSON)\n");
+#endif
     exit(status);
 }
 
@@ -49,14 +73,25 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
         char *arg = argv[argind++];
     	switch (arg[1]) {
 	    case 'c':
-	    	if (streq(argv[argind], "single")) {
+	    	if (argind >= argc) {
+	    	    return false;
+	    	} else if (streq(argv[argind], "single")) {
 	    	    *mode = SINGLE;
                 } else if (streq(argv[argind], "forking")) {
 	    	    *mode = FORKING;
+                } else if (streq(argv[argind], "event")) {
+	    	    *mode = EVENT;
+                } else if (streq(argv[argind], "prefork")) {
+	    	    *mode = PREFORK;
+                } else if (streq(argv[argind], "threaded")) {
+	    	    *mode = THREADED;
 	    	} else {
 	    	    return false;
 	    	}
 	    	argind++;
+	    	if ((*mode == EVENT || *mode == PREFORK || *mode == THREADED) && argind < argc && isdigit(argv[argind][0])) {
+	    	    Workers = strtoul(argv[argind++], NULL, 10);
+	    	}
 	    	break;
 	    case 'h':
 	    	usage(argv[0], EXIT_SUCCESS);
@@ -73,6 +108,59 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
 	    case 'r':
 	    	RootPath = argv[argind++];
 	    	break;
+	    case 's':
+	    	Sharded = true;
+	    	break;
+	    case 'k':
+	    	KeepAliveTimeout = atoi(argv[argind++]);
+	    	break;
+	    case 'K':
+	    	KeepAliveMax = strtoul(argv[argind++], NULL, 10);
+	    	break;
+	    case 'S':
+	    	SendFile = false;
+	    	break;
+	    case 'e':
+	    	CacheEntries = strtoul(argv[argind++], NULL, 10);
+	    	break;
+	    case 'b':
+	    	ContentBudget = strtoul(argv[argind++], NULL, 10);
+	    	break;
+	    case 'x':
+	    	MmapThreshold = strtoul(argv[argind++], NULL, 10);
+	    	break;
+	    case 'z':
+	    	Compress = false;
+	    	break;
+	    case 'f':
+	    	FastCGIWorkers = strtoul(argv[argind++], NULL, 10);
+	    	break;
+	    case 'C':
+	    	MemoBudget = strtoul(argv[argind++], NULL, 10);
+	    	break;
+	    case 'H':
+	    	MemoHeaders = argv[argind++];
+	    	break;
+	    case 'n':
+	    	CGIProcesses = strtoul(argv[argind++], NULL, 10);
+	    	break;
+	    case 't':
+	    	CGITimeout = atoi(argv[argind++]);
+	    	break;
+	    case 'u':
+	    	CGICPULimit = atoi(argv[argind++]);
+	    	break;
+	    case 'l':
+	    	AccessLog = argv[argind++];
+	    	break;
+	    case 'A':
+	    	StatsURI = argv[argind++];
+	    	break;
+#ifdef TRACE
+	    case 'T':
+	    	TracePath = argv[argind++];
+	    	break;
+#endif
 	    default:
 	        return false;
 	    	break;
@@ -82,11 +170,21 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
     return true;
 }
 
+/**
+ * Stop the FastCGI workers (see fastcgi_stop), then die of the signal as the
+ * server would have without the handler.
+ **/
+static void shutdown_signal_handler(int signum) {
+    fastcgi_stop();
+    signal(signum, SIG_DFL);
+    raise(signum);
+}
+
 /**
  * Parses command line options and starts appropriate server
  **/
 int main(int argc, char *argv[]) {
-    ServerMode mode;
+    ServerMode mode = SINGLE;
 
     /* Parse command line options */
 
@@ -96,30 +194,125 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
+    /* Report failed writes to disconnected clients as errors, not signals */
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Only prefork and threaded workers accept for themselves (see socket_shards) */
+
+    if (Sharded && mode != PREFORK && mode != THREADED) {
+        fprintf(stderr, "%s: -s needs prefork or threaded mode (not %s)\n", argv[0], ModeNames[mode]);
+        return EXIT_FAILURE;
+    }
+
     /* Listen to server socket */
-    int server_fd = socket_listen(Port);
+
+    int server_fd = socket_listen(Port, Sharded);
     if(server_fd < 0){
         debug("Listen to socket failure");
         return EXIT_FAILURE;
     }
 
+    /* Load mime-types once (reloaded on SIGHUP) */
+
+    mime_load();
+    mime_watch();
+
+    /* Limit concurrent CGI scripts over all (future) worker processes */
+
+    if (!cgi_init()) {
+        log("Unable to limit CGI scripts: %s", strerror(errno));
+    }
+
+    /* Gather FastCGI workers of all (future) worker processes, to stop them
+     * with the server (the prefork master stops them once its workers exit) */
+
+    if (!fastcgi_init()) {
+        log("Unable to group FastCGI workers: %s", strerror(errno));
+    }
+    signal(SIGINT,  shutdown_signal_handler);
+    signal(SIGTERM, shutdown_signal_handler);
+
+    /* Count requests over all (future) worker processes */
+
+    if (!stats_init()) {
+        log("Unable to share server statistics: %s", strerror(errno));
+    }
+
+#ifdef TRACE
+    /* Start the trace (appended to by all future workers) */
+
+    if (!trace_open(TracePath)) {
+        log("Unable to open trace %s: %s", TracePath, strerror(errno));
+    }
+
+#endif
+    /* Open the access log (shared by all future workers) */
+
+    if (!journal_open(AccessLog)) {
+        log("Unable to open access log %s: %s", AccessLog, strerror(errno));
+    }
+
+    /* Report cache and subsystem counters on SIGUSR1 */
+
+    stats_watch();
+
     /* Determine real RootPath */
 
     RootPath = realpath(RootPath, NULL); // TODO 
 
+    /* Default to one worker per CPU */
+
+    if (Workers == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        Workers = ncpus > 0 ? ncpus : 1;
+    }
+
     log("Listening on port %s", Port);
     debug("RootPath        = %s", RootPath);
     debug("MimeTypesPath   = %s", MimeTypesPath);
     debug("DefaultMimeType = %s", DefaultMimeType);
-    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : "Forking");
+    debug("ConcurrencyMode = %s", ModeNames[mode]);
+    debug("Workers         = %zu", Workers);
+    debug("Sharded         = %s", Sharded ? "Yes" : "No");
+    debug("KeepAlive       = %ds, %zu requests", KeepAliveTimeout, KeepAliveMax);
+    debug("SendFile        = %s", SendFile ? "Yes" : "No");
+    debug("CacheEntries    = %zu", CacheEntries);
+    debug("ContentBudget   = %zu", ContentBudget);
+    debug("MmapThreshold   = %zu", MmapThreshold);
+    debug("Compress        = %s", Compress ? "Yes" : "No");
+    debug("FastCGIWorkers  = %zu", FastCGIWorkers);
+    debug("MemoBudget      = %zu", MemoBudget);
+    debug("MemoHeaders     = %s", MemoHeaders);
+    debug("CGIProcesses    = %zu", CGIProcesses);
+    debug("CGITimeout      = %ds, %ds of CPU", CGITimeout, CGICPULimit);
+    debug("AccessLog       = %s", AccessLog);
+    debug("StatsURI        = %s", StatsURI);
+#ifdef TRACE
+    debug("TracePath       = %s", TracePath);
+#endif
 
-    /* Start either forking or single HTTP server */
+    /* Start appropriate HTTP server */
 
-    if(mode == FORKING)
-        forking_server(server_fd);
-    else
-        single_server(server_fd);
+    switch (mode) {
+        case FORKING:
+            forking_server(server_fd);
+            break;
+        case EVENT:
+            event_server(server_fd, Workers);
+            break;
+        case PREFORK:
+            prefork_server(server_fd, Workers);
+            break;
+        case THREADED:
+            threaded_server(server_fd, Workers);
+            break;
+        default:
+            single_server(server_fd);
+            break;
+    }
 
+    fastcgi_stop();
     free(RootPath);
 
     return 0; // return status;
@@ -0,0 +1,394 @@
+/* stats.c: Server Statistics */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+/* Constants */
+
+#define STATS_SUB_BITS  4                       /* Histogram buckets per power of two: 2^4 */
+#define STATS_SUB       (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS   ((32 - STATS_SUB_BITS + 1) * STATS_SUB)    /* Covers all uint32_t */
+#define STATS_SECONDS   16                      /* Per-second request counts kept */
+#define STATS_WINDOW    10                      /* Seconds the request rate is taken over */
+
+/* Handler Types (latency is kept per type) */
+
+typedef enum {
+    STATS_BROWSE,
+    STATS_FILE,
+    STATS_CGI,
+    STATS_ERROR,
+    STATS_HANDLERS,
+} StatsHandler;
+
+static const char *StatsHandlerNames[] = { "browse", "file", "cgi", "error" };
+static const char *StatsCacheNames[]   = { "file", "content", "listing", "compression", "cgi" };
+static const char *StatsSpawnNames[]   = { "cgi", "fastcgi" };
+
+/* Structures (in memory shared by all server processes) */
+
+typedef struct {
+    uint64_t count;                     /*< Requests recorded */
+    uint64_t sum;                       /*< Microseconds over all requests */
+    uint64_t max;                       /*< Slowest request (microseconds) */
+    uint64_t buckets[STATS_BUCKETS];    /*< Requests per latency bucket */
+} StatsHistogram;
+
+typedef struct {
+    uint64_t second;                    /*< Second (since started) being counted */
+    uint64_t count;                     /*< Requests completed in that second */
+} StatsSecond;
+
+typedef struct {
+    uint64_t started;                   /*< When the server started (monotonic ns) */
+    uint64_t requests;                  /*< Requests handled */
+    uint64_t bytes;                     /*< Bytes of responses sent */
+    int64_t  active;                    /*< Connections open */
+    uint64_t statuses[HTTP_STATUS_SERVICE_UNAVAILABLE + 1];
+    uint64_t caches[STATS_CACHES][2];   /*< Misses and hits per cache */
+    uint64_t spawns[STATS_SPAWNS];      /*< Processes started per kind */
+    StatsSecond    seconds[STATS_SECONDS];
+    StatsHistogram handlers[STATS_HANDLERS];
+} StatsBlock;
+
+/* Globals */
+
+static StatsBlock  StatsLocal;                  /* Used if shared memory is unavailable */
+static StatsBlock *Stats = &StatsLocal;
+
+static volatile sig_atomic_t StatsReportRequested = 0;
+
+/* Internal Functions */
+
+static void stats_signal_handler(int signum) {
+    StatsReportRequested = 1;
+}
+
+/**
+ * Log the counters of every cache and subsystem (the file metadata and hot
+ * content caches, the shared mappings, compressed files, directory listings,
+ * CGI scripts and responses, FastCGI workers, and the access journal) if
+ * requested with SIGUSR1.
+ **/
+static void stats_report(void) {
+    if (!StatsReportRequested || !__sync_bool_compare_and_swap(&StatsReportRequested, 1, 0)) {
+        return;
+    }
+
+    cache_report();
+
+    size_t hits, misses, rejected, bytes;
+    content_stats(&hits, &misses, &rejected, &bytes);
+    log("Content cache: %zu hits, %zu misses (%.1f%% hit rate, %zu not admitted), %zu of %zu bytes",
+        hits, misses, hits + misses ? 100.0 * hits / (hits + misses) : 0.0, rejected, bytes, ContentBudget);
+
+    mapping_stats(&hits, &misses, &bytes);
+    log("Mappings: %zu shared, %zu not shared, %zu of %d bytes mapped", hits, misses, bytes, MAPPING_BUDGET);
+
+    double ratio;
+    encoding_stats(&hits, &misses, &ratio, &bytes);
+    log("Compression: %zu hits, %zu files compressed (%.1fx smaller), %zu of %d bytes", hits, misses, ratio, bytes, ENCODING_BUDGET);
+
+    size_t streamed;
+    listing_stats(&hits, &misses, &streamed, &bytes);
+    log("Listings: %zu hits, %zu rendered, %zu streamed, %zu of %d bytes", hits, misses, streamed, bytes, LISTING_BUDGET);
+
+    size_t running, queued, peak, shed, killed;
+    cgi_stats(&running, &queued, &peak, &shed, &killed);
+    log("CGI scripts: %zu of %zu running, %zu queued (at most %zu), %zu shed, %zu killed", running, CGIProcesses, queued, peak, shed, killed);
+
+    size_t stored;
+    memo_stats(&hits, &misses, &stored, &bytes);
+    log("CGI responses: %zu hits, %zu scripts run, %zu stored, %zu of %zu bytes", hits, misses, stored, bytes, MemoBudget);
+
+    size_t requests, started, waited, failed;
+    fastcgi_stats(&requests, &started, &waited, &failed);
+    log("FastCGI: %zu requests (%zu waited for a worker, %zu failed), %zu workers started", requests, waited, failed, started);
+
+    size_t written, dropped;
+    journal_stats(&written, &dropped);
+    log("Access journal: %zu written, %zu dropped", written, dropped);
+}
+
+static inline uint64_t stats_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Find the histogram bucket of a latency.
+ *
+ * Values below STATS_SUB get a bucket each; above that, every power of two
+ * is split into STATS_SUB buckets, so a bucket is never more than 1/16th
+ * (6.25%) wider than the values in it (like an HDR histogram with one
+ * significant digit and a bit).
+ **/
+static inline size_t stats_bucket(uint32_t value) {
+    if (value < STATS_SUB) {
+        return value;
+    }
+
+    int exponent = 31 - __builtin_clz(value);
+    return (exponent - STATS_SUB_BITS + 1) * STATS_SUB + ((value >> (exponent - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+/**
+ * Largest latency that falls into a bucket.
+ **/
+static uint64_t stats_bucket_value(size_t bucket) {
+    if (bucket < STATS_SUB) {
+        return bucket;
+    }
+
+    int    shift = bucket / STATS_SUB - 1;
+    size_t sub   = bucket % STATS_SUB;
+    return ((uint64_t)(STATS_SUB + sub + 1) << shift) - 1;
+}
+
+/**
+ * Find the latency below which a fraction of requests completed.
+ *
+ * @param   buckets     Snapshot of histogram buckets.
+ * @param   count       Requests in snapshot.
+ * @param   max         Slowest request (no bound is reported above it).
+ * @param   fraction    Fraction of requests (0.5 for the median).
+ * @return  Upper bound of the latency (microseconds).
+ **/
+static uint64_t stats_percentile(const uint64_t *buckets, uint64_t count, uint64_t max, double fraction) {
+    uint64_t target = fraction * count + 0.5;
+    uint64_t seen   = 0;
+
+    if (target == 0) {
+        target = 1;
+    }
+
+    for (size_t bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+        seen += buckets[bucket];
+        if (seen >= target) {
+            uint64_t value = stats_bucket_value(bucket);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+
+/**
+ * Render one handler's latency summary as a JSON object.
+ **/
+static void stats_render_histogram(FILE *stream, StatsHistogram *histogram) {
+    uint64_t buckets[STATS_BUCKETS];
+    uint64_t count = 0;
+
+    for (size_t bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+        buckets[bucket] = __atomic_load_n(&histogram->buckets[bucket], __ATOMIC_RELAXED);
+        count += buckets[bucket];
+    }
+
+    uint64_t sum = __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+    fprintf(stream, "{\"count\": %llu, \"mean_us\": %llu, \"p50_us\": %llu, \"p99_us\": %llu, \"p999_us\": %llu, \"max_us\": %llu}",
+        (unsigned long long)count,
+        (unsigned long long)(count ? sum / count : 0),
+        (unsigned long long)(count ? stats_percentile(buckets, count, max, 0.5) : 0),
+        (unsigned long long)(count ? stats_percentile(buckets, count, max, 0.99) : 0),
+        (unsigned long long)(count ? stats_percentile(buckets, count, max, 0.999) : 0),
+        (unsigned long long)max);
+}
+
+/* Functions */
+
+/**
+ * Set up the statistics counters (before any worker exists).
+ *
+ * @return  Whether the counters could be shared (without that, each process
+ * counts only what it handles itself).
+ *
+ * The counters live in memory shared with the processes forked later, so
+ * that short-lived children in the forking mode, and every worker in the
+ * prefork mode, add to the same counters.
+ **/
+bool stats_init(void) {
+    StatsBlock *shared = mmap(NULL, sizeof(StatsBlock), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    Stats = shared == MAP_FAILED ? &StatsLocal : shared;
+    Stats->started = stats_now();
+    return shared != MAP_FAILED;
+}
+
+/**
+ * Count a connection opening (delta of 1) or closing (delta of -1).
+ *
+ * @param   delta       Change in the number of open connections.
+ **/
+void stats_connection(int delta) {
+    __atomic_add_fetch(&Stats->active, delta, __ATOMIC_RELAXED);
+}
+
+/**
+ * Count a cache lookup.
+ *
+ * @param   cache       Which cache was looked in.
+ * @param   hit         Whether the lookup was a hit.
+ **/
+void stats_cache(StatsCache cache, bool hit) {
+    __atomic_add_fetch(&Stats->caches[cache][hit], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Count a process started to run a script.
+ *
+ * @param   spawn       Kind of process started.
+ **/
+void stats_spawn(StatsSpawn spawn) {
+    __atomic_add_fetch(&Stats->spawns[spawn], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Count a completed request.
+ *
+ * @param   r           Request structure.
+ * @param   status      Status of the response.
+ * @param   record      Access journal record of the request (see journal_end).
+ *
+ * Requests that failed count as errors, whichever handler failed them;
+ * the rest count towards the handler of their file's kind.  The statistics
+ * page itself counts only towards the totals.
+ **/
+void stats_request(Request *r, Status status, const JournalRecord *record) {
+    uint64_t second = (stats_now() - Stats->started) / 1000000000;
+    StatsSecond *slot = &Stats->seconds[second % STATS_SECONDS];
+    uint64_t seen = __atomic_load_n(&slot->second, __ATOMIC_RELAXED);
+
+    stats_report();
+
+    if (seen != second && __atomic_compare_exchange_n(&slot->second, &seen, second, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&slot->count, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&slot->count, 1, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&Stats->requests, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&Stats->bytes, record->bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&Stats->statuses[status], 1, __ATOMIC_RELAXED);
+
+    StatsHandler handler;
+    if (status >= HTTP_STATUS_BAD_REQUEST) {
+        handler = STATS_ERROR;
+    } else if (!r->file) {
+        return;
+    } else if (r->file->kind == CACHE_DIRECTORY) {
+        handler = STATS_BROWSE;
+    } else if (r->file->kind == CACHE_EXECUTABLE) {
+        handler = STATS_CGI;
+    } else {
+        handler = STATS_FILE;
+    }
+
+    StatsHistogram *histogram = &Stats->handlers[handler];
+    uint64_t latency = record->latency;
+    uint64_t max     = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&histogram->buckets[stats_bucket(record->latency)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->sum, latency, __ATOMIC_RELAXED);
+    while (latency > max && !__atomic_compare_exchange_n(&histogram->max, &max, latency, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Render the statistics page.
+ *
+ * @param   length      Where to store the length of the page.
+ * @return  Newly allocated JSON document (free it), or NULL on failure.
+ *
+ * The request rate is taken over the last STATS_WINDOW complete seconds;
+ * latencies are in microseconds, and percentiles are the upper bound of
+ * the histogram bucket they fall in.
+ **/
+char * stats_render(size_t *length) {
+    char *page = NULL;
+    FILE *stream = open_memstream(&page, length);
+    if (!stream) {
+        return NULL;
+    }
+
+    uint64_t now    = (stats_now() - Stats->started) / 1000000000;
+    uint64_t window = now < STATS_WINDOW ? now : STATS_WINDOW;
+    uint64_t recent = 0;
+
+    for (size_t i = 0; i < STATS_SECONDS; i++) {
+        uint64_t second = __atomic_load_n(&Stats->seconds[i].second, __ATOMIC_RELAXED);
+        if (second < now && second + window >= now) {
+            recent += __atomic_load_n(&Stats->seconds[i].count, __ATOMIC_RELAXED);
+        }
+    }
+
+    fprintf(stream, "{\n");
+    fprintf(stream, "    \"uptime\": %llu,\n", (unsigned long long)now);
+    fprintf(stream, "    \"requests\": %llu,\n", (unsigned long long)__atomic_load_n(&Stats->requests, __ATOMIC_RELAXED));
+    fprintf(stream, "    \"requests_per_second\": %.1f,\n", window ? (double)recent / window : 0.0);
+    fprintf(stream, "    \"bytes_sent\": %llu,\n", (unsigned long long)__atomic_load_n(&Stats->bytes, __ATOMIC_RELAXED));
+    fprintf(stream, "    \"connections\": %lld,\n", (long long)__atomic_load_n(&Stats->active, __ATOMIC_RELAXED));
+
+    fprintf(stream, "    \"statuses\": {");
+    for (Status status = HTTP_STATUS_OK; status <= HTTP_STATUS_SERVICE_UNAVAILABLE; status++) {
+        fprintf(stream, "%s\"%.3s\": %llu", status ? ", " : "", http_status_string(status),
+            (unsigned long long)__atomic_load_n(&Stats->statuses[status], __ATOMIC_RELAXED));
+    }
+    fprintf(stream, "},\n");
+
+    fprintf(stream, "    \"caches\": {\n");
+    for (StatsCache cache = 0; cache < STATS_CACHES; cache++) {
+        uint64_t misses = __atomic_load_n(&Stats->caches[cache][false], __ATOMIC_RELAXED);
+        uint64_t hits   = __atomic_load_n(&Stats->caches[cache][true], __ATOMIC_RELAXED);
+        fprintf(stream, "        \"%s\": {\"hits\": %llu, \"misses\": %llu, \"hit_rate\": %.3f}%s\n",
+            StatsCacheNames[cache], (unsigned long long)hits, (unsigned long long)misses,
+            hits + misses ? (double)hits / (hits + misses) : 0.0, cache + 1 < STATS_CACHES ? "," : "");
+    }
+    fprintf(stream, "    },\n");
+
+    size_t running, queued, peak, shed, killed;
+    cgi_stats(&running, &queued, &peak, &shed, &killed);
+    fprintf(stream, "    \"cgi\": {\"running\": %zu, \"queued\": %zu, \"peak_queued\": %zu, \"shed\": %zu, \"killed\": %zu",
+        running, queued, peak, shed, killed);
+    for (StatsSpawn spawn = 0; spawn < STATS_SPAWNS; spawn++) {
+        fprintf(stream, ", \"%s_spawned\": %llu", StatsSpawnNames[spawn],
+            (unsigned long long)__atomic_load_n(&Stats->spawns[spawn], __ATOMIC_RELAXED));
+    }
+    fprintf(stream, "},\n");
+
+    fprintf(stream, "    \"latency\": {\n");
+    for (StatsHandler handler = 0; handler < STATS_HANDLERS; handler++) {
+        fprintf(stream, "        \"%s\": ", StatsHandlerNames[handler]);
+        stats_render_histogram(stream, &Stats->handlers[handler]);
+        fprintf(stream, "%s\n", handler + 1 < STATS_HANDLERS ? "," : "");
+    }
+    fprintf(stream, "    }\n");
+    fprintf(stream, "}\n");
+
+    if (fclose(stream) != 0) {
+        free(page);
+        return NULL;
+    }
+    return page;
+}
+
+/**
+ * Log the counters of every cache and subsystem whenever SIGUSR1 arrives.
+ *
+ * The report is written once the next request completes, outside of signal
+ * context, by the process (and counters) handling it.
+ **/
+void stats_watch(void) {
+    struct sigaction action = { .sa_handler = stats_signal_handler, .sa_flags = SA_RESTART };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,244 @@
+/* test_scan.c: Scan Kernel Equivalence Test */
+
+#include "spidey.h"
+
+#include <string.h>
+
+/* Constants */
+
+#define BUFFER_SIZE 256
+#define ITERATIONS  200000
+#define REQUESTS    20000
+#define REQUEST_MAX 8192
+
+/* Characters likely to appear around header delimiters */
+
+static const char Alphabet[] = " \t\r\n\v\f:;,=aZ0\x80\xff\x08\x0e\x1f!";
+
+/**
+ * Fill buffer with random characters, mostly drawn from Alphabet so that
+ * blank runs of every length show up.
+ *
+ * @param   buffer      Buffer to fill.
+ * @param   n           Number of bytes to fill.
+ **/
+static void fill_random(char *buffer, size_t n) {
+    size_t run = rand() % 4;
+
+    for (size_t i = 0; i < n; i++) {
+        if (rand() % 8 == 0) {
+            run = rand() % 4;
+        }
+        switch (run) {
+            case 0:  buffer[i] = rand() % 256; break;
+            case 1:  buffer[i] = " \t"[rand() % 2]; break;
+            case 2:  buffer[i] = " \t\r\n\v\f"[rand() % 6]; break;
+            default: buffer[i] = Alphabet[rand() % (sizeof(Alphabet) - 1)]; break;
+        }
+    }
+}
+
+/**
+ * Compare one kernel function against the scalar kernel.
+ **/
+#define CHECK(kernel, fn, s, n)                                                 \
+    do {                                                                        \
+        size_t expected = ScanKernels[0].fn(s, n);                              \
+        size_t actual   = (kernel)->fn(s, n);                                   \
+        if (expected != actual) {                                               \
+            fprintf(stderr, "%s.%s(offset=%zu, n=%zu): expected %zu, got %zu\n",\
+                    (kernel)->name, #fn, (size_t)((s) - buffer), n, expected, actual); \
+            return false;                                                       \
+        }                                                                       \
+    } while (0)
+
+/**
+ * Check kernel against the scalar kernel on random inputs at every
+ * alignment and length.
+ *
+ * @param   kernel      Scan kernel.
+ * @return  Whether or not all results matched.
+ **/
+static bool test_kernel(const ScanKernel *kernel) {
+    char buffer[BUFFER_SIZE + 64];
+
+    for (size_t iteration = 0; iteration < ITERATIONS; iteration++) {
+        size_t offset = rand() % 64;
+        size_t n      = rand() % BUFFER_SIZE;
+        char  *s      = buffer + offset;
+
+        fill_random(buffer, sizeof(buffer));
+        CHECK(kernel, blank,    s, n);
+        CHECK(kernel, nonblank, s, n);
+    }
+
+    /* Every single byte value at every position of a 64 byte window */
+    for (int c = 0; c < 256; c++) {
+        for (size_t position = 0; position < 64; position++) {
+            memset(buffer, 'x', 64);
+            buffer[position] = c;
+            char *s = buffer;
+            size_t n = 64;
+            CHECK(kernel, blank, s, n);
+            memset(buffer, ' ', 64);
+            buffer[position] = c;
+            CHECK(kernel, nonblank, s, n);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Append a random run of blanks (often longer than the parser scans inline).
+ **/
+static size_t fill_blanks(char *s) {
+    size_t n = rand() % 4 ? 1 + rand() % 3 : rand() % 48;
+
+    for (size_t i = 0; i < n; i++) {
+        s[i] = " \t"[rand() % 2];
+    }
+    return n;
+}
+
+/**
+ * Append a random token of up to max characters (with the odd blank).
+ **/
+static size_t fill_token(char *s, size_t max) {
+    static const char Token[] = "abcXYZ019/?&=%-._~+:;";
+    size_t n = rand() % (max + 1);
+
+    for (size_t i = 0; i < n; i++) {
+        s[i] = rand() % 64 ? Token[rand() % (sizeof(Token) - 1)] : " \t"[rand() % 2];
+    }
+    return n;
+}
+
+/**
+ * Build a random request head: long and short request lines and headers,
+ * runs of blanks of every length, and the occasional malformed line.
+ *
+ * @param   request     Buffer of at least REQUEST_MAX bytes.
+ * @return  Length of the request.
+ **/
+static size_t fill_request(char *request) {
+    size_t n = 0;
+
+    if (rand() % 8 == 0) {
+        n += sprintf(request + n, "\r\n");
+    }
+    n += fill_token(request + n, rand() % 4 ? 8 : 40);
+    n += fill_blanks(request + n);
+    n += fill_token(request + n, rand() % 2 ? 32 : 600);
+    n += fill_blanks(request + n);
+    n += sprintf(request + n, "HTTP/1.%d", rand() % 2);
+    if (rand() % 8 == 0) {
+        n += fill_blanks(request + n);
+    }
+    n += sprintf(request + n, "\r\n");
+
+    for (int headers = rand() % 12; headers > 0; headers--) {
+        n += fill_token(request + n, 24);
+        if (rand() % 4 == 0) {
+            n += fill_blanks(request + n);
+        }
+        if (rand() % 16) {
+            request[n++] = ':';
+        }
+        n += fill_blanks(request + n);
+        n += fill_token(request + n, rand() % 2 ? 32 : 200);
+        if (rand() % 4 == 0) {
+            n += fill_blanks(request + n);
+        }
+        n += sprintf(request + n, rand() % 4 ? "\r\n" : "\n");
+    }
+
+    if (rand() % 8) {
+        n += sprintf(request + n, "\r\n");
+    }
+    return n;
+}
+
+/**
+ * Parse a request as it arrives in reads of random sizes.
+ *
+ * @param   p           Parser structure.
+ * @param   request     Request to parse.
+ * @param   length      Length of the request.
+ * @param   seed        Seed for the read sizes (the same for every kernel).
+ * @return  Final result of parser_parse.
+ **/
+static int parse_request_in_pieces(Parser *p, const char *request, size_t length, unsigned seed) {
+    size_t arrived = 0;
+    int    status  = PARSE_INCOMPLETE;
+
+    memset(p, 0, sizeof(*p));
+    parser_init(p);
+    while (status == PARSE_INCOMPLETE && arrived < length) {
+        arrived += 1 + rand_r(&seed) % 256;
+        status   = parser_parse(p, request, arrived < length ? arrived : length);
+    }
+    return status;
+}
+
+static bool slice_equal(Slice a, Slice b) {
+    return a.offset == b.offset && a.length == b.length;
+}
+
+/**
+ * Check that requests parse the same with kernel as with the scalar kernel.
+ *
+ * @param   kernel      Scan kernel.
+ * @return  Whether or not all results matched.
+ **/
+static bool test_parser(const ScanKernel *kernel) {
+    static char request[REQUEST_MAX];
+    static Parser expected, actual;
+
+    for (size_t iteration = 0; iteration < REQUESTS; iteration++) {
+        size_t   length = fill_request(request);
+        unsigned seed   = rand();
+
+        Scan = &ScanKernels[0];
+        int status = parse_request_in_pieces(&expected, request, length, seed);
+        Scan = kernel;
+        bool same  = parse_request_in_pieces(&actual, request, length, seed) == status &&
+            expected.state == actual.state && expected.length == actual.length &&
+            slice_equal(expected.method, actual.method) && slice_equal(expected.uri, actual.uri) &&
+            slice_equal(expected.query, actual.query) && slice_equal(expected.version, actual.version) &&
+            expected.nheaders == actual.nheaders;
+
+        for (size_t i = 0; same && i < expected.nheaders; i++) {
+            same = slice_equal(expected.names[i], actual.names[i]) && slice_equal(expected.values[i], actual.values[i]);
+        }
+        if (!same) {
+            fprintf(stderr, "%s: request %zu parsed differently: %.*s\n", kernel->name, iteration, (int)length, request);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    const ScanKernel *selected = Scan;
+    int status = EXIT_SUCCESS;
+
+    srand(argc > 1 ? strtoul(argv[1], NULL, 10) : 0x5CA17);
+
+    for (const ScanKernel *k = ScanKernels; k->name; k++) {
+        if (!scan_supported(k)) {
+            printf("%-8s ... Skipped\n", k->name);
+            continue;
+        }
+        bool passed = test_kernel(k) && test_parser(k);
+        printf("%-8s ... %s%s\n", k->name, passed ? "Success" : "Failure", k == selected ? " (selected)" : "");
+        if (!passed) {
+            status = EXIT_FAILURE;
+        }
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,174 @@
+/* threaded.c: Thread Pool HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define THREADED_QUEUE_SIZE 1024
+
+/* Shard Workers */
+
+typedef struct {
+    int     sfd;                        /*< Server socket of worker's shard */
+    int     cpu;                        /*< CPU worker is pinned to */
+} Shard;
+
+/**
+ * Accept and handle requests on a shard's own server socket forever.
+ *
+ * @param   arg         Shard structure.
+ * @return  Never returns.
+ **/
+static void * threaded_shard_worker(void *arg) {
+    Shard *shard = arg;
+
+    socket_pin_cpu(shard->cpu);
+
+    while (true) {
+        Connection *c = accept_connection(shard->sfd);
+        if (!c) {
+            continue;
+        }
+
+        handle_connection(c);
+        free_connection(c);
+    }
+
+    return NULL;
+}
+
+/**
+ * Handle HTTP requests with one pinned thread per SO_REUSEPORT socket.
+ *
+ * @param   sfd         Server socket file descriptor (shard 0).
+ * @param   nworkers    Number of worker threads.
+ * @return  Exit status of server (EXIT_SUCCESS or EXIT_FAILURE).
+ *
+ * Each worker accepts from its own socket, so there is neither a shared
+ * accept queue nor a hand-off queue; the calling thread runs shard 0.
+ **/
+static int threaded_sharded_server(int sfd, size_t nworkers) {
+    int *sfds = socket_shards(sfd, nworkers);
+    if (!sfds) {
+        log("Unable to open shard sockets: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    Shard *shards = calloc(nworkers, sizeof(Shard));
+    if (!shards) {
+        log("Unable to allocate shards: %s", strerror(errno));
+        free(sfds);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < nworkers; i++) {
+        shards[i].sfd = sfds[i];
+        shards[i].cpu = socket_shard_cpu(i);
+        log("Shard %2zu: fd %d -> CPU %d", i, shards[i].sfd, shards[i].cpu);
+    }
+    free(sfds);
+
+    for (size_t i = 1; i < nworkers; i++) {
+        pthread_t thread;
+        int status = pthread_create(&thread, NULL, threaded_shard_worker, &shards[i]);
+        if (status != 0) {
+            log("Unable to create worker thread: %s", strerror(status));
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    log("Started %zu sharded worker threads", nworkers);
+
+    threaded_shard_worker(&shards[0]);
+
+    free(shards);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Handle connections taken from the accepted-connection queue forever.
+ *
+ * @param   arg         Queue of accepted Connection structures.
+ * @return  Never returns.
+ **/
+static void * threaded_worker(void *arg) {
+    Queue *q = arg;
+
+    while (true) {
+        Connection *c = queue_pop(q);
+
+        handle_connection(c);
+        free_connection(c);
+    }
+
+    return NULL;
+}
+
+/**
+ * Handle HTTP requests with a pool of worker threads.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @param   nworkers    Number of worker threads.
+ * @return  Exit status of server (EXIT_SUCCESS or EXIT_FAILURE).
+ *
+ * The calling thread becomes the acceptor: it accepts connections and pushes
+ * them onto a bounded lock-free queue that the workers drain.  A worker stays
+ * with a connection for as long as it is kept alive.  When the queue
+ * is full the acceptor stops accepting, leaving further clients in the
+ * kernel's listen backlog.
+ *
+ * When Sharded, the queue is replaced by per-thread SO_REUSEPORT sockets.
+ **/
+int threaded_server(int sfd, size_t nworkers) {
+    if (Sharded) {
+        return threaded_sharded_server(sfd, nworkers);
+    }
+
+    /* Allocate accepted-connection queue */
+
+    Queue *q = queue_create(THREADED_QUEUE_SIZE);
+    if (!q) {
+        log("Unable to allocate connection queue: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* Start worker threads */
+
+    for (size_t i = 0; i < nworkers; i++) {
+        pthread_t thread;
+        int status = pthread_create(&thread, NULL, threaded_worker, q);
+        if (status != 0) {
+            log("Unable to create worker thread: %s", strerror(status));
+            if (i == 0) {
+                queue_delete(q);
+                return EXIT_FAILURE;
+            }
+            break;
+        }
+        pthread_detach(thread);
+    }
+    log("Started %zu worker threads", nworkers);
+
+    /* Accept connections and hand them to the workers */
+    while (true) {
+        Connection *c = accept_connection(sfd);
+        if (!c) {
+            continue;
+        }
+
+        queue_push(q, c);
+    }
+
+    /* Close server socket */
+    close(sfd);
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
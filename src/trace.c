@@ -0,0 +1,140 @@
+/* trace.c: Request Tracing (built with make TRACE=1) */
+
+#include "spidey.h"
+
+#ifdef TRACE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define TRACE_BUFFER    (64 << 10)      /* Bytes of events kept per thread */
+#define TRACE_EVENT     256             /* Longest formatted event */
+
+/* Globals */
+
+static int TraceFd = -1;
+
+static __thread char   TraceBuffer[TRACE_BUFFER];  /* Events not yet written */
+static __thread size_t TraceUsed  = 0;
+static __thread size_t TraceDepth = 0;              /* Spans open on this thread */
+static __thread pid_t  TracePid   = 0;              /* Cached ids (0 = look up) */
+static __thread pid_t  TraceTid   = 0;
+
+/* Internal Functions */
+
+static inline uint64_t trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Write this thread's events out (one write(2), appended to the file).
+ **/
+static void trace_flush(void) {
+    size_t written = 0;
+
+    while (written < TraceUsed) {
+        ssize_t nwritten = write(TraceFd, TraceBuffer + written, TraceUsed - written);
+        if (nwritten < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nwritten <= 0) {
+            debug("Unable to write trace: %s", strerror(errno));
+            break;
+        }
+        written += nwritten;
+    }
+    TraceUsed = 0;
+}
+
+/**
+ * Forget the ids (and the events) the parent left behind in a forked child.
+ **/
+static void trace_fork_child(void) {
+    TracePid  = 0;
+    TraceTid  = 0;
+    TraceUsed = 0;
+}
+
+/* Functions */
+
+/**
+ * Start the trace file.
+ *
+ * @param   path        Path to write trace events to (truncated first).
+ * @return  Whether the file could be opened.
+ *
+ * Events are written in the JSON Array Format of the Trace Event Format
+ * (which chrome://tracing and Perfetto load as is, without the closing
+ * bracket), appended by every worker process and thread as they go.
+ **/
+bool trace_open(const char *path) {
+    TraceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (TraceFd < 0) {
+        return false;
+    }
+
+    pthread_atfork(NULL, NULL, trace_fork_child);
+    return write(TraceFd, "[\n", 2) == 2;
+}
+
+/**
+ * Open a span.
+ *
+ * @param   name        Name of phase (a string literal).
+ * @return  Span to close with trace_end.
+ **/
+TraceSpan trace_begin(const char *name) {
+    TraceDepth++;
+    return (TraceSpan){ name, trace_now() };
+}
+
+/**
+ * Close a span, recording it as a complete ("X") event.
+ *
+ * @param   span        Span opened with trace_begin.
+ *
+ * Events are buffered per thread and written once the outermost span on the
+ * thread closes (typically once per request), or when the buffer fills.
+ **/
+void trace_end(TraceSpan *span) {
+    uint64_t end = trace_now();
+
+    if (TraceFd < 0) {
+        TraceDepth--;
+        return;
+    }
+
+    if (!TracePid) {
+        TracePid = getpid();
+        TraceTid = syscall(SYS_gettid);
+    }
+
+    if (TraceUsed > TRACE_BUFFER - TRACE_EVENT) {
+        trace_flush();
+    }
+
+    int length = snprintf(TraceBuffer + TraceUsed, TRACE_EVENT,
+        "{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d},\n",
+        span->name, span->start / 1e3, (end - span->start) / 1e3, TracePid, TraceTid);
+    if (length > 0 && length < TRACE_EVENT) {
+        TraceUsed += length;
+    }
+
+    if (--TraceDepth == 0) {
+        trace_flush();
+    }
+}
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
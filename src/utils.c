@@ -13,89 +13,41 @@
  * Determine mime-type from file extension.
  *
  * @param   path        Path to file.
- * @return  An allocated string containing the mime-type of the specified file.
+ * @return  The mime-type of the specified file.
  *
- * This function first finds the file's extension and then scans the contents
- * of the MimeTypesPath file to determine which mimetype the file has.
- *
- * The MimeTypesPath file (typically /etc/mime.types) consists of rules in the
- * following format:
- *
- *  <MIMETYPE>      <EXT1> <EXT2> ...
- *
- * This function simply checks the file extension version each extension for
- * each mimetype and returns the mimetype on the first match.
+ * This function finds the file's extension (after the last . in the file's
+ * name) and looks it up in the mime-type table loaded from MimeTypesPath
+ * (see mime_load), first picking up any reload requested with SIGHUP.
  *
  * If no extension exists or no matching mimetype is found, then return
  * DefaultMimeType.
  *
- * This function returns an allocated string that must be free'd.
+ * The returned string is borrowed and must not be free'd.
  **/
-char * determine_mimetype(const char *path) { // r->path
-    char *ext;
-    char *mimetype;
-    char *token;
-    char buffer[BUFSIZ] = {0};
-    FILE *fs = NULL;
+const char * determine_mimetype(const char *path) {
+    const char *name = strrchr(path, '/');
+    const char *ext  = strrchr(name ? name : path, '.');
+    const char *mimetype;
+
+    mime_reload();
 
     /* Find file extension */
 
-    ext = strchr(path, '.');
     if(!ext){
         debug("Unable to find file extension");
-        return strdup(DefaultMimeType);
+        return DefaultMimeType;
     }
 
     debug("Extension is: %s", ext);
 
-    fs = fopen(MimeTypesPath, "r");
-    if(!fs){
-        debug("Unable to open MimeTypesPath: %s", strerror(errno));
-        return strdup(DefaultMimeType);
-    }
-
-
-    ext++; // move extension past . if exists
-
-    while(fgets(buffer, BUFSIZ, fs)){
-
-        if(buffer == NULL || buffer[0] == '#' || strlen(buffer) < 2) continue;
-
-        mimetype = strtok(buffer, WHITESPACE);
-
-        if(!mimetype) continue;
-
-        token = strtok(NULL, "\n");
-
-        if(!token) continue;
-
-        token = skip_whitespace(token);
-        token = strtok(token, WHITESPACE);
-
-        if(!token) continue;
-
-        if(streq(token, ext)){
-            fclose(fs);
-            return strdup(mimetype);
-        }
-
-        while((token = strtok(NULL, WHITESPACE))){
-            
-            if(streq(token, ext)){
-                fclose(fs);
-                return strdup(mimetype);
-            }
-
-        }
-    }
-
-    fclose(fs);
-    return strdup(DefaultMimeType);
+    mimetype = mime_lookup(ext + 1);
+    return mimetype ? mimetype : DefaultMimeType;
 }
 
 /**
  * Determine actual filesystem path based on RootPath and URI.
  *
+ * @param   arena       Arena to allocate the result from.
  * @param   uri         Resource path of URI.
  * @return  An allocated string containing the full path of the resource on the
  * local filesystem.
@@ -106,10 +58,11 @@ char * determine_mimetype(const char *path) { // r->path
  * As a security check, if the real path does not begin with the RootPath, then
  * return NULL.
  *
- * Otherwise, return a newly allocated string containing the real path.  This
- * string must later be free'd.
+ * Otherwise, return a string allocated from the arena containing the real
+ * path.  It is released with the rest of the arena.
  **/
-char * determine_request_path(const char *uri) {
+char * determine_request_path(Arena *arena, const char *uri) {
+    trace_scope("determine_request_path");
 
     char buffer[BUFSIZ];
     char path[BUFSIZ];
@@ -120,9 +73,11 @@ char * determine_request_path(const char *uri) {
         return NULL;
     }
 
-    realpath(buffer, path);
+    trace_start(resolve, "realpath");
+    char *resolved = realpath(buffer, path);
+    trace_stop(resolve);
 
-    if(path == NULL){
+    if(!resolved){
         debug("Path is null");
         return NULL;
     }
@@ -134,7 +89,7 @@ char * determine_request_path(const char *uri) {
         return NULL;
     }
 
-    return strdup(path);
+    return arena_strdup(arena, path);
 }
 
 /**
@@ -148,9 +103,13 @@ char * determine_request_path(const char *uri) {
 const char * http_status_string(Status status) {
     static char *StatusStrings[] = {
         "200 OK",
+        "206 Partial Content",
+        "304 Not Modified",
         "400 Bad Request",
         "404 Not Found",
+        "416 Range Not Satisfiable",
         "500 Internal Server Error",
+        "503 Service Unavailable",
         "418 I'm A Teapot",
     };
 
@@ -160,19 +119,51 @@ const char * http_status_string(Status status) {
         return NULL;
 }
 
+/**
+ * Hash bytes with FNV-1a.
+ *
+ * @param   data        Bytes to hash.
+ * @param   length      Number of bytes.
+ * @return  Hash of the bytes (for the caches' hash tables).
+ **/
+size_t hash_bytes(const void *data, size_t length) {
+    const unsigned char *s = data;
+    size_t hash = 14695981039346656037ULL;
+
+    while (length--) {
+        hash ^= *s++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Hash a string with FNV-1a.
+ *
+ * @param   s           String.
+ * @return  Hash of the string (the same as hash_bytes over its characters).
+ **/
+size_t hash_string(const char *s) {
+    size_t hash = 14695981039346656037ULL;
+
+    while (*s) {
+        hash ^= (unsigned char)*s++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
 /**
  * Advance string pointer pass all nonwhitespace characters
  *
  * @param   s           String.
- * @return  Point to first whitespace character in s.
+ * @return  Point to first whitespace character in s (or its terminating NUL).
  **/
 char * skip_nonwhitespace(char *s) {
-    char* start = s;
+    while (*s && !isspace((unsigned char)*s))
+        s++;
 
-    while(start && !isspace(*start))
-        start++;
-
-    return start;
+    return s;
 }
 
 /**
@@ -182,12 +173,10 @@ char * skip_nonwhitespace(char *s) {
  * @return  Point to first non-whitespace character in s.
  **/
 char * skip_whitespace(char *s) {
-    char* start = s;
-
-    while(start && isspace(*start))
-        start++;
+    while (isspace((unsigned char)*s))
+        s++;
 
-    return start;
+    return s;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,16 @@
+#!/bin/sh
+
+# Sleep for the number of seconds in the query (1 by default) before answering
+
+case "$QUERY_STRING" in
+    ''|*[!0-9]*)    DELAY=1;;
+    *)		    DELAY=$QUERY_STRING;;
+esac
+
+sleep $DELAY
+
+echo "HTTP/1.0 200 OK"
+echo "Content-type: text/plain"
+echo
+
+echo "Slept $DELAY"